@@ -16,6 +16,21 @@
  *   --configuration <arg>     Use this file for configuration
  *   --port <arg>       Set a differnt port           
  *   --user <arg>       Choose a user to start as     
+ *   --workers <arg>    Serve from this many processes
+ *   --pin              Pin each worker process to a CPU
+ *   --listen <arg>     Listen on [http://|https://][address:]port
+ * 
+ * --listen can be given more than once, e.g. '--listen 80 --listen
+ * https://443 --listen https://[::]:443' serves plain HTTP and HTTPS
+ * over IPv4 and IPv6 from one process.  Every listener shares the same
+ * configuration, Lua states and caches.  Without --listen, the server
+ * listens on --port using --protocol.
+ * 
+ * With --workers, the process that starts becomes a master.  It forks
+ * the workers, each of which binds its own SO_REUSEPORT listener and runs
+ * the chosen model, then restarts any worker that dies and passes
+ * SIGINT, SIGTERM and SIGHUP along to them.  Caches are kept per
+ * worker, and sessions are shared through the session database.
  * 
  * LICENSE
  * -------
@@ -28,6 +43,7 @@
  * - 
  *  
  * -------------------------------------------------------- */
+#define _GNU_SOURCE
 #include <zwalker.h>
 #include <ztable.h>
 #include <dlfcn.h>
@@ -41,24 +57,29 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sched.h>
 #include <pwd.h>
 #include <pthread.h>
 #include "../config.h"
 #include "../logging/log.h"
 #include "../server/server.h"
-#if 0
 #include "../filters/filter-static.h"
+#if 0
 #include "../filters/filter-dirent.h"
 #include "../filters/filter-redirect.h"
 #endif
 #include "../filters/filter-echo.h"
 #include "../filters/filter-lua.h"
+#include "../lua/session.h"
 #include "../ctx/ctx-http.h"
 #include "cliutils.h"
 
 // New server types
 #include "../server/multithread.h"
 #include "../server/single.h"
+#include "../server/event.h"
 
 
 #ifndef DISABLE_TLS
@@ -92,6 +113,13 @@
 	"-x, --dump                Dump configuration at startup\n" \
 	"-l, --log-file <arg>      Define an alternate log file location\n" \
 	"-a, --access-file <arg>   Define an alternate access file location\n" \
+	"    --model=<arg>         Choose a server model (oneshot, threaded, event)\n" \
+	"    --threads <arg>       Number of workers for the event model\n" \
+	"    --keepalive <arg>     Requests allowed per connection (0 disables)\n" \
+	"    --idle-timeout <arg>  Seconds an idle connection is kept open\n" \
+	"    --workers <arg>       Serve from this many processes (0 for one per CPU)\n" \
+	"    --pin                 Pin each worker process to a CPU\n" \
+	"    --listen <arg>        Listen on [http://|https://][address:]port (repeatable)\n" \
 	"-V, --version             Show version information and quit.\n" \
 	"-h, --help                Show the help menu.\n"
 
@@ -126,9 +154,14 @@ int procpid = 0;
 
 int fdset[ 10 ] = { -1 };
 
+pid_t workers[ MAX_WORKERS ] = { 0 };
+
+volatile sig_atomic_t stopping = 0;
+
 typedef enum model_t {
 	SERVER_ONESHOT = 0,
 	SERVER_MULTITHREAD,
+	SERVER_EVENT,
 } model_t;
 
 
@@ -140,6 +173,15 @@ typedef enum userprotocol_t {
 
 
 
+// Where and how a server listens for connections
+struct listener {
+	userprotocol_t protocol;
+	int port;
+	char address[ INET6_ADDRSTRLEN ];
+};
+
+
+
 struct values {
 	int port;
 	pid_t pid;
@@ -158,6 +200,13 @@ struct values {
 	model_t model;
 	userprotocol_t userprotocol;
 	short int maxper;
+	short int threads;
+	int kmax;
+	int ktimeout;
+	int workers;
+	int pin;
+	int lcount;
+	struct listener listeners[ SERVER_MAX_LISTENERS ];
 #ifdef DEBUG_H
 	int tapout;
 #endif
@@ -173,6 +222,12 @@ struct values {
 ,	.model = SERVER_MULTITHREAD
 ,	.userprotocol = UP_HTTP
 ,	.maxper = 0
+,	.threads = 0
+,	.kmax = KEEPALIVE_MAX_REQUESTS
+,	.ktimeout = KEEPALIVE_TIMEOUT
+,	.workers = 0
+,	.pin = 0
+,	.lcount = 0
 #ifdef DEBUG_H
 ,	.tapout = 32
 #endif
@@ -182,12 +237,12 @@ struct values {
 
 filter_t http_filters[] = { 
 #if 0
-	{ "static", filter_static }
-,	{ "dirent", filter_dirent }
+	{ "dirent", filter_dirent }
 ,	{ "redirect", filter_redirect }
 #endif
   { "lua", filter_lua }
 , { "echo", filter_echo }
+, { "static", filter_static }
 , { NULL }
 #if 0
 , { NULL }
@@ -362,6 +417,31 @@ void sigkill( int signum ) {
 
 
 
+// Pass a signal along to every worker
+void sigforward( int signum ) {
+	//SIGHUP only restarts the workers, the others stop them for good
+	if ( signum != SIGHUP ) {
+		stopping = 1;
+		alarm( WORKER_STOP_TIMEOUT );
+	}
+
+	for ( int i = 0; i < MAX_WORKERS; i++ ) {
+		( workers[ i ] > 0 ) ? kill( workers[ i ], signum ) : 0;
+	}
+}
+
+
+
+// Kill whatever workers did not stop in time
+void sigstop( int signum ) {
+	for ( int i = 0; i < MAX_WORKERS; i++ ) {
+		( workers[ i ] > 0 ) ? kill( workers[ i ], SIGKILL ) : 0;
+	}
+}
+
+
+
+
 
 
 // Use the command line to kill a running server
@@ -434,19 +514,372 @@ int cmd_kill ( struct values *v, char *err, int errlen ) {
 
 
 
+// Parse a whole number from 0 to max, returning -1 if the argument isn't one
+static int parse_count ( const char *arg, int max ) {
+	int len = strlen( arg ), n = 0;
+
+	// safeatoi copies into a fixed buffer and reads junk as 0, so check first
+	if ( !len || len > 5 || strspn( arg, "0123456789" ) != len ) {
+		return -1;
+	}
+
+	return ( ( n = safeatoi( arg ) ) > max ) ? -1 : n;
+}
+
+
+
+// Parse a listener in the form [http://|https://][address:]port
+int parse_listener ( const char *arg, struct listener *l ) {
+	const char *port = arg;
+	int alen = 0;
+
+	l->protocol = UP_HTTP;
+	if ( !strncmp( arg, "http://", 7 ) )
+		arg += 7, port = arg;
+	else if ( !strncmp( arg, "https://", 8 ) ) {
+		l->protocol = UP_HTTPS, arg += 8, port = arg;
+	}
+
+	//IPv6 addresses are wrapped in brackets to keep them apart from the port
+	if ( *arg == '[' ) {
+		const char *end = strchr( arg, ']' );
+		if ( !end || end[ 1 ] != ':' ) {
+			return 0;
+		}
+		alen = end - arg - 1, arg++, port = end + 2;
+	}
+	else if ( strchr( arg, ':' ) ) {
+		port = strrchr( arg, ':' ) + 1;
+		alen = port - arg - 1;
+	}
+
+	if ( alen >= sizeof( l->address ) || strlen( port ) > 5 ) {
+		return 0;
+	}
+
+	if ( ( l->port = safeatoi( port ) ) < 1 || l->port > 65535 ) {
+		return 0;
+	}
+
+	memcpy( l->address, arg, alen );
+	l->address[ alen ] = '\0';
+	return 1;
+}
+
+
+
+// Open a TCP socket listening on a listener's address and port
+int open_listener ( server_t *p, const struct listener *l, int reuseport, char *err, int errlen ) {
+	struct sockaddr_storage sa = { 0 };
+	struct sockaddr_in *si = (struct sockaddr_in *)&sa;
+	struct sockaddr_in6 *si6 = (struct sockaddr_in6 *)&sa;
+	int fd = -1, on = 1, flags = 0, family = strchr( l->address, ':' ) ? AF_INET6 : AF_INET;
+	socklen_t salen = sizeof( struct sockaddr_in );
+
+	//No address means every address
+	if ( family == AF_INET6 ) {
+		si6->sin6_family = AF_INET6;
+		si6->sin6_port = htons( l->port );
+		salen = sizeof( struct sockaddr_in6 );
+		if ( inet_pton( AF_INET6, l->address, &si6->sin6_addr ) != 1 ) {
+			snprintf( err, errlen, "Invalid IPv6 address '%s'\n", l->address );
+			fprintf( logfd, "%s", err );
+			return -1;
+		}
+	}
+	else {
+		si->sin_family = AF_INET; 
+		si->sin_port = htons( l->port );
+		si->sin_addr.s_addr = htonl( INADDR_ANY );
+		if ( *l->address && inet_pton( AF_INET, l->address, &si->sin_addr ) != 1 ) {
+			snprintf( err, errlen, "Invalid IPv4 address '%s'\n", l->address );
+			fprintf( logfd, "%s", err );
+			return -1;
+		}
+	}
+
+	if ( ( fd = socket( family, SOCK_STREAM, IPPROTO_TCP ) ) == -1 ) {
+		snprintf( err, errlen, "Couldn't open socket! Error: %s\n", strerror( errno ) );
+		fprintf( logfd, "%s", err );
+		return -1;
+	}
+
+	if ( setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on) ) == -1 ) {
+		snprintf( err, errlen, "Couldn't set socket to reusable! Error: %s\n", strerror( errno ) );
+		fprintf( logfd, "%s", err );
+		close( fd );
+		return -1;
+	}
+
+	//Each worker binds the same port, and the kernel spreads new connections across them
+	if ( reuseport && setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on) ) == -1 ) {
+		snprintf( err, errlen, "Couldn't set socket port to reusable! Error: %s\n", strerror( errno ) );
+		fprintf( logfd, "%s", err );
+		close( fd );
+		return -1;
+	}
+
+	//Keep IPv6 listeners to IPv6 so that an IPv4 listener can share the port
+	if ( family == AF_INET6 && setsockopt( fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&on, sizeof(on) ) == -1 ) {
+		snprintf( err, errlen, "Couldn't set socket to IPv6 only! Error: %s\n", strerror( errno ) );
+		fprintf( logfd, "%s", err );
+		close( fd );
+		return -1;
+	}
+
+	//A listener that went dry between poll() and accept() must not block the worker
+	if ( ( flags = fcntl( fd, F_GETFL ) ) == -1 || fcntl( fd, F_SETFL, flags | O_NONBLOCK ) == -1 ) {
+		snprintf( err, errlen, "fcntl error: %s\n", strerror(errno) ); 
+		fprintf( logfd, "%s", err );
+		close( fd );
+		return -1;
+	}
+
+	if ( bind( fd, (struct sockaddr *)&sa, salen ) == -1 ) {
+		snprintf( err, errlen, "Couldn't bind socket to address! Error: %s\n", strerror( errno ) );
+		fprintf( logfd, "%s", err );
+		close( fd );
+		return -1;
+	}
+
+	if ( listen( fd, p->backlog ) == -1 ) {
+		snprintf( err, errlen, "Couldn't listen for connections! Error: %s\n", strerror( errno ) );
+		fprintf( logfd, "%s", err );
+		close( fd );
+		return -1;
+	}
+
+	return fd;
+}
+
+
+
+// Close the listeners opened so far
+void close_listeners ( server_t *p ) {
+	for ( server_t *s = p; s && s->fd > -1; s = s->next ) {
+		if ( close( s->fd ) == -1 ) {
+			FPRINTF( "FAILURE: Couldn't close parent socket. Error: %s\n", strerror( errno ) );
+		}
+		s->fd = -1;
+	}
+}
+
+
+
+// Free what each protocol set up, once per protocol
+void free_protocols ( server_t *servers, int count ) {
+	for ( int i = 0, j = 0; i < count; i++ ) {
+		for ( j = 0; j < i && servers[ j ].ctx != servers[ i ].ctx; j++ );
+		( j == i ) ? servers[ i ].ctx->free( &servers[ i ] ) : 0;
+	}
+}
+
+
+
+// Open the listeners and serve from them until the chosen model stops
+int run_worker ( struct values *v, server_t *p, int cpu, char *err, int errlen ) {
+	struct listener *l = v->listeners;
+	int i = 0;
+
+	//Stay on one CPU if asked to
+	if ( cpu > -1 ) {
+		cpu_set_t set;
+		CPU_ZERO( &set );
+		CPU_SET( cpu, &set );
+		if ( sched_setaffinity( 0, sizeof( set ), &set ) == -1 ) {
+			snprintf( err, errlen, "Couldn't pin worker to CPU %d: %s\n", cpu, strerror( errno ) );
+			fprintf( logfd, "%s", err );
+			return 0;
+		}
+	}
+
+	for ( server_t *s = p; s; s = s->next, l++, i++ ) {
+		if ( ( fdset[ i ] = s->fd = open_listener( s, l, v->workers > 0, err, errlen ) ) == -1 ) {
+			close_listeners( p );
+			return 0;
+		}
+	}
+
+	//todo: uSing threads may make this easier... https://www.geeksforgeeks.org/zombie-processes-prevention/
+	if ( signal( SIGCHLD, SIG_IGN ) == SIG_ERR ) {
+		snprintf( err, errlen, "Failed to set SIGCHLD\n" );
+		fprintf( logfd, "%s", err );
+		close_listeners( p );
+		return 0;
+	}
+
+	// Evaluate server mode
+	if ( v->model == SERVER_ONESHOT )
+		srv_single( p );
+	else if ( v->model == SERVER_MULTITHREAD ) {
+		srv_multithread( p );
+	}
+	else if ( v->model == SERVER_EVENT ) {
+		srv_event( p );
+	}
+
+	close_listeners( p );
+	return 1;
+}
+
+
+
+// Fork a worker into slot i
+int start_worker ( struct values *v, server_t *p, int i, int cpu, char *err, int errlen ) {
+	sigset_t block, prev;
+	pid_t pid = 0;
+
+	//Hold signals until the new worker can be found in the table
+	sigemptyset( &block );
+	sigaddset( &block, SIGINT );
+	sigaddset( &block, SIGTERM );
+	sigaddset( &block, SIGHUP );
+	sigprocmask( SIG_BLOCK, &block, &prev );
+	fflush( NULL );
+
+	if ( ( pid = fork() ) == -1 ) {
+		sigprocmask( SIG_SETMASK, &prev, NULL );
+		snprintf( err, errlen, "Couldn't start worker %d: %s\n", i, strerror( errno ) );
+		fprintf( logfd, "%s", err );
+		return 0;
+	}
+
+	if ( pid == 0 ) {
+		//Workers go when the master does
+		prctl( PR_SET_PDEATHSIG, SIGTERM );
+		if ( getppid() != v->pid ) {
+			exit( 1 );
+		}
+
+		signal( SIGINT, sigkill );
+		signal( SIGTERM, SIG_DFL );
+		signal( SIGHUP, SIG_DFL );
+		signal( SIGALRM, SIG_DFL );
+		sigprocmask( SIG_SETMASK, &prev, NULL );
+		exit( run_worker( v, p, cpu, err, errlen ) ? 0 : 1 );
+	}
+
+	workers[ i ] = pid;
+	sigprocmask( SIG_SETMASK, &prev, NULL );
+	return 1;
+}
+
+
+
+// Start the workers, then restart any that die until told to stop
+int run_master ( struct values *v, server_t *p, char *err, int errlen ) {
+	struct sigaction sa;
+	cpu_set_t set;
+	int fd = -1, ok = 1, ncpus = 0, cpus[ CPU_SETSIZE ];
+
+	//Make sure every listener can be bound before starting anything
+	for ( int i = 0; i < v->lcount; i++ ) {
+		if ( ( fd = open_listener( p, &v->listeners[ i ], 1, err, errlen ) ) == -1 ) {
+			return 0;
+		}
+		close( fd );
+	}
+
+	//Workers are pinned in turn to the CPUs this process may use
+	if ( v->pin ) {
+		if ( sched_getaffinity( 0, sizeof( set ), &set ) == -1 ) {
+			snprintf( err, errlen, "Couldn't get CPU affinity: %s\n", strerror( errno ) );
+			fprintf( logfd, "%s", err );
+			return 0;
+		}
+		for ( int i = 0; i < CPU_SETSIZE; i++ ) {
+			CPU_ISSET( i, &set ) ? cpus[ ncpus++ ] = i : 0;
+		}
+	}
+
+	//Signals should interrupt waitpid, and workers must stay waitable
+	memset( &sa, 0, sizeof( sa ) );
+	sigemptyset( &sa.sa_mask );
+	sa.sa_handler = sigforward;
+	if ( sigaction( SIGINT, &sa, NULL ) == -1 || sigaction( SIGTERM, &sa, NULL ) == -1 || sigaction( SIGHUP, &sa, NULL ) == -1 ) {
+		snprintf( err, errlen, "Failed to set signal handlers: %s\n", strerror( errno ) );
+		fprintf( logfd, "%s", err );
+		return 0;
+	}
+
+	sa.sa_handler = sigstop;
+	if ( sigaction( SIGALRM, &sa, NULL ) == -1 || signal( SIGCHLD, SIG_DFL ) == SIG_ERR ) {
+		snprintf( err, errlen, "Failed to set signal handlers: %s\n", strerror( errno ) );
+		fprintf( logfd, "%s", err );
+		return 0;
+	}
+
+	//Workers only see each other's sessions on disk
+	session_shared = 1;
+
+	for ( int i = 0; i < v->workers; i++ ) {
+		if ( !( ok = start_worker( v, p, i, ncpus ? cpus[ i % ncpus ] : -1, err, errlen ) ) ) {
+			sigforward( SIGTERM );
+			break;
+		}
+	}
+
+	FPRINTF( "Master %d started %d workers\n", getpid(), v->workers );
+
+	//Wait on the workers, restarting any that die
+	for ( ;; ) {
+		int status = 0, i = 0;
+		pid_t pid = waitpid( -1, &status, 0 );
+
+		if ( pid == -1 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			break;
+		}
+
+		for ( i = 0; i < v->workers && workers[ i ] != pid; i++ );
+		if ( i == v->workers ) {
+			continue;
+		}
+
+		workers[ i ] = 0;
+		if ( stopping ) {
+			continue;
+		}
+
+		if ( WIFSIGNALED( status ) ) {
+			fprintf( logfd, "Worker %d (pid %d) was killed by signal %d, restarting\n", i, pid, WTERMSIG( status ) );
+		}
+		else {
+			fprintf( logfd, "Worker %d (pid %d) exited with status %d, restarting\n", i, pid, WEXITSTATUS( status ) );
+		}
+		fflush( logfd );
+
+		//Don't spin on a worker that keeps crashing, but come right back from a SIGHUP
+		if ( !WIFSIGNALED( status ) || WTERMSIG( status ) != SIGHUP ) {
+			sleep( WORKER_RESPAWN_DELAY );
+		}
+
+		//A worker that can't be forked leaves nothing to wait on, so keep trying
+		while ( !stopping && !start_worker( v, p, i, ncpus ? cpus[ i % ncpus ] : -1, err, errlen ) ) {
+			fprintf( logfd, "Worker %d could not be restarted, retrying in %d seconds\n", i, WORKER_RESPAWN_DELAY );
+			fflush( logfd );
+			sleep( WORKER_RESPAWN_DELAY );
+		}
+	}
+
+	alarm( 0 );
+	if ( ok && !stopping ) {
+		snprintf( err, errlen, "No workers are left running.\n" );
+		return 0;
+	}
+
+	return ok;
+}
+
+
+
 // Run a server
 int cmd_server ( struct values *v, char *err, int errlen ) {
 
-	// Define all we need
-	struct sockaddr_in sa, *si = &sa;
-	//short unsigned int port = v->port, *pport = &port;
-	//short unsigned int *pport = NULL;
-	//int server.fd = 0;
-	//int backlog = BACKLOG;
-	int on = 1;
-
 	// Prep this
-	server_t server; 
+	server_t server, servers[ SERVER_MAX_LISTENERS ]; 
 	server.interrupt = 0;
 	server.max_per = !v->maxper ? 64 : v->maxper;
 	server.timeout = 30;
@@ -458,22 +891,21 @@ int cmd_server ( struct values *v, char *err, int errlen ) {
 	server.fdset = NULL;
 	server.port = v->port; 
 	server.backlog = BACKLOG;
+	server.threads = v->threads;
+	server.max_requests = v->kmax;
+	server.ktimeout = v->ktimeout;
 	server.filters = http_filters;
-	short unsigned int port = server.port, *pport = &port;
+	server.ctx = NULL;
+	server.next = NULL;
 	#ifdef DEBUG_H
 	server.tapout = v->tapout;
 	#endif
 
-	// Check that the protocol choice is valid and set a reference
-	if ( v->userprotocol == UP_HTTP )
-		server.ctx = &sr[ (int)UP_HTTP ];
-	else if ( v->userprotocol == UP_HTTPS )
-		server.ctx = &sr[ (int)UP_HTTPS ];
-	else {
-		snprintf( err, errlen, "Invalid protocol specified...\n" );
+	// Check that there is something to listen on
+	if ( v->lcount < 1 || v->lcount > SERVER_MAX_LISTENERS ) {
+		snprintf( err, errlen, "Invalid number of listeners specified...\n" );
 		return 0;
 	}
-	 
 
 	// Logging functions are now a context of their own.
 	// But locking will most likely be needed, so either
@@ -494,13 +926,6 @@ int cmd_server ( struct values *v, char *err, int errlen ) {
 		return 0;
 	}
 
-	//Initialize server protocol
-	if ( !server.ctx->init( &server ) ) {
-		free_server_config( server.config );
-		snprintf( err, errlen, "Initializing protocol '%s' failed: %s\n", server.ctx->name, server.err );
-		return 0;
-	}
-
   #if 0
 	//Init logging and access structures too
 	struct log *al = &loggers[ 0 ], *el = &loggers[ 0 ];
@@ -534,59 +959,6 @@ int cmd_server ( struct values *v, char *err, int errlen ) {
 	server.access_fd = accessfd;
   #endif
 
-	// Setup and open a TCP socket
-	si->sin_family = PF_INET; 
-	si->sin_port = htons( *pport );
-	(&si->sin_addr)->s_addr = htonl( INADDR_ANY );
-
-	if (( fdset[0] = server.fd = socket( PF_INET, SOCK_STREAM, IPPROTO_TCP )) == -1 ) {
-		snprintf( err, errlen, "Couldn't open socket! Error: %s\n", strerror( errno ) );
-		fprintf( logfd, "%s", err );
-		return 0;
-	}
-
-	if ( setsockopt( server.fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on) ) == -1 ) {
-		snprintf( err, errlen, "Couldn't set socket to reusable! Error: %s\n", strerror( errno ) );
-		fprintf( logfd, "%s", err );
-		return 0;
-	}
-
-  #if 0
-	//This may only be valid via BSD
-	if ( setsockopt( server.fd, SOL_SOCKET, SO_NOSIGPIPE, (char *)&on, sizeof(on) ) == -1 ) {
-		snprintf( err, errlen, "Couldn't set socket sigpipe behavior! Error: %s\n", strerror( errno ) );
-		fprintf( logfd, "%s", err );
-		return 0;
-	}
-  #endif
-
-  #if 1
-	if ( fcntl( server.fd, F_SETFD, O_NONBLOCK ) == -1 ) {
-		snprintf( err, errlen, "fcntl error: %s\n", strerror(errno) ); 
-		fprintf( logfd, "%s", err );
-		return 0;
-	}
-  #else
-	// One of these two should set non blocking functionality
-	if ( ioctl( server.fd, FIONBIO, (char *)&on ) == -1 ) {
-		snprintf( err, errlen, "fcntl error: %s\n", strerror(errno) ); 
-		fprintf( logfd, "%s", err );
-		return 0;
-	}
-  #endif
-
-	if ( bind( server.fd, (struct sockaddr *)si, sizeof(struct sockaddr_in)) == -1 ) {
-		snprintf( err, errlen, "Couldn't bind socket to address! Error: %s\n", strerror( errno ) );
-		fprintf( logfd, "%s", err );
-		return 0;
-	}
-
-	if ( listen( server.fd, server.backlog ) == -1 ) {
-		snprintf( err, errlen, "Couldn't listen for connections! Error: %s\n", strerror( errno ) );
-		fprintf( logfd, "%s", err );
-		return 0;
-	}
-
 #if 0
 	//Drop privileges
 	if ( !revoke_priv( v, err, errlen ) ) {
@@ -623,13 +995,6 @@ int cmd_server ( struct values *v, char *err, int errlen ) {
 	}
 #endif
 	
-	//todo: uSing threads may make this easier... https://www.geeksforgeeks.org/zombie-processes-prevention/
-	if ( signal( SIGCHLD, SIG_IGN ) == SIG_ERR ) {
-		snprintf( err, errlen, "Failed to set SIGCHLD\n" );
-		fprintf( logfd, "%s", err );
-		return 0;
-	}
-
 	//Needed for lots of send() activity
 	if ( signal( SIGPIPE, SIG_IGN ) == SIG_ERR ) {
 		snprintf( err, errlen, "Failed to set SIGPIPE\n" );
@@ -637,19 +1002,30 @@ int cmd_server ( struct values *v, char *err, int errlen ) {
 		return 0;
 	}
 
-	#if 0
-	if ( signal( SIGSEGV, SIG_IGN ) == SIG_ERR ) {
-		snprintf( err, errlen, "Failed to set SIGSEGV\n" );
-		fprintf( logfd, "%s", err );
-		return 0;
+	// Every listener shares the config, and listeners speaking the same protocol share its setup
+	for ( int i = 0, j = 0; i < v->lcount; i++ ) {
+		server_t *s = &servers[ i ];
+		memcpy( s, &server, sizeof( server_t ) );
+		s->ctx = &sr[ (int)v->listeners[ i ].protocol ];
+		s->port = v->listeners[ i ].port;
+		s->next = ( i + 1 < v->lcount ) ? &servers[ i + 1 ] : NULL;
+
+		for ( j = 0; j < i && servers[ j ].ctx != s->ctx; j++ );
+		if ( j < i )
+			s->data = servers[ j ].data;
+		else if ( !s->ctx->init( s ) ) {
+			snprintf( err, errlen, "Initializing protocol '%s' failed: %s\n", s->ctx->name, s->err );
+			free_protocols( servers, i );
+			free_server_config( server.config );
+			return 0;
+		}
 	}
-	#endif
 
-	// Evaluate server mode
-	if ( v->model == SERVER_ONESHOT )
-		srv_single( &server );
-	else if ( v->model == SERVER_MULTITHREAD ) {
-		srv_multithread( &server );
+	// Serve from this process, or start workers and watch over them
+	if ( !( v->workers ? run_master( v, servers, err, errlen ) : run_worker( v, servers, -1, err, errlen ) ) ) {
+		free_protocols( servers, v->lcount );
+		free_server_config( server.config );
+		return 0;
 	}
 
 	if ( accessfd ) {
@@ -662,14 +1038,8 @@ int cmd_server ( struct values *v, char *err, int errlen ) {
 		logfd = NULL;
 	}
 
-	if ( close( server.fd ) == -1 ) {
-		FPRINTF( "FAILURE: Couldn't close parent socket. Error: %s\n", err );
-		return 0;
-	}
-
-
 	//TODO: Free whatever was allocated at ctx->init()
-	server.ctx->free( &server );
+	free_protocols( servers, v->lcount );
 	free_server_config( server.config );
 	return 1;
 }
@@ -752,9 +1122,20 @@ int cmd_dump( struct values *v, char *err, int errlen ) {
 	fprintf( stderr, "Share Directory:     %s\n", SHAREDIR );
 	fprintf( stderr, "Session DB:          %s\n", SESSION_DB_PATH );
 	fprintf( stderr, "Model:               %s\n", 
-		v->model == SERVER_ONESHOT ? "oneshot" : "multithread" );
+		v->model == SERVER_ONESHOT ? "oneshot" : 
+		v->model == SERVER_EVENT ? "event" : "multithread" );
 	fprintf( stderr, "Default Protocol:    %s\n", 
 		v->userprotocol == UP_HTTP ? "http" : "https" );
+	fprintf( stderr, "Listeners:           " );
+	for ( int i = 0; i < v->lcount; i++ ) {
+		struct listener *l = &v->listeners[ i ];
+		int six = strchr( l->address, ':' ) != NULL;
+		fprintf( stderr, "%s://%s%s%s:%d, ", l->protocol == UP_HTTP ? "http" : "https", 
+			six ? "[" : "", *l->address ? l->address : "*", six ? "]" : "", l->port );
+	}
+	fprintf( stderr, "\n" );
+	fprintf( stderr, "Keep-alive:          %d requests, %ds idle\n", v->kmax, v->ktimeout );
+	fprintf( stderr, "Workers:             %d%s\n", v->workers, v->pin ? " (pinned)" : "" );
 	//fprintf( stderr, "Daemonized:          %s\n", v->fork ? "T" : "F" );
 	//fprintf( stderr, "Library Directory:   %s\n", v->libdir );
 
@@ -870,6 +1251,46 @@ int main ( int argc, char *argv[] ) {
 			v.model = SERVER_MULTITHREAD;
 		else if ( !strcmp( *argv, "--model=oneshot" ) ) 
 			v.model = SERVER_ONESHOT;
+		else if ( !strcmp( *argv, "--model=event" ) ) 
+			v.model = SERVER_EVENT;
+		else if ( !strcmp( *argv, "--threads" ) ) {
+			OPTARG( *argv, "--threads" );
+			if ( ( v.threads = parse_count( *argv, MAX_THREADS ) ) < 1 ) {
+				return eprintf( "Invalid thread count '%s', expected a number from 1 to %d.", *argv, MAX_THREADS );
+			}
+		}
+		else if ( !strcmp( *argv, "--keepalive" ) ) {
+			OPTARG( *argv, "--keepalive" );
+			if ( ( v.kmax = parse_count( *argv, 65535 ) ) == -1 ) {
+				return eprintf( "Invalid request count '%s', expected a number from 0 to %d.", *argv, 65535 );
+			}
+		}
+		else if ( !strcmp( *argv, "--idle-timeout" ) ) {
+			OPTARG( *argv, "--idle-timeout" );
+			if ( ( v.ktimeout = parse_count( *argv, 65535 ) ) == -1 ) {
+				return eprintf( "Invalid idle timeout '%s', expected a number of seconds from 0 to %d.", *argv, 65535 );
+			}
+		}
+		else if ( !strcmp( *argv, "--workers" ) ) {
+			OPTARG( *argv, "--workers" );
+			if ( ( v.workers = parse_count( *argv, MAX_WORKERS ) ) == -1 ) {
+				return eprintf( "Invalid worker count '%s', expected a number from 0 to %d.", *argv, MAX_WORKERS );
+			}
+			if ( !v.workers && ( v.workers = sysconf( _SC_NPROCESSORS_ONLN ) ) > MAX_WORKERS ) {
+				v.workers = MAX_WORKERS;
+			}
+		}
+		else if ( !strcmp( *argv, "--pin" ) ) 
+			v.pin = 1;
+		else if ( !strcmp( *argv, "--listen" ) ) {
+			OPTARG( *argv, "--listen" );
+			if ( v.lcount >= SERVER_MAX_LISTENERS ) {
+				return eprintf( "Too many listeners, at most %d are allowed.", SERVER_MAX_LISTENERS );
+			}
+			if ( !parse_listener( *argv, &v.listeners[ v.lcount++ ] ) ) {
+				return eprintf( "Invalid listener '%s', expected [http://|https://][address:]port.", *argv );
+			}
+		}
 		else if ( !strcmp( *argv, "--protocol=http" ) ) 
 			v.userprotocol = UP_HTTP;
 		else if ( !strcmp( *argv, "--protocol=https" ) ) 
@@ -906,6 +1327,13 @@ int main ( int argc, char *argv[] ) {
 		v.port = defport;
 	}
 
+	//Without any listeners, listen on the port and protocol given
+	if ( !v.lcount ) {
+		v.listeners[ 0 ].protocol = v.userprotocol;
+		v.listeners[ 0 ].port = v.port;
+		v.lcount = 1;
+	}
+
 	//Set a default user and group
 	if ( ! *v.user ) {
 		snprintf( v.user, sizeof( v.user ) - 1, "%s", getpwuid( getuid() )->pw_name );
@@ -16,6 +16,8 @@
  * ---------
  * - 
  * ------------------------------------------- */
+#include <ctype.h>
+#include <strings.h>
 #include "configs.h"
 
 //Free config tables
@@ -61,20 +63,115 @@ static int hosts_iterator ( zKeyval * kv, int i, void *p ) {
 }
 
 
-//Find a host
-struct lconfig * find_host ( struct lconfig **hosts, char *hostname ) {
-	char host[ 2048 ] = { 0 };
-	int pos = memchrat( hostname, ':', strlen( hostname ) );
-	memcpy( host, hostname, ( pos > -1 ) ? pos : strlen(hostname) );
-	while ( hosts && *hosts ) {
-		struct lconfig *req = *hosts;
-		if ( req->name && strcmp( req->name, host ) == 0 )  {
-			return req;	
+//Hostnames are hashed without regard to case
+static unsigned int host_hash ( const char *name, int len ) {
+	unsigned int hash = 2166136261u;
+	for ( int i = 0; i < len; i++ ) {
+		hash = ( hash ^ (unsigned char)tolower( name[ i ] ) ) * 16777619u;
+	}
+	return hash;
+}
+
+
+
+//Look up one name (or wildcard suffix) in the host index
+static struct lconfig * host_lookup ( struct sconfig *c, const char *name, int len, int wildcard ) {
+	unsigned int hash = host_hash( name, len );
+	for ( struct hname_t *n = c->index[ hash & ( c->isize - 1 ) ]; n; n = n->next ) {
+		if ( n->hash == hash && n->len == len && n->wildcard == wildcard && !strncasecmp( n->name, name, len ) ) {
+			return n->host;
+		}
+	}
+	return NULL;
+}
+
+
+
+//Add a name to the host index, the first host to claim a name keeps it
+static int index_host ( struct sconfig *c, const char *name, struct lconfig *host ) {
+	struct hname_t *n = NULL, **slot = NULL;
+	int wildcard = ( name[ 0 ] == '*' && name[ 1 ] == '.' );
+	
+	name += wildcard;
+	if ( host_lookup( c, name, strlen( name ), wildcard ) ) {
+		return 1;
+	}
+
+	if ( !( n = malloc( sizeof( struct hname_t ) ) ) ) {
+		return 0;
+	}
+
+	n->name = name, n->len = strlen( name ), n->wildcard = wildcard, n->host = host;
+	n->hash = host_hash( name, n->len );
+	slot = &c->index[ n->hash & ( c->isize - 1 ) ];
+	n->next = *slot, *slot = n;
+	return 1;
+}
+
+
+
+//Build an index of every hostname and alias
+static int build_index ( struct sconfig *c ) {
+	int count = 0;
+
+	for ( struct lconfig **h = c->hosts; h && *h; h++ ) {
+		(*h)->id = count++;
+	}
+
+	//Keep the load under one name per bucket
+	for ( c->isize = 16; c->isize < count * 2; c->isize <<= 1 );
+	if ( !( c->index = calloc( c->isize, sizeof( struct hname_t * ) ) ) ) {
+		return 0;
+	}
+
+	for ( struct lconfig **h = c->hosts; h && *h; h++ ) {
+		if ( !index_host( c, (*h)->name, *h ) || ( (*h)->alias && !index_host( c, (*h)->alias, *h ) ) ) {
+			return 0;
 		}
-		if ( req->alias && strcmp( req->alias, host ) == 0 ) {
-			return req;	
+	}
+	return 1;
+}
+
+
+
+//Free the host index
+static void free_index ( struct sconfig *c ) {
+	for ( unsigned int i = 0; c->index && i < c->isize; i++ ) {
+		for ( struct hname_t *n = c->index[ i ], *next = NULL; n; n = next ) {
+			next = n->next;
+			free( n );
 		}
-		hosts++;
+	}
+	free( c->index );
+	c->index = NULL;
+}
+
+
+
+//Find a host by name or alias, then by a wildcard standing in for its first label
+struct lconfig * find_host ( struct sconfig *c, const char *hostname ) {
+	struct lconfig *h = NULL;
+	const char *end = NULL;
+	int len = 0;
+
+	if ( !c || !c->index || !hostname ) {
+		return NULL;
+	}
+
+	//Leave off the port, and the brackets around IPv6 addresses
+	if ( *hostname == '[' && ( end = strchr( hostname, ']' ) ) )
+		hostname++, len = end - hostname;
+	else {
+		len = ( end = strchr( hostname, ':' ) ) ? end - hostname : strlen( hostname );
+	}
+
+	if ( ( h = host_lookup( c, hostname, len, 0 ) ) ) {
+		return h;
+	}
+
+	//A wildcard only stands in for the first label
+	if ( ( end = memchr( hostname, '.', len ) ) && end > hostname ) {
+		return host_lookup( c, end, len - ( end - hostname ), 1 );
 	}
 	return NULL;
 }
@@ -256,6 +353,17 @@ struct sconfig * build_server_config ( const char *file, char *err, int errlen )
 	#endif
 	}
 
+	//Index every name a host answers to
+	config->index = NULL;
+	if ( !build_index( config ) ) {
+		snprintf( err, errlen, "Failed to index hosts from: %s\n", file );
+		free_index( config );
+		free_t( t );
+		free( config );
+		lua_close( L );
+		return NULL;
+	}
+
 	//This is the web root 
 	config->wwwroot = dupstr( loader_get_char_value( t, "wwwroot" ) ); 
 
@@ -291,6 +399,8 @@ void free_server_config( struct sconfig *config ) {
 		free_hosts( config->hosts );	
 	}
 
+	free_index( config );
+
 #if 0
 	if ( config->routes ) {
 		free_routes( config->routes );
@@ -46,6 +46,19 @@ struct lconfig {
 	char *key_file;
 	int *tlserror;
 	int tlsready;
+	int id;
+};
+
+
+//A hostname or alias in the host index.  Wildcards like '*.example.com'
+//are kept under what follows the '*'.
+struct hname_t {
+	struct hname_t *next;
+	unsigned int hash;
+	int len;
+	int wildcard;
+	const char *name;
+	struct lconfig *host;
 };
 
 
@@ -53,11 +66,13 @@ struct lconfig {
 struct sconfig {
 	char *wwwroot;
 	struct lconfig **hosts;
+	struct hname_t **index;
+	unsigned int isize;
 	zTable *src;
 };
 
 
-struct lconfig * find_host ( struct lconfig **, char * );
+struct lconfig * find_host ( struct sconfig *, const char * );
 
 int host_table_iterator ( zKeyval *, int, void * );
 
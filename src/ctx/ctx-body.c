@@ -0,0 +1,302 @@
+/* ------------------------------------------- *
+ * ctx-body.c
+ * ========
+ *
+ * Summary
+ * -------
+ * Functions for receiving request bodies a piece at a time.
+ *
+ * LICENSE
+ * -------
+ * Copyright 2020-2021 Tubular Modular Inc. dba Collins Design
+ *
+ * See LICENSE in the top-level directory for more information.
+ *
+ * ------------------------------------------- */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "ctx-body.h"
+
+// Template for temporary files
+static const char spill_template[] = CTX_SPILL_DIR "/hypno-XXXXXX";
+
+
+
+// Note why a body was refused and the status to send back
+static int body_error ( struct cbody_t *b, int status, const char *msg ) {
+	snprintf( b->err, sizeof( b->err ), "%s", msg );
+	b->status = status;
+	return 0;
+}
+
+
+
+// Grow an in-memory buffer until need bytes fit
+static int body_reserve ( unsigned char **ptr, int *cap, int need ) {
+	unsigned char *p = NULL;
+	int size = *cap ? *cap : CTX_READ_SIZE;
+
+	if ( need <= *cap ) {
+		return 1;
+	}
+
+	for ( ; size < need; size *= 2 ) ;
+
+	if ( !( p = realloc( *ptr, size ) ) ) {
+		return 0;
+	}
+
+	*ptr = p, *cap = size;
+	return 1;
+}
+
+
+
+// Write all of p to the open temporary file
+static int body_write ( struct cbody_t *b, unsigned char *p, int len ) {
+	for ( int w; len > 0; p += w, len -= w ) {
+		if ( ( w = write( b->fd, p, len ) ) == -1 ) {
+			if ( errno == EINTR ) {
+				w = 0;
+				continue;
+			}
+			snprintf( b->err, sizeof( b->err ),
+				"Could not write temporary file: %s.", strerror( errno ) );
+			b->status = 500;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+
+// Move a value that has outgrown memory into a temporary file
+static int body_spill ( struct cbody_t *b, zhttpr_t *r ) {
+	char path[ sizeof( spill_template ) ];
+
+	memcpy( path, spill_template, sizeof( spill_template ) );
+	if ( ( b->fd = mkstemp( path ) ) == -1 ) {
+		snprintf( b->err, sizeof( b->err ),
+			"Could not create temporary file: %s.", strerror( errno ) );
+		b->status = 500;
+		return 0;
+	}
+
+	// The record owns the file now, so it's removed along with the request
+	if ( !( r->path = strdup( path ) ) ) {
+		close( b->fd ), unlink( path ), b->fd = -1;
+		return body_error( b, 500, "Out of memory." );
+	}
+
+	if ( r->size && !body_write( b, r->value, r->size ) ) {
+		return 0;
+	}
+
+	b->memory -= r->size;
+	free( r->value );
+	r->value = NULL, r->free = 0, b->cap = 0;
+	return 1;
+}
+
+
+
+// Add content to a value, moving it to disk if it's allowed to go there
+static int body_append ( struct cbody_t *b, zhttpr_t *r, unsigned char *p, int len, int spill ) {
+	if ( b->fd == -1 && b->memory + len > CTX_READ_MAX ) {
+		if ( !spill ) {
+			return body_error( b, 413, "Form field exceeds read max." );
+		}
+		if ( !body_spill( b, r ) ) {
+			return 0;
+		}
+	}
+
+	if ( b->fd > -1 ) {
+		if ( !body_write( b, p, len ) ) {
+			return 0;
+		}
+	}
+	else {
+		if ( !body_reserve( &r->value, &b->cap, r->size + len ) ) {
+			return body_error( b, 500, "Out of memory." );
+		}
+		memcpy( &r->value[ r->size ], p, len );
+		b->memory += len, r->free = 1;
+	}
+
+	r->size += len;
+	return 1;
+}
+
+
+
+// Take ownership of a new multipart part
+static int body_open_part ( void *data, zhttpr_t *r ) {
+	struct cbody_t *b = (struct cbody_t *)data;
+
+	// Parts are added to the request right away, so an error cleans them up too
+	if ( !zhttp_add_item_to_list( (void ***)&b->req->body, r, sizeof( zhttpr_t * ), &b->parts ) ) {
+		return body_error( b, 500, "Out of memory." );
+	}
+
+	b->part = r, b->cap = 0;
+	return 1;
+}
+
+
+
+// Only uploaded files may be written to disk, everything else stays in memory
+static int body_write_part ( void *data, zhttpr_t *r, unsigned char *p, int len ) {
+	return body_append( (struct cbody_t *)data, r, p, len, r->filename != NULL );
+}
+
+
+
+// Finish up the current multipart part
+static int body_close_part ( void *data, zhttpr_t *r ) {
+	struct cbody_t *b = (struct cbody_t *)data;
+	( b->fd > -1 ) ? close( b->fd ) : 0;
+	b->fd = -1, b->part = NULL, b->cap = 0;
+	return 1;
+}
+
+
+
+// Prepare to receive the body of req
+int body_init ( struct cbody_t *b, zhttp_t *req ) {
+	memset( b, 0, sizeof( struct cbody_t ) );
+	b->req = req, b->fd = -1, b->remaining = req->clen;
+
+	if ( !req->chunked && req->clen > CTX_UPLOAD_MAX ) {
+		return body_error( b, 413, "Content-Length exceeds upload max." );
+	}
+
+	if ( req->formtype == ZHTTP_MULTIPART ) {
+		if ( !( b->mp = malloc( sizeof( zhttpm_t ) ) ) ) {
+			return body_error( b, 500, "Out of memory." );
+		}
+		if ( !http_multipart_init( b->mp, req->boundary ) ) {
+			return body_error( b, 500, "Multipart boundary too long." );
+		}
+		b->mp->data = b;
+		b->mp->open = body_open_part;
+		b->mp->write = body_write_part;
+		b->mp->close = body_close_part;
+	}
+	else if ( req->formtype == ZHTTP_OTHER ) {
+		// Freeform bodies get one record, same as http_parse_freeform_body
+		zhttpr_t *r = NULL;
+		if ( !( r = malloc( sizeof( zhttpr_t ) ) ) || !memset( r, 0, sizeof( zhttpr_t ) ) ) {
+			return body_error( b, 500, "Out of memory." );
+		}
+		r->type = ZHTTP_OTHER, r->field = zhttp_dupstr( "body" );
+		if ( !zhttp_add_item_to_list( (void ***)&req->body, r, sizeof( zhttpr_t * ), &b->parts ) ) {
+			free( (void *)r->field ), free( r );
+			return body_error( b, 500, "Out of memory." );
+		}
+		b->part = r;
+	}
+	else if ( req->formtype == ZHTTP_URL_ENCODED ) {
+		req->atype = ZHTTP_MESSAGE_MALLOC;
+	}
+
+	return 1;
+}
+
+
+
+// How many bytes can be read without running into the next request
+int body_want ( struct cbody_t *b, int size ) {
+	return ( !b->req->chunked && b->remaining < size ) ? b->remaining : size;
+}
+
+
+
+// Take the next len bytes off the wire, used is set to how many belonged to the body
+int body_feed ( struct cbody_t *b, unsigned char *p, int len, int *used ) {
+	zhttp_t *req = b->req;
+	int n = len;
+
+	if ( !req->chunked )
+		n = *used = ( len < b->remaining ) ? len : b->remaining, b->done = !( b->remaining -= n );
+	else {
+		// Chunks are decoded in place
+		if ( ( n = http_decode_chunked( &b->chunks, p, len, used ) ) == -1 ) {
+			return body_error( b, 400, "Malformed chunked body." );
+		}
+		b->done = b->chunks.done;
+	}
+
+	if ( ( b->total += n ) > CTX_UPLOAD_MAX ) {
+		return body_error( b, 413, "Request body exceeds upload max." );
+	}
+
+	if ( n < 1 ) {
+		return 1;
+	}
+
+	if ( req->formtype == ZHTTP_MULTIPART ) {
+		if ( !http_parse_multipart_chunk( b->mp, p, n ) ) {
+			return b->status ? 0 : body_error( b, 500, "Malformed multipart body." );
+		}
+	}
+	else if ( req->formtype == ZHTTP_OTHER ) {
+		return body_append( b, b->part, p, n, 1 );
+	}
+	else if ( req->formtype == ZHTTP_URL_ENCODED ) {
+		if ( b->len + n > CTX_READ_MAX ) {
+			return body_error( b, 413, "Form exceeds read max." );
+		}
+		if ( !body_reserve( &req->msg, &b->cap, b->len + n ) ) {
+			return body_error( b, 500, "Out of memory." );
+		}
+		memcpy( &req->msg[ b->len ], p, n ), b->len += n;
+	}
+
+	return 1;
+}
+
+
+
+// Wrap up a fully received body
+int body_finish ( struct cbody_t *b ) {
+	zhttp_t *req = b->req;
+
+	( b->fd > -1 ) ? close( b->fd ) : 0;
+	b->fd = -1;
+
+	if ( b->mp && !b->mp->done ) {
+		return body_error( b, 500, "Malformed multipart body." );
+	}
+
+	// Chunked requests only know how long they were now
+	req->clen = b->total;
+
+	if ( req->formtype == ZHTTP_URL_ENCODED && b->len && !http_parse_content( req, req->msg, b->len ) ) {
+		return body_error( b, 500, (char *)req->errmsg );
+	}
+
+	return 1;
+}
+
+
+
+// Free anything a body held on to while it was received
+void body_free ( struct cbody_t *b ) {
+	( b->fd > -1 ) ? close( b->fd ) : 0;
+	b->fd = -1;
+	free( b->mp );
+	b->mp = NULL;
+}
+
+
+
+// Free a body that was allocated to outlive the read it started in
+void body_drop ( struct cbody_t *b ) {
+	if ( b ) {
+		body_free( b );
+		free( b );
+	}
+}
@@ -0,0 +1,66 @@
+/* ------------------------------------------- *
+ * ctx-body.h
+ * ========
+ *
+ * Summary
+ * -------
+ * Header for streaming request bodies.
+ *
+ * Usage
+ * -----
+ * Bodies that are chunked or larger than CTX_READ_MAX are fed here a
+ * piece at a time as they come off the socket.  Form fields stay in
+ * memory, while uploaded files and large raw bodies are written to
+ * temporary files under CTX_SPILL_DIR.  Under the event model, a body
+ * that has to wait on the socket is kept on the connection until it
+ * picks back up, and dropped with body_drop.
+ *
+ * LICENSE
+ * -------
+ * Copyright 2020-2021 Tubular Modular Inc. dba Collins Design
+ *
+ * See LICENSE in the top-level directory for more information.
+ *
+ * CHANGELOG
+ * ---------
+ *
+ * ------------------------------------------- */
+#include <zhttp.h>
+#include "../config.h"
+
+#ifndef CTXBODY_H
+#define CTXBODY_H
+
+#define CTXBODY_ERRBUF_LEN 128
+
+//A request body that is still being received
+struct cbody_t {
+	zhttp_t *req;
+	zhttpc_t chunks;
+	zhttpm_t *mp;
+	zhttpr_t *part;
+	int fd;
+	int cap;
+	int len;
+	int parts;
+	int memory;
+	int total;
+	int remaining;
+	int status;
+	char done;
+	char err[ CTXBODY_ERRBUF_LEN ];
+};
+
+int body_init ( struct cbody_t *, zhttp_t * );
+
+int body_want ( struct cbody_t *, int );
+
+int body_feed ( struct cbody_t *, unsigned char *, int, int * );
+
+int body_finish ( struct cbody_t * );
+
+void body_free ( struct cbody_t * );
+
+void body_drop ( struct cbody_t * );
+
+#endif
@@ -21,8 +21,8 @@ static const int bhsize = 4;
 // Size of zhttp_t object
 static const int zhttp_size = sizeof( zhttp_t );
 
-// Define an interval for polling 
-static const struct timespec __interval__ = { 0, POLL_INTERVAL };
+// Go-ahead for clients that sent 'Expect: 100-continue'
+static const char http_continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
 
 
 
@@ -72,28 +72,217 @@ const int pre_notls ( server_t *p, conn_t *conn ) {
 
 
 
+// Tell a client waiting on 'Expect: 100-continue' to send its body
+static void send_continue_notls ( server_t *p, conn_t *conn ) {
+	// Nothing is lost if this doesn't go out, the client sends the body anyway after a while
+	if ( conn->req->expects ) {
+		(void)send( conn->fd, http_continue, sizeof( http_continue ) - 1, MSG_DONTWAIT | MSG_NOSIGNAL );
+	}
+}
+
+
+
+// Read a chunked or oversized body a piece at a time
+static int read_stream_notls ( server_t *p, conn_t *conn, int hlen, int total, struct timespec *timer ) {
+
+	// Define
+	struct cbody_t *b = conn->stream;
+	unsigned char buf[ CTX_READ_SIZE ];
+	unsigned char *hp = conn->req->preamble + ( hlen + bhsize );
+	int used = 0, left = total - ( hlen + bhsize );
+	const int room = ZHTTP_PREAMBLE_SIZE - ( hlen + bhsize );
+
+	// A body that stopped to wait on the socket carries on where it was
+	if ( b )
+		conn->stream = NULL;
+	else if ( !( b = malloc( sizeof( struct cbody_t ) ) ) ) {
+		conn->req->keepalive = 0;
+		conn->stage = CONN_WRITE;
+		(void)http_set_error( conn->res, 500, "Out of memory." );
+		return 1;
+	}
+	// Start with whatever arrived behind the header
+	else if ( body_init( b, conn->req ) && left > 0 && body_feed( b, hp, left, &used ) && b->done ) {
+		conn->pipepos = hlen + bhsize + used;
+		conn->pipelen = left - used;
+	}
+	else if ( !b->status ) {
+		send_continue_notls( p, conn );
+	}
+
+	// Get the rest of the message
+	for ( int rd; !b->done && !b->status; ) {
+		if ( ( rd = recv( conn->fd, buf, body_want( b, sizeof( buf ) ), MSG_DONTWAIT ) ) == 0 ) {
+			// The client gave up part way through, so there's no one to answer
+			body_drop( b );
+			conn->stage = CONN_POST;
+			return 1;
+		}
+		else if ( rd < 1 ) {
+
+			// Most likely the other side is closed
+			if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+				snprintf( conn->err, sizeof( conn->err ),
+					"Got socket read error: %s\n", strerror( errno ) );
+				FPRINTF( "FATAL: %s\n", conn->err );
+				body_drop( b );
+				conn->stage = CONN_POST;
+				return 0;
+			}
+
+			// Let the event loop do the waiting
+			if ( p->yield ) {
+				conn->stream = b, conn->progress = hlen;
+				return 1;
+			}
+
+			if ( srv_wait( conn->fd, POLLIN, timer, p->rtimeout ) < 1 ) {
+				body_drop( b );
+				conn->req->keepalive = 0;
+				conn->stage = CONN_WRITE;
+				(void)http_set_error( conn->res, 408, "Timeout reached." );
+				return 1;
+			}
+		}
+		else {
+			// A chunked body can run into the next request, keep it if it fits
+			if ( body_feed( b, buf, rd, &used ) && b->done && used < rd ) {
+				if ( rd - used > room )
+					conn->req->keepalive = 0;
+				else {
+					memcpy( hp, &buf[ used ], rd - used );
+					conn->pipepos = hlen + bhsize, conn->pipelen = rd - used;
+				}
+			}
+
+			// Set timer to keep track of long running requests
+			clock_gettime( CLOCK_REALTIME, timer );
+		}
+	}
+
+	// Whatever is left of a refused body can't be told apart from the next request
+	if ( b->status || !body_finish( b ) ) {
+		(void)http_set_error( conn->res, b->status, b->err );
+		body_drop( b );
+		conn->req->keepalive = 0;
+		conn->stage = CONN_WRITE;
+		return 1;
+	}
+
+	FPRINTF( "Read complete (streamed %d bytes of content)\n", conn->req->clen );
+	body_drop( b );
+	conn->stage = CONN_PROC;
+	return 1;
+}
+
+
+
+// Read the rest of a body that fits in memory
+static int read_body_notls ( server_t *p, conn_t *conn, int crecvd, struct timespec *timer ) {
+
+	// Define
+	const int size = CTX_READ_SIZE;
+	unsigned char *xp = conn->req->msg + crecvd;
+
+	// Never ask for more than the body, whatever follows it belongs to the next request
+	for ( int rd, bsize = size; crecvd < conn->req->clen; ) {
+		bsize = ( conn->req->clen - crecvd < size ) ? conn->req->clen - crecvd : size;
+		FPRINTF( "Attempting read of %d bytes in ptr %p\n", bsize, xp );
+		if ( ( rd = recv( conn->fd, xp, bsize, MSG_DONTWAIT ) ) == 0 ) {
+			// TODO: Properly handle this case
+			conn->stage = CONN_PROC;
+			return 1;
+		}
+		else if ( rd < 1 ) {
+
+			// Most likely the other side is closed
+			if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+				snprintf( conn->err, sizeof( conn->err ),
+					"Got socket read error: %s\n", strerror( errno ) );
+				FPRINTF( "FATAL: %s\n", conn->err );
+				conn->stage = CONN_POST;
+				return 0;
+			}
+
+			// Let the event loop do the waiting
+			if ( p->yield ) {
+				conn->progress = crecvd;
+				return 1;
+			}
+
+			if ( srv_wait( conn->fd, POLLIN, timer, p->rtimeout ) < 1 ) {
+				conn->stage = CONN_WRITE;
+				(void)http_set_error( conn->res, 408, "Timeout reached." );
+				return 1;
+			}
+		}
+		else {
+			// Process a successfully read buffer
+			FPRINTF( "Received %d additional bytes on fd %d\n", rd, conn->fd ); 
+			xp += rd, crecvd += rd;
+
+			// Set timer to keep track of long running requests
+			clock_gettime( CLOCK_REALTIME, timer );
+		}
+	}
+
+	// Finally, process the body (chunked may still need something fancy)
+	if ( !http_parse_content( conn->req, conn->req->msg, conn->req->clen ) ) {
+		conn->stage = CONN_WRITE;
+		(void)http_set_error( conn->res, 500, (char *)conn->req->errmsg );
+		return 1;
+	}
+
+	FPRINTF( "Read complete (read %d out of %d bytes for content)\n",
+		crecvd, conn->req->clen );
+	conn->stage = CONN_PROC;
+	return 1;
+}
+
+
+
 // Read a message that the server will use later.
 const int read_notls ( server_t *p, conn_t *conn ) {
 
 	// Get the time at the start
-	int total = 0, nsize, mult = 1;
+	int total = 0, nsize, mult = 1, wait = 0;
 	int hlen = -1, mlen = 0;
 	int bsize = ZHTTP_PREAMBLE_SIZE;
 	const int size = CTX_READ_SIZE;
 	struct timespec timer = {0};
-	struct timespec n = {0};
 	unsigned char *x = NULL, *xp = NULL;
 
 	// Get the time
 	clock_gettime( CLOCK_REALTIME, &timer );
 
+	// A body that stopped to wait on the socket picks back up where it was (write starts from nothing)
+	if ( conn->stream || conn->req->msg ) {
+		int from = conn->progress;
+		conn->progress = 0;
+		if ( conn->stream )
+			return read_stream_notls( p, conn, from, 0, &timer );
+		return read_body_notls( p, conn, from, &timer );
+	}
+
 	// Set another pointer for just the headers
-	memset( x = conn->req->preamble, 0, ZHTTP_PREAMBLE_SIZE );
+	x = conn->req->preamble;
+
+	// Start with anything the client pipelined behind the last request (or sent before it had to wait)
+	if ( conn->pipelen > 0 ) {
+		total = conn->pipelen, bsize -= total, x += total;
+		hlen = http_header_received( conn->req->preamble, total ); 
+		conn->pipelen = 0;
+	}
 
 	// Read whatever the server sends and read until complete.
-	for ( int rd, recvd = -1; recvd < 0 || bsize <= 0;  ) {
+	for ( int rd, recvd = hlen; recvd < 0 || bsize <= 0;  ) {
 		rd = recv( conn->fd, x, bsize, MSG_DONTWAIT );
 		if ( rd == 0 ) {
+			// A client closing between requests is not an error
+			if ( !total ) {
+				conn->stage = CONN_POST;
+				return 1;
+			}
 			// TODO: This indicates either an extremely slow read or perhaps a closed conn
 			break;
 		}
@@ -108,20 +297,29 @@ const int read_notls ( server_t *p, conn_t *conn ) {
 				return 0;
 			}
 
-			// Get the time
-			memset( &n, 0, sizeof( struct timespec ) );
-			clock_gettime( CLOCK_REALTIME, &n );
+			// Let the event loop do the waiting, holding on to whatever part of the header came in
+			if ( p->yield ) {
+				conn->pipelen = total;
+				return 1;
+			}
 
-			// NOTE: This runs after an arbitrary limit
-			// TODO: Need to analyze avg write size & make sure that it is "worth it"
-			if ( ( n.tv_sec - timer.tv_sec ) >= p->rtimeout  ) {
+			// Persistent connections that go quiet are simply closed
+			if ( ( wait = srv_wait( conn->fd, POLLIN, &timer, ( !total && conn->count ) ? p->ktimeout : p->rtimeout ) ) == -1 ) {
+				snprintf( conn->err, sizeof( conn->err ),
+						"Got socket poll error: %s\n", strerror( errno ) );
+				FPRINTF( "FATAL: %s\n", conn->err );
+				conn->stage = CONN_POST;
+				return 0;
+			}
+			else if ( !wait && !total && conn->count ) {
+				conn->stage = CONN_POST;
+				return 1;
+			}
+			else if ( !wait ) {
 				conn->stage = CONN_WRITE;
 				(void)http_set_error( conn->res, 408, "Timeout reached." );
 				return 1;
 			}
-
-			// FPRINTF("Trying again to read from socket. Got %d bytes.\n", rd );
-			nanosleep( &__interval__, NULL );
 		}
 		else {
 			FPRINTF( "Received %d additional header bytes on fd %d\n", rd, conn->fd ); 
@@ -151,14 +349,23 @@ const int read_notls ( server_t *p, conn_t *conn ) {
 
 	// If the message is not idempotent, stop and return.
 	if ( !conn->req->idempotent ) {
+		conn->pipepos = hlen + bhsize;
+		conn->pipelen = total - conn->pipepos;
 		conn->stage = CONN_PROC;
 		FPRINTF( "%s: Read complete, no content body (read %d bytes)\n",
 				p->ctx->name, total );
 		return 1;
 	}
 
+	// Bodies that are chunked or too big for memory are streamed
+	if ( conn->req->chunked || conn->req->clen > CTX_READ_MAX ) {
+		return read_stream_notls( p, conn, hlen, total, &timer );
+	}
+
 	// Check to see if we've fully received the message
-	if ( total == ( hlen + bhsize + conn->req->clen ) ) {
+	if ( total >= ( hlen + bhsize + conn->req->clen ) ) {
+		conn->pipepos = hlen + bhsize + conn->req->clen;
+		conn->pipelen = total - conn->pipepos;
 		conn->req->msg = conn->req->preamble + ( hlen + bhsize );
 		if ( !http_parse_content( conn->req, conn->req->msg, conn->req->clen ) ) {
 			conn->stage = CONN_WRITE;
@@ -171,28 +378,9 @@ const int read_notls ( server_t *p, conn_t *conn ) {
 		return 1;
 	}
 
-	// Check here if the thing is too big
-	if ( conn->req->clen > CTX_READ_MAX ) {
-		snprintf( conn->err, sizeof( conn->err ),
-			"Content-Length (%d) exceeds read max (%d).", conn->req->clen, CTX_READ_MAX );
-		conn->stage = CONN_WRITE;
-		(void)http_set_error( conn->res, 500, (char *)conn->err );
-		return 1;
-	}
-
-	#if 1
+	// The client may be holding the body back until it hears from us
 	nsize = conn->req->clen;
-	#else
-	if ( !conn->req->chunked )
-		nsize = conn->req->mlen + conn->req->clen + 4;	
-	else {
-		// For chunked encoding, allocate a sensible size.
-		// Then send a 100-continue to the server...
-		nsize = conn->req->mlen + size + 4;
-		char *a = http_make_request( conn->res, 100, "Continue" );
-		send( a ); 
-	}
-	#endif
+	send_continue_notls( p, conn );
 
 	// Allocate space for the content of the message (may wish to initialize the memory)
 	conn->req->atype = ZHTTP_MESSAGE_MALLOC;
@@ -215,64 +403,7 @@ const int read_notls ( server_t *p, conn_t *conn ) {
 		xp += crecvd; 
 	} 
 
-	// Get the rest of the message
-	// FPRINTF( "crecvd: %d, clen: %d\n", crecvd, conn->req->clen );
-	for ( int rd, bsize = size; crecvd < conn->req->clen; ) {
-		FPRINTF( "Attempting read of %d bytes in ptr %p\n", bsize, xp );
-		// FPRINTF( "crevd: %d, clen: %d\n", crecvd, conn->req->clen );
-		if ( ( rd = recv( conn->fd, xp, bsize, MSG_DONTWAIT ) ) == 0 ) {
-			// TODO: Properly handle this case
-			conn->stage = CONN_PROC;
-			return 1;
-		}
-		else if ( rd < 1 ) {
-
-			// Most likely the other side is closed
-			if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
-				snprintf( conn->err, sizeof( conn->err ),
-					"Got socket read error: %s\n", strerror( errno ) );
-				FPRINTF( "FATAL: %s\n", conn->err );
-				conn->stage = CONN_POST;
-				return 0;
-			}
-
-			memset( &n, 0, sizeof( struct timespec ) );
-			clock_gettime( CLOCK_REALTIME, &n );
-
-			if ( ( n.tv_sec - timer.tv_sec ) >= p->rtimeout ) {
-				conn->stage = CONN_WRITE;
-				(void)http_set_error( conn->res, 408, "Timeout reached." );
-				return 1;
-			}
-
-			FPRINTF("Trying again to read from socket. Got %d bytes.\n", rd );
-			nanosleep( &__interval__, NULL );
-		}
-		else {
-			// Process a successfully read buffer
-			FPRINTF( "Received %d additional bytes on fd %d\n", rd, conn->fd ); 
-			xp += rd, total += rd, crecvd += rd;
-			if ( ( conn->req->clen - crecvd ) < size ) {
-				bsize = conn->req->clen - crecvd;
-			}
-
-			// Set timer to keep track of long running requests
-			FPRINTF( "Total read so far: %d\n", total );
-			clock_gettime( CLOCK_REALTIME, &timer );
-		}
-	}
-
-	// Finally, process the body (chunked may still need something fancy)
-	if ( !http_parse_content( conn->req, conn->req->msg, conn->req->clen ) ) {
-		conn->stage = CONN_WRITE;
-		(void)http_set_error( conn->res, 500, (char *)conn->req->errmsg );
-		return 1;
-	}
-
-	FPRINTF( "Read complete (read %d out of %d bytes for content)\n",
-		crecvd, conn->req->clen );
-	conn->stage = CONN_PROC;
-	return 1;
+	return read_body_notls( p, conn, crecvd, &timer );
 }
 
 
@@ -280,21 +411,25 @@ const int read_notls ( server_t *p, conn_t *conn ) {
 // Write a message to regular, unencrypted socket
 const int write_notls ( server_t *p, conn_t *conn ) {
 
-	// Define
-	int sent = 0, pos = 0, try = 0, total = conn->res->mlen;
+	// Define (a write that stopped to wait on the socket starts after what it got out)
+	int sent = 0, pos = conn->progress, try = 0, total = conn->res->mlen, blen = 0;
 	unsigned char *ptr = conn->res->msg;
-	struct timespec timer = {0}, n = {0};
+	unsigned char *body = http_get_response_body( conn->res, &blen );
+	struct iovec iov[ 2 ] = { { conn->res->msg, conn->res->mlen }, { body, blen } };
+	struct msghdr mh = { .msg_iov = iov, .msg_iovlen = ( blen > 0 ) ? 2 : 1 };
+	struct timespec timer = {0};
 
 	// Get the time at the start
 	clock_gettime( CLOCK_REALTIME, &timer );
 
 	// Mark the next stage
-	conn->stage = CONN_POST;
+	conn->stage = CONN_POST, conn->progress = 0;
 
 #ifdef SENDFILE_ENABLED 
 	if ( conn->res->atype == ZHTTP_MESSAGE_SENDFILE ) {
 		// Send the header first
 		int hlen = total;	
+		total = ( pos < hlen ) ? hlen - pos : 0, ptr += hlen - total;
 		for ( ; total; ) {
 			sent = send( conn->fd, ptr, total, MSG_DONTWAIT | MSG_NOSIGNAL );
 			if ( sent == 0 ) {
@@ -324,10 +459,13 @@ const int write_notls ( server_t *p, conn_t *conn ) {
 					return 0;
 				}
 
-				memset( &n, 0, sizeof( struct timespec ) );	
-				clock_gettime( CLOCK_REALTIME, &n );
-				
-				if ( ( n.tv_sec - timer.tv_sec ) >= p->wtimeout ) {
+				// Let the event loop do the waiting
+				if ( p->yield ) {
+					conn->progress = pos, conn->stage = CONN_WRITE;
+					return 1;
+				}
+
+				if ( srv_wait( conn->fd, POLLOUT, &timer, p->wtimeout ) < 1 ) {
 					// Cut if we can't get this message out for some reason
 					snprintf( conn->err, sizeof( conn->err ), 
 						"Timeout reached on write end of socket - header." );
@@ -335,17 +473,15 @@ const int write_notls ( server_t *p, conn_t *conn ) {
 					conn->stage = CONN_POST;
 					return 0;
 				}
-
-				FPRINTF("Trying again to send header to socket. (%d).\n", sent );
-				nanosleep( &__interval__, NULL );
 			}
 			FPRINTF( "Bytes sent: %d, leftover: %d\n", pos, total );
 		}
 		FPRINTF( "Header write complete (sent %d out of %d bytes)\n", pos, hlen );
 
-		// Then send the file
-		for ( total = conn->res->clen; total; ) {
-			sent = sendfile( conn->fd, conn->res->fd, NULL, CTX_WRITE_SIZE );
+		// Then send the file (descriptors can be shared, so keep our own offset)
+		off_t offset = ( pos > hlen ) ? pos - hlen : 0;
+		for ( total = conn->res->clen - offset; total; ) {
+			sent = sendfile( conn->fd, conn->res->fd, &offset, CTX_WRITE_SIZE );
 			FPRINTF( "Bytes sent from open file %d: %d\n", conn->fd, sent );
 			if ( sent == 0 )
 				break;
@@ -360,19 +496,18 @@ const int write_notls ( server_t *p, conn_t *conn ) {
 					return 0;
 				}
 
-				memset( &n, 0, sizeof( struct timespec ) );
-				clock_gettime( CLOCK_REALTIME, &n );
-				
-				if ( ( n.tv_sec - timer.tv_sec ) > p->wtimeout ) {
+				if ( p->yield ) {
+					conn->progress = pos, conn->stage = CONN_WRITE;
+					return 1;
+				}
+
+				if ( srv_wait( conn->fd, POLLOUT, &timer, p->wtimeout ) < 1 ) {
 					snprintf( conn->err, sizeof( conn->err ),
 						"Timeout reached on write end of socket - body." );
 					FPRINTF( "FATAL: %s\n", conn->err );
 					conn->stage = CONN_POST;
 					return 0;
 				}
-
-				FPRINTF("Trying again to send file to socket. (%d).\n", sent );
-				nanosleep( &__interval__, NULL );
 			}
 			FPRINTF( "Bytes sent: %d, leftover: %d\n", pos, total );
 		}
@@ -381,9 +516,18 @@ const int write_notls ( server_t *p, conn_t *conn ) {
 	}
 #endif
 
-	// Start writing data to socket
+	// Start writing data to socket, headers and body together without copying either
+	for ( total += blen - pos, sent = pos; mh.msg_iovlen && (size_t)sent >= mh.msg_iov->iov_len; mh.msg_iov++, mh.msg_iovlen-- ) {
+		sent -= mh.msg_iov->iov_len;
+	}
+
+	if ( mh.msg_iovlen ) {
+		mh.msg_iov->iov_base = (unsigned char *)mh.msg_iov->iov_base + sent;
+		mh.msg_iov->iov_len -= sent;
+	}
+
 	for ( ;; ) {
-		sent = send( conn->fd, ptr, total, MSG_DONTWAIT | MSG_NOSIGNAL );
+		sent = sendmsg( conn->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL );
 		FPRINTF( "Bytes sent: %d, over file %d\n", sent, conn->fd );
 
 		if ( sent == 0 ) {
@@ -391,7 +535,17 @@ const int write_notls ( server_t *p, conn_t *conn ) {
 			break;	
 		}
 		else if ( sent > -1 ) {
-			pos += sent, total -= sent, ptr += sent;	
+			pos += sent, total -= sent;
+
+			// Step past whatever was written
+			for ( ; mh.msg_iovlen && (size_t)sent >= mh.msg_iov->iov_len; mh.msg_iov++, mh.msg_iovlen-- ) {
+				sent -= mh.msg_iov->iov_len;
+			}
+
+			if ( mh.msg_iovlen ) {
+				mh.msg_iov->iov_base = (unsigned char *)mh.msg_iov->iov_base + sent;
+				mh.msg_iov->iov_len -= sent;
+			}
 			FPRINTF( "sent == %d, %d bytes remain to be sent...\n", sent, total );
 			if ( total == 0 ) {
 				FPRINTF( "sent == 0, assuming all %d bytes have been sent...\n", conn->res->mlen );
@@ -412,18 +566,18 @@ const int write_notls ( server_t *p, conn_t *conn ) {
 				return 0;	
 			}
 
-			memset( &n, 0, sizeof( struct timespec ) );	
-			clock_gettime( CLOCK_REALTIME, &n );
-			
-			if ( ( n.tv_sec - timer.tv_sec ) > p->wtimeout ) {
+			if ( p->yield ) {
+				conn->progress = pos, conn->stage = CONN_WRITE;
+				return 1;
+			}
+
+			if ( srv_wait( conn->fd, POLLOUT, &timer, p->wtimeout ) < 1 ) {
 				snprintf( conn->err, sizeof( conn->err ), 
 					"Timeout reached on write end of socket - body." );
 				FPRINTF( "%s\n", conn->err );
 				conn->stage = CONN_POST;
 				return 0;
 			}
-
-			nanosleep( &__interval__, NULL );
 		}
 		FPRINTF( "Bytes sent: %d, leftover: %d\n", pos, total );
 	}
@@ -436,6 +590,9 @@ const int write_notls ( server_t *p, conn_t *conn ) {
 
 // Deallocate these structures
 const void post_notls ( server_t *p, conn_t *conn ) {
+	// A body can be left part way through if the client went quiet
+	body_drop( conn->stream ), conn->stream = NULL;
+
 	// Also need to destroy the http bodies
 	http_free_body( conn->req ), http_free_body( conn->res );
 
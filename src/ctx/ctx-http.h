@@ -22,9 +22,12 @@
  * 
  * ------------------------------------------- */
 #include <time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <zhttp.h>
 #include "../server/server.h"
 #include "../config.h"
+#include "ctx-body.h"
 
 #ifdef SENDFILE_ENABLED
  #include <sys/sendfile.h>
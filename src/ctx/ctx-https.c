@@ -24,8 +24,13 @@ static const int bhsize = 4;
 // Size of zhttp_t object
 static const int zhttp_size = sizeof( zhttp_t );
 
-// Interval for fake polling here...
-static const struct timespec __interval__ = { 0, 100000000 };
+// Go-ahead for clients that sent 'Expect: 100-continue'
+static const char http_continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+#if TLS_SESSION_CACHE_SIZE > 0
+// Sessions kept for clients that resume by ID, shared by every thread and worker
+static struct gnutls_sesscache_t *sesscache = NULL;
+#endif
 
 
 
@@ -54,10 +59,205 @@ static void destroy_gnutls ( struct gnutls_abstr *g ) {
 
 
 
+#if TLS_SESSION_CACHE_SIZE > 0
+// Map the session cache where worker processes forked later will find it
+static int sess_cache_init ( void ) {
+	struct gnutls_sesscache_t *c = NULL;
+	pthread_mutexattr_t attr;
+	int status = 0;
+
+	c = mmap( NULL, sizeof( struct gnutls_sesscache_t ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if ( c == MAP_FAILED ) {
+		return 0;
+	}
+
+	// A worker that dies holding the lock mustn't take the cache down with it
+	pthread_mutexattr_init( &attr );
+	pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+	pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+	if ( !( status = ( pthread_mutex_init( &c->lock, &attr ) == 0 ) ) )
+		munmap( c, sizeof( struct gnutls_sesscache_t ) );
+	else {
+		sesscache = c;
+	}
+	pthread_mutexattr_destroy( &attr );
+	return status;
+}
+
+
+
+// Lock the cache, starting it over if a worker died part way through changing it
+static void sess_lock ( void ) {
+	if ( pthread_mutex_lock( &sesscache->lock ) == EOWNERDEAD ) {
+		memset( sesscache->slots, 0, sizeof( sesscache->slots ) );
+		pthread_mutex_consistent( &sesscache->lock );
+	}
+}
+
+
+
+// Find the slot a session ID belongs in
+static struct gnutls_sess_t * sess_slot ( gnutls_datum_t key ) {
+	unsigned int hash = 2166136261u;
+	for ( unsigned int i = 0; i < key.size; i++ ) {
+		hash = ( hash ^ key.data[ i ] ) * 16777619u;
+	}
+	return &sesscache->slots[ hash % TLS_SESSION_CACHE_SIZE ];
+}
+
+
+
+// Save a session, pushing out whatever was in its slot
+static int sess_store ( void *ptr, gnutls_datum_t key, gnutls_datum_t data ) {
+	struct gnutls_sess_t *e = NULL;
+
+	if ( !key.size || key.size > GNUTLS_MAX_SESSION_ID_SIZE || data.size > TLS_SESSION_DATA_SIZE ) {
+		return -1;
+	}
+
+	e = sess_slot( key );
+	sess_lock();
+	memcpy( e->key, key.data, key.size );
+	memcpy( e->data, data.data, data.size );
+	e->klen = key.size, e->dlen = data.size;
+	e->expires = gnutls_db_check_entry_expire_time( &data );
+	pthread_mutex_unlock( &sesscache->lock );
+	return 0;
+}
+
+
+
+// Hand back a copy of a saved session, if it hasn't expired
+static gnutls_datum_t sess_retrieve ( void *ptr, gnutls_datum_t key ) {
+	gnutls_datum_t data = { NULL, 0 };
+	struct gnutls_sess_t *e = NULL;
+
+	if ( !key.size || key.size > GNUTLS_MAX_SESSION_ID_SIZE ) {
+		return data;
+	}
+
+	e = sess_slot( key );
+	sess_lock();
+	if ( e->klen == key.size && !memcmp( e->key, key.data, key.size ) && e->expires > time( NULL ) ) {
+		if ( ( data.data = gnutls_malloc( e->dlen ) ) ) {
+			memcpy( data.data, e->data, e->dlen );
+			data.size = e->dlen;
+		}
+	}
+	pthread_mutex_unlock( &sesscache->lock );
+	return data;
+}
+
+
+
+// Drop a saved session
+static int sess_remove ( void *ptr, gnutls_datum_t key ) {
+	struct gnutls_sess_t *e = NULL;
+	int status = -1;
+
+	if ( !key.size || key.size > GNUTLS_MAX_SESSION_ID_SIZE ) {
+		return -1;
+	}
+
+	e = sess_slot( key );
+	sess_lock();
+	if ( e->klen == key.size && !memcmp( e->key, key.data, key.size ) ) {
+		memset( e, 0, sizeof( struct gnutls_sess_t ) );
+		status = 0;
+	}
+	pthread_mutex_unlock( &sesscache->lock );
+	return status;
+}
+#endif
+
+
+
+// Load a host's certificate chain and key
+static int load_cert ( struct gnutls_cert_t *c, const char *crt, const char *key ) {
+	gnutls_datum_t kd = { NULL, 0 };
+	int status = 0;
+
+	c->plen = CTXHTTPS_CHAIN_MAX;
+	if ( ( status = gnutls_pcert_list_import_x509_file( c->pcert, &c->plen, crt, GNUTLS_X509_FMT_PEM, NULL, NULL, 0 ) ) < 0 ) {
+		c->plen = 0;
+		return status;
+	}
+
+	if ( ( status = gnutls_load_file( key, &kd ) ) < 0 ) {
+		return status;
+	}
+
+	if ( ( status = gnutls_privkey_init( &c->key ) ) < 0 ) {
+		gnutls_free( kd.data );
+		return status;
+	}
+
+	status = gnutls_privkey_import_x509_raw( c->key, &kd, GNUTLS_X509_FMT_PEM, NULL, 0 );
+	gnutls_free( kd.data );
+	return status;
+}
+
+
+
+// Free every certificate chain and key that was loaded
+static void free_certs ( struct gnutls_ctx_t *t ) {
+	for ( int i = 0; t->certs && i < t->clen; i++ ) {
+		for ( unsigned int j = 0; j < t->certs[ i ].plen; j++ ) {
+			gnutls_pcert_deinit( &t->certs[ i ].pcert[ j ] );
+		}
+		( t->certs[ i ].key ) ? gnutls_privkey_deinit( t->certs[ i ].key ) : 0;
+	}
+	free( t->certs );
+	t->certs = NULL, t->clen = 0;
+}
+
+
+
+// Hand GnuTLS the certificate of whichever host the client named
+static int retrieve_cert ( gnutls_session_t session, const gnutls_datum_t *req_ca_rdn, int nreqs, 
+	const gnutls_pk_algorithm_t *pk_algos, int pk_algos_length, gnutls_pcert_st **pcert, 
+	unsigned int *pcert_length, gnutls_privkey_t *privkey ) {
+
+	struct gnutls_ctx_t *t = (struct gnutls_ctx_t *)gnutls_session_get_ptr( session );
+	char name[ CTXHTTPS_SNI_LENGTH ] = { 0 };
+	size_t size = sizeof( name ) - 1;
+	unsigned int type = GNUTLS_NAME_DNS;
+	struct lconfig *h = NULL;
+	int id = t->fallback;
+
+	// Clients that don't name a host get the first certificate that was loaded
+	if ( gnutls_server_name_get( session, name, &size, &type, 0 ) >= 0 ) {
+		if ( !( h = find_host( t->config, name ) ) || !h->tlsready || h->id >= t->clen ) {
+			return -1;
+		}
+		id = h->id;
+	}
+
+	if ( id < 0 ) {
+		return -1;
+	}
+
+	*pcert = t->certs[ id ].pcert;
+	*pcert_length = t->certs[ id ].plen;
+	*privkey = t->certs[ id ].key;
+	return 0;
+}
+
+
+
 // Attempts to process all the certificates we've asked for.  If it can't find or process one, server just dies.
-static int process_certs ( server_t *p, gnutls_certificate_credentials_t *t, int *count ) {
+static int process_certs ( server_t *p, struct gnutls_ctx_t *t, int *count ) {
 	int found = 0;
 
+	// Each host's certificate sits at the same position as the host
+	t->fallback = -1;
+	for ( struct lconfig **h = p->config->hosts; h && *h ; h++, t->clen++ );
+	if ( !( t->certs = calloc( t->clen, sizeof( struct gnutls_cert_t ) ) ) ) {
+		snprintf( p->err, sizeof( p->err ), "Could not allocate certificate table: %s\n", strerror( errno ) );
+		t->clen = 0;
+		return 0;
+	}
+
 	// Find the certificates and keys that each host is pointing to 
 	for ( struct lconfig **h = p->config->hosts; h && *h ; h++ ) {
 		// Define everything here
@@ -100,14 +300,15 @@ FPRINTF( "key access was bad\n" );
 				return 0;
 			}
 
-			// Simply load and associate
-			int status = gnutls_certificate_set_x509_key_file( *t, crt, key, GNUTLS_X509_FMT_PEM );
+			// Load now, and hand over during the handshake once the client names a host
+			int status = load_cert( &t->certs[ (*h)->id ], crt, key );
 			if ( status < 0 ) {
 				snprintf( p->err, sizeof( p->err ), "Could not set tls info for '%s': %s\n", (*h)->name, gnutls_strerror( status ) );
 				return 0;
 			}
 
 			(*h)->tlsready = 1;	
+			t->fallback = ( t->fallback == -1 ) ? (*h)->id : t->fallback;
 			(*count)++;
 			FPRINTF( "TLS connection data for host '%s' successfully initialized\n", (*h)->name );
 		}
@@ -118,6 +319,7 @@ FPRINTF( "key access was bad\n" );
 		return 0;
 	}
 
+	gnutls_certificate_set_retrieve_function2( t->creds, retrieve_cert );
 	return 1;
 }
 
@@ -129,8 +331,8 @@ int create_gnutls ( server_t *p ) {
 	// Define
 	int status = 0;
 	int certcount = 0;
-	const int size = sizeof( gnutls_certificate_credentials_t );
-	gnutls_certificate_credentials_t *bob = NULL;
+	const int size = sizeof( struct gnutls_ctx_t );
+	struct gnutls_ctx_t *bob = NULL;
 
 
 	// Initialize GnuTLS context
@@ -152,7 +354,7 @@ int create_gnutls ( server_t *p ) {
 
 
 	// Certificate credentials allocate and set 
-	if ( ( status = gnutls_certificate_allocate_credentials( bob ) ) != GNUTLS_E_SUCCESS ) {
+	if ( ( status = gnutls_certificate_allocate_credentials( &bob->creds ) ) != GNUTLS_E_SUCCESS ) {
 		snprintf( p->err, sizeof( p->err ),
 			"certificate strucutre allocation failed - %s", gnutls_strerror( status ) );
 		// FPRINTF( "%s\n", p->err );
@@ -163,14 +365,37 @@ int create_gnutls ( server_t *p ) {
 
 
 	// If we run it this way, it should just fail with no issue
+	bob->config = p->config;
 	if ( !process_certs( p, bob, &certcount ) ) {
-		gnutls_certificate_free_credentials( *bob );
+		free_certs( bob );
+		gnutls_certificate_free_credentials( bob->creds );
 		free( bob );
 		gnutls_global_deinit();
 		return 0;
 	}
 
 
+	// Tickets are sealed with keys derived from this one, which GnuTLS rotates on its own.
+	// Worker processes inherit it, so a ticket from one can be resumed by any of them.
+	if ( ( status = gnutls_session_ticket_key_generate( &bob->ticketkey ) ) != GNUTLS_E_SUCCESS ) {
+		snprintf( p->err, sizeof( p->err ),
+			"session ticket key generation failed - %s", gnutls_strerror( status ) );
+		free_certs( bob );
+		gnutls_certificate_free_credentials( bob->creds );
+		free( bob );
+		gnutls_global_deinit();
+		return 0;
+	}
+
+
+#if TLS_SESSION_CACHE_SIZE > 0
+	// Resuming by ID only saves a round trip, so without a cache clients just do full handshakes
+	if ( !sesscache && !sess_cache_init() ) {
+		fprintf( p->log_fd, "TLS session cache unavailable: %s\n", strerror( errno ) );
+	}
+#endif
+
+
 	// Set global context for this protocol
 	p->data = bob;
 	return 1;
@@ -178,17 +403,148 @@ int create_gnutls ( server_t *p ) {
 
 
 
+// Carry the handshake as far as the socket allows, then check the name the client asked for
+static int handshake_gnutls ( server_t *p, conn_t *conn ) {
+
+	// Define
+	struct gnutls_abstr *g = (struct gnutls_abstr *)conn->data;
+	struct gnutls_ctx_t *cred = (struct gnutls_ctx_t *)p->data;
+	unsigned int snitype = GNUTLS_NAME_DNS;
+	size_t snisize = CTXHTTPS_SNI_LENGTH;
+	struct timespec timer = {0};
+	int ret = 0, invalid = 1;
+
+	// Get the time at the start
+	clock_gettime( CLOCK_REALTIME, &timer );
+
+	// Perform and complete the handshake.  Get the server name as well.
+	do {
+		// TODO: Log any failures here
+	#if 0
+		// This is somewhat helpful debugging information
+		FPRINTF( "HANDSHAKE STATUS: %s\n", gnutls_handshake_description_get_name( ret ) );
+		FPRINTF( "CIPHERSUITE NAME: %s\n", gnutls_ciphersuite_get( g->session ) );
+		char *sgd = gnutls_session_get_desc( g->session );
+		FPRINTF( "CIPHERSUITE DESCRIPTION: %s\n", sgd );
+		free( sgd );
+	#endif
+		ret = gnutls_handshake( g->session );
+
+	#ifndef DISABLE_SNI
+		// Get the server name
+		if ( ret == GNUTLS_E_SUCCESS ) {
+			int sret = gnutls_server_name_get( g->session, g->sniname, &snisize, &snitype, 0 );
+			if ( sret < 0 || snisize == 0 ) {
+				// Without a name the client got the fallback certificate, the Host header picks the site
+				FPRINTF( "No server name sent: %s\n", gnutls_strerror( sret ) );
+				*g->sniname = '\0';
+				invalid = ( cred->fallback == -1 );
+			}
+			else {
+				// Check here that this is a valid host
+				struct lconfig *h = find_host( p->config, g->sniname );
+				invalid = !h || h->tlsready != 1;
+			}
+		}
+		else if ( ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED ) {
+			// TODO: There is more to the story here...
+			snprintf( conn->err, sizeof( conn->err ),
+				"GnuTLS handshake failed: %s\n", gnutls_strerror( ret ) );
+			FPRINTF( "FATAL: %s\n", conn->err );
+			destroy_gnutls( g ), conn->data = NULL;
+			conn->stage = CONN_POST;
+			return 0;
+		}
+	#endif
+
+		// Wait for whichever direction the handshake stalled on
+		if ( ret == GNUTLS_E_AGAIN ) {
+			short dir = gnutls_record_get_direction( g->session ) ? POLLOUT : POLLIN;
+
+			// The event loop comes back here once the socket is ready
+			if ( p->yield ) {
+				conn->wait = dir;
+				return 1;
+			}
+
+			if ( srv_wait( conn->fd, dir, &timer, p->rtimeout ) < 1 ) {
+				snprintf( conn->err, sizeof( conn->err ),
+					"GnuTLS handshake timed out.\n" );
+				FPRINTF( "FATAL: %s\n", conn->err );
+				destroy_gnutls( g ), conn->data = NULL;
+				conn->stage = CONN_POST;
+				return 0;
+			}
+		}
+	}
+	while ( ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED );
+
+	if ( ret < 0 ) {
+		snprintf( conn->err, sizeof( conn->err ),
+			"GnuTLS handshake failed: %s\n", gnutls_strerror( ret ) );
+		FPRINTF( "FATAL: %s\n", conn->err );
+		destroy_gnutls( g ), conn->data = NULL;
+		conn->stage = CONN_POST;
+		return 0;
+	}
+
+	if ( invalid ) {
+		snprintf( conn->err, sizeof( conn->err ),
+			"Invalid host '%s', requested\n", g->sniname );
+		FPRINTF( "FATAL: %s\n", conn->err );
+		destroy_gnutls( g ), conn->data = NULL;
+		conn->stage = CONN_POST;
+		return 0;
+	}
+
+	FPRINTF( "GnuTLS handshake succeeded.\n" );
+
+	// Keep count of how often clients were able to resume
+	if ( gnutls_session_is_resumed( g->session ) )
+		__atomic_add_fetch( &cred->resumed, 1, __ATOMIC_RELAXED );
+	else {
+		__atomic_add_fetch( &cred->full, 1, __ATOMIC_RELAXED );
+	}
+
+#ifdef CTXHTTPS_KTLS
+	// GnuTLS only does this when its system config turns it on and the tls module is loaded
+	if ( ( g->ktls = gnutls_transport_is_ktls_enabled( g->session ) & GNUTLS_KTLS_SEND ) ) {
+		__atomic_add_fetch( &cred->ktls, 1, __ATOMIC_RELAXED );
+	}
+#endif
+
+#if TLS_STATS_INTERVAL > 0
+	unsigned long full = __atomic_load_n( &cred->full, __ATOMIC_RELAXED );
+	unsigned long resumed = __atomic_load_n( &cred->resumed, __ATOMIC_RELAXED );
+	unsigned long ktls = __atomic_load_n( &cred->ktls, __ATOMIC_RELAXED );
+	if ( ( full + resumed ) % TLS_STATS_INTERVAL == 0 ) {
+		fprintf( p->log_fd, "TLS handshakes: %lu full, %lu resumed, %lu kernel\n", full, resumed, ktls );
+	}
+#endif
+
+	if ( !( conn->req = create_zhttp_t( ZHTTP_IS_CLIENT ) ) ) {
+		FPRINTF( "(%s)->pre failure: %s\n", p->ctx->name, "HTTP read end init failed" );
+		return 0;
+	}
+
+	if ( !( conn->res = create_zhttp_t( ZHTTP_IS_SERVER ) ) ) {
+		FPRINTF( "(%s)->pre failure: %s\n", p->ctx->name, "HTTP write end init failed" );
+		return 0;
+	}
+
+	conn->stage = CONN_READ;
+	return 1;
+}
+
+
+
 // Functions to run before we can speak to others via TLS + structure allocation
 const int pre_gnutls ( server_t *p, conn_t *conn ) {
 
 	// Define
 	struct gnutls_abstr *g = NULL;
-	int ret, invalid = 1, size = sizeof( struct gnutls_abstr );
-	unsigned int snitype = GNUTLS_NAME_DNS;
-	size_t snisize = CTXHTTPS_SNI_LENGTH;
-	int certfound = 0;
-	gnutls_certificate_credentials_t *cred =
-		(gnutls_certificate_credentials_t *)p->data;
+	int ret, size = sizeof( struct gnutls_abstr );
+	struct gnutls_ctx_t *cred = (struct gnutls_ctx_t *)p->data;
 
 	// Die if there are no credentials
 	if ( !cred ) {
@@ -199,6 +555,11 @@ const int pre_gnutls ( server_t *p, conn_t *conn ) {
 		return 0;
 	}
 
+	// A handshake that stopped to wait on the socket carries on where it was
+	if ( conn->data ) {
+		return handshake_gnutls( p, conn );
+	}
+
 	// Allocate a structure for the request process
 	if ( !( g = malloc( size )) || !memset( g, 0, size ) ) {
 		snprintf( conn->err, sizeof( conn->err ),
@@ -210,8 +571,7 @@ const int pre_gnutls ( server_t *p, conn_t *conn ) {
 
 	// Start a GnuTLS session
 	// TODO: You might need this too: GNUTLS_NO_SIGNAL 
-	ret = gnutls_init( &g->session,
-		GNUTLS_SERVER | GNUTLS_NONBLOCK | GNUTLS_NO_TICKETS );
+	ret = gnutls_init( &g->session, GNUTLS_SERVER | GNUTLS_NONBLOCK );
 	if ( ret != GNUTLS_E_SUCCESS ) {
 		snprintf( conn->err, sizeof( conn->err ),
 			"Failed to initialize new TLS session for incoming connection: %s\n",
@@ -235,7 +595,7 @@ const int pre_gnutls ( server_t *p, conn_t *conn ) {
 	}
 
 	// NOTE: What is this doing?
-	ret = gnutls_credentials_set( g->session, GNUTLS_CRD_CERTIFICATE, *cred );
+	ret = gnutls_credentials_set( g->session, GNUTLS_CRD_CERTIFICATE, cred->creds );
 	if ( ret != GNUTLS_E_SUCCESS ) {
 		snprintf( conn->err, sizeof( conn->err ), 
 			"Failed to set credentials for incoming connection: %s\n", 
@@ -245,6 +605,27 @@ const int pre_gnutls ( server_t *p, conn_t *conn ) {
 		return 0;
 	}
 
+	// Let returning clients skip the full handshake
+	ret = gnutls_session_ticket_enable_server( g->session, &cred->ticketkey );
+	if ( ret != GNUTLS_E_SUCCESS ) {
+		snprintf( conn->err, sizeof( conn->err ), 
+			"Failed to enable session tickets for incoming connection: %s\n", 
+			gnutls_strerror( ret ) );
+		FPRINTF( "FATAL: %s\n", conn->err );
+		conn->stage = CONN_POST;
+		return 0;
+	}
+
+	gnutls_db_set_cache_expiration( g->session, TLS_SESSION_LIFETIME );
+#if TLS_SESSION_CACHE_SIZE > 0
+	if ( sesscache ) {
+		gnutls_db_set_store_function( g->session, sess_store );
+		gnutls_db_set_retrieve_function( g->session, sess_retrieve );
+		gnutls_db_set_remove_function( g->session, sess_remove );
+		gnutls_db_set_ptr( g->session, NULL );
+	}
+#endif
+
 
 	// TODO: This might not be necessary
 	// gnutls_certificate_server_set_request( g->session, GNUTLS_CERT_IGNORE ); 
@@ -252,94 +633,206 @@ const int pre_gnutls ( server_t *p, conn_t *conn ) {
 	// Set a handshake timeout (perhaps a server or individual site option)
 	gnutls_handshake_set_timeout( g->session, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT );
 
+	// The certificate callback looks up hosts through this
+	gnutls_session_set_ptr( g->session, cred );
+
 	// Turn the open file into a secure socket
 	gnutls_transport_set_int( g->session, conn->fd );
 
-	// Perform and complete the handshake.  Get the server name as well.
-	do {
-		// TODO: Log any failures here
-		ret = gnutls_handshake( g->session );
-	#if 0
-		// This is somewhat helpful debugging information
-		FPRINTF( "HANDSHAKE STATUS: %s\n", gnutls_handshake_description_get_name( ret ) );
-		FPRINTF( "CIPHERSUITE NAME: %s\n", gnutls_ciphersuite_get( g->session ) );
-		char *sgd = gnutls_session_get_desc( g->session );
-		FPRINTF( "CIPHERSUITE DESCRIPTION: %s\n", sgd );
-		free( sgd );
-	#endif
-		ret = gnutls_handshake( g->session );
+	conn->data = g;
+	return handshake_gnutls( p, conn );
+}
 
-	#ifndef DISABLE_SNI
-		// Get the server name
-		if ( ret == GNUTLS_E_SUCCESS ) {
-			int sret = gnutls_server_name_get( g->session, g->sniname, &snisize, &snitype, 0 );
-			if ( sret < 0 || snisize == 0 ) {
-				// TODO: This really isn't fatal, but if the client does not
-				// support this, we can't safely move forward.  Need to add
-				// an explicit check for SNI support...
-				snprintf( conn->err, sizeof( conn->err ), 
-					"Could not get server name: %s\n", gnutls_strerror( sret ) );
+
+
+// Tell a client waiting on 'Expect: 100-continue' to send its body
+static void send_continue_gnutls ( server_t *p, conn_t *conn ) {
+	struct gnutls_abstr *g = (struct gnutls_abstr *)conn->data;
+	struct timespec timer = {0};
+	int sent = 0;
+
+	if ( !conn->req->expects ) {
+		return;
+	}
+
+	// Nothing is lost if this doesn't go out, the client sends the body anyway after a while
+	clock_gettime( CLOCK_REALTIME, &timer );
+	while ( ( sent = gnutls_record_send( g->session, http_continue, sizeof( http_continue ) - 1 ) ) < 0 ) {
+		if ( sent != GNUTLS_E_AGAIN && sent != GNUTLS_E_INTERRUPTED ) {
+			return;
+		}
+		if ( sent == GNUTLS_E_AGAIN && ( p->yield || srv_wait( conn->fd, POLLOUT, &timer, p->wtimeout ) < 1 ) ) {
+			return;
+		}
+	}
+}
+
+
+
+// Read a chunked or oversized body a piece at a time
+static int read_stream_gnutls ( server_t *p, conn_t *conn, int hlen, int total, struct timespec *timer ) {
+
+	// Define
+	struct gnutls_abstr *g = (struct gnutls_abstr *)conn->data;
+	struct cbody_t *b = conn->stream;
+	unsigned char buf[ CTX_READ_SIZE ];
+	unsigned char *hp = conn->req->preamble + ( hlen + bhsize );
+	int used = 0, left = total - ( hlen + bhsize );
+	const int room = ZHTTP_PREAMBLE_SIZE - ( hlen + bhsize );
+
+	// A body that stopped to wait on the socket carries on where it was
+	if ( b )
+		conn->stream = NULL;
+	else if ( !( b = malloc( sizeof( struct cbody_t ) ) ) ) {
+		conn->req->keepalive = 0;
+		conn->stage = CONN_WRITE;
+		(void)http_set_error( conn->res, 500, "Out of memory." );
+		return 1;
+	}
+	// Start with whatever arrived behind the header
+	else if ( body_init( b, conn->req ) && left > 0 && body_feed( b, hp, left, &used ) && b->done ) {
+		conn->pipepos = hlen + bhsize + used;
+		conn->pipelen = left - used;
+	}
+	else if ( !b->status ) {
+		send_continue_gnutls( p, conn );
+	}
+
+	// Get the rest of the message
+	for ( int rd; !b->done && !b->status; ) {
+		if ( ( rd = gnutls_record_recv( g->session, buf, body_want( b, sizeof( buf ) ) ) ) == 0 ) {
+			// The client gave up part way through, so there's no one to answer
+			body_drop( b );
+			conn->stage = CONN_POST;
+			return 1;
+		}
+		else if ( rd < 1 ) {
+
+			// Handle any TLS/TLS errors
+			if ( rd == GNUTLS_E_INTERRUPTED || rd == GNUTLS_E_REHANDSHAKE ) {
+				continue;
+			}
+			else if ( rd != GNUTLS_E_AGAIN ) {
+				snprintf( conn->err, sizeof( conn->err ), "%s",
+					(char *)gnutls_strerror( rd ) );
 				FPRINTF( "FATAL: %s\n", conn->err );
+				body_drop( b );
 				conn->stage = CONN_POST;
 				return 0;
 			}
-		
-			// Check here that this is a valid host
-			for ( struct lconfig **h = p->config->hosts; h && *h ; h++ ) {
-				if ( (*h)->tlsready == 1 ) {
-					if ( !strcmp( g->sniname, (*h)->name ) ) {
-						invalid = 0;
-						break;
-					}
-					else if ( (*h)->alias && !strcmp( g->sniname, (*h)->alias ) ) { 
-						invalid = 0;
-						break;
-					}
+
+			// Let the event loop do the waiting
+			if ( p->yield ) {
+				conn->stream = b, conn->progress = hlen;
+				conn->wait = gnutls_record_get_direction( g->session ) ? POLLOUT : POLLIN;
+				return 1;
+			}
+
+			if ( srv_wait( conn->fd, POLLIN, timer, p->rtimeout ) < 1 ) {
+				body_drop( b );
+				conn->req->keepalive = 0;
+				conn->stage = CONN_WRITE;
+				(void)http_set_error( conn->res, 408, "Timeout reached." );
+				return 1;
+			}
+		}
+		else {
+			// A chunked body can run into the next request, keep it if it fits
+			if ( body_feed( b, buf, rd, &used ) && b->done && used < rd ) {
+				if ( rd - used > room )
+					conn->req->keepalive = 0;
+				else {
+					memcpy( hp, &buf[ used ], rd - used );
+					conn->pipepos = hlen + bhsize, conn->pipelen = rd - used;
 				}
 			}
+
+			// Set timer to keep track of long running requests
+			clock_gettime( CLOCK_REALTIME, timer );
 		}
-		else if ( ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED ) {
-			// TODO: There is more to the story here...
-			snprintf( conn->err, sizeof( conn->err ),
-				"GnuTLS handshake failed: %s\n", gnutls_strerror( ret ) );
-			FPRINTF( "FATAL: %s\n", conn->err );
-			conn->stage = CONN_POST;
-			return 0;
-		}
-	#endif
 	}
-	while ( ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED );
 
-	if ( ret < 0 ) {
-		snprintf( conn->err, sizeof( conn->err ),
-			"GnuTLS handshake failed: %s\n", gnutls_strerror( ret ) );
-		FPRINTF( "FATAL: %s\n", conn->err );
-		conn->stage = CONN_POST;
-		return 0;
+	// Whatever is left of a refused body can't be told apart from the next request
+	if ( b->status || !body_finish( b ) ) {
+		(void)http_set_error( conn->res, b->status, b->err );
+		body_drop( b );
+		conn->req->keepalive = 0;
+		conn->stage = CONN_WRITE;
+		return 1;
 	}
 
-	if ( invalid ) {
-		snprintf( conn->err, sizeof( conn->err ),
-			"Invalid host '%s', requested\n", g->sniname );
-		FPRINTF( "FATAL: %s\n", conn->err );
-		conn->stage = CONN_POST;
-		return 0;
-	}
+	FPRINTF( "Read complete (streamed %d bytes of content)\n", conn->req->clen );
+	body_drop( b );
+	conn->stage = CONN_PROC;
+	return 1;
+}
 
-	FPRINTF( "GnuTLS handshake succeeded.\n" );
 
-	if ( !( conn->req = create_zhttp_t( ZHTTP_IS_CLIENT ) ) ) {
-		FPRINTF( "(%s)->pre failure: %s\n", p->ctx->name, "HTTP read end init failed" );
-		return 0;
+
+// Read the rest of a body that fits in memory
+static int read_body_gnutls ( server_t *p, conn_t *conn, int crecvd, struct timespec *timer ) {
+
+	// Define
+	struct gnutls_abstr *g = (struct gnutls_abstr *)conn->data;
+	const int size = CTX_READ_SIZE;
+	unsigned char *xp = conn->req->msg + crecvd;
+
+	// Never ask for more than the body, whatever follows it belongs to the next request
+	for ( int rd, bsize = size; crecvd < conn->req->clen; ) {
+		bsize = ( conn->req->clen - crecvd < size ) ? conn->req->clen - crecvd : size;
+		FPRINTF( "Attempting read of %d bytes in ptr %p\n", bsize, xp );
+		if ( ( rd = gnutls_record_recv( g->session, xp, bsize ) ) == 0 ) {
+			// TODO: Properly handle this case
+			conn->stage = CONN_PROC;
+			return 1;
+		}
+		else if ( rd < 1 ) {
+
+			// Handle any TLS/TLS errors
+			if ( rd == GNUTLS_E_INTERRUPTED || rd == GNUTLS_E_REHANDSHAKE ) {
+				continue;
+			}
+			else if ( rd != GNUTLS_E_AGAIN ) {
+				snprintf( conn->err, sizeof( conn->err ), "%s",
+					(char *)gnutls_strerror( rd ) );
+				FPRINTF( "FATAL: %s\n", conn->err );
+				conn->stage = CONN_POST;
+				return 0;
+			}
+
+			// Let the event loop do the waiting
+			if ( p->yield ) {
+				conn->progress = crecvd;
+				conn->wait = gnutls_record_get_direction( g->session ) ? POLLOUT : POLLIN;
+				return 1;
+			}
+
+			if ( srv_wait( conn->fd, POLLIN, timer, p->rtimeout ) < 1 ) {
+				conn->stage = CONN_WRITE;
+				(void)http_set_error( conn->res, 408, "Timeout reached." );
+				return 1;
+			}
+		}
+		else {
+			// Process a successfully read buffer
+			FPRINTF( "Received %d additional bytes on fd %d\n", rd, conn->fd ); 
+			xp += rd, crecvd += rd;
+
+			// Set timer to keep track of long running requests
+			clock_gettime( CLOCK_REALTIME, timer );
+		}
 	}
 
-	if ( !( conn->res = create_zhttp_t( ZHTTP_IS_SERVER ) ) ) {
-		FPRINTF( "(%s)->pre failure: %s\n", p->ctx->name, "HTTP write end init failed" );
-		return 0;
+	// Finally, process the body (chunked may still need something fancy)
+	if ( !http_parse_content( conn->req, conn->req->msg, conn->req->clen ) ) {
+		conn->stage = CONN_WRITE;
+		(void)http_set_error( conn->res, 500, (char *)conn->req->errmsg );
+		return 1;
 	}
 
-	conn->data = g;
-	conn->stage = CONN_READ;
+	FPRINTF( "Read complete (read %d out of %d bytes for content)\n",
+		crecvd, conn->req->clen );
+	conn->stage = CONN_PROC;
 	return 1;
 }
 
@@ -349,12 +842,11 @@ const int pre_gnutls ( server_t *p, conn_t *conn ) {
 const int read_gnutls ( server_t *p, conn_t *conn ) {
 
 	// Set references, initialize pointers
-	int total = 0, nsize, mult = 1, size = CTX_READ_SIZE;
+	int total = 0, nsize, mult = 1, size = CTX_READ_SIZE, wait = 0;
 	int hlen = -1, mlen = 0, bsize = ZHTTP_PREAMBLE_SIZE;
 	unsigned char *x = NULL, *xp = NULL;
 	struct gnutls_abstr *g = (struct gnutls_abstr *)conn->data;
 	struct timespec timer = {0};
-	struct timespec n = {0};
 
 	// Get the time
 	clock_gettime( CLOCK_REALTIME, &timer );
@@ -368,13 +860,34 @@ const int read_gnutls ( server_t *p, conn_t *conn ) {
 		return 0;
 	}
 
+	// A body that stopped to wait on the socket picks back up where it was (write starts from nothing)
+	if ( conn->stream || conn->req->msg ) {
+		int from = conn->progress;
+		conn->progress = 0;
+		if ( conn->stream )
+			return read_stream_gnutls( p, conn, from, 0, &timer );
+		return read_body_gnutls( p, conn, from, &timer );
+	}
+
 	// Set another pointer for just the headers
-	memset( x = conn->req->preamble, 0, ZHTTP_PREAMBLE_SIZE );
+	x = conn->req->preamble;
+
+	// Start with anything the client pipelined behind the last request (or sent before it had to wait)
+	if ( conn->pipelen > 0 ) {
+		total = conn->pipelen, bsize -= total, x += total;
+		hlen = http_header_received( conn->req->preamble, total ); 
+		conn->pipelen = 0;
+	}
 
 	// Read whatever the server sends and read until complete.
-	for ( int rd, flags, recvd = -1; recvd < 0 || bsize <= 0; ) {
+	for ( int rd, flags, recvd = hlen; recvd < 0 || bsize <= 0; ) {
 		rd = gnutls_record_recv( g->session, x, bsize );
 		if ( rd == 0 ) {
+			// A client closing between requests is not an error
+			if ( !total ) {
+				conn->stage = CONN_POST;
+				return 1;
+			}
 			// TODO: May need to tear down the connection.
 			// TODO: This indicates either an extremely slow read or perhaps a closed conn
 			break;
@@ -382,7 +895,7 @@ const int read_gnutls ( server_t *p, conn_t *conn ) {
 		else if ( rd < 1 ) {
 
 			// Handle any TLS/TLS errors
-			if ( rd == GNUTLS_E_INTERRUPTED || rd == GNUTLS_E_AGAIN ) {
+			if ( rd == GNUTLS_E_INTERRUPTED ) {
 				// FPRINTF( "TLS was interrupted...  Try request again...\n" );
 				continue;
 			}
@@ -390,7 +903,7 @@ const int read_gnutls ( server_t *p, conn_t *conn ) {
 				// FPRINTF( "TLS got handshake reauthentication request...\n" );
 				continue;
 			}
-			else {
+			else if ( rd != GNUTLS_E_AGAIN ) {
 				snprintf( conn->err, sizeof( conn->err ), "Got TLS error: %s",
 					(char *)gnutls_strerror( rd ) );
 				FPRINTF( "FATAL: %s\n", conn->err );
@@ -398,48 +911,39 @@ const int read_gnutls ( server_t *p, conn_t *conn ) {
 				return 0;
 			}
 
-			if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
-				// TODO: This should be logged somewhere
+			// Let the event loop do the waiting, holding on to whatever part of the header came in
+			if ( p->yield ) {
+				conn->pipelen = total;
+				conn->wait = gnutls_record_get_direction( g->session ) ? POLLOUT : POLLIN;
+				return 1;
+			}
+
+			// Persistent connections that go quiet are simply closed
+			if ( ( wait = srv_wait( conn->fd, POLLIN, &timer, ( !total && conn->count ) ? p->ktimeout : p->rtimeout ) ) == -1 ) {
 				snprintf( conn->err, sizeof( conn->err ),
-					"Got socket read error: %s\n", strerror( errno ) );
+					"Got socket poll error: %s\n", strerror( errno ) );
 				FPRINTF( "FATAL: %s\n", conn->err );
 				conn->stage = CONN_POST;
 				return 0;
 			}
-
-			// Get the time
-			memset( &n, 0, sizeof( struct timespec ) );
-			clock_gettime( CLOCK_REALTIME, &n );
-
-			// NOTE: This runs after an arbitrary limit
-			// TODO: Need to analyze avg write size & make sure that it is "worth it"
-			if ( ( n.tv_sec - timer.tv_sec ) >= p->rtimeout ) {
+			else if ( !wait && !total && conn->count ) {
+				conn->stage = CONN_POST;
+				return 1;
+			}
+			else if ( !wait ) {
 				conn->stage = CONN_WRITE;
 				(void)http_set_error( conn->res, 408, "Timeout reached." );
 				return 1;
 			}
-
-			// FPRINTF("Trying again to read from socket. Got %d bytes.\n", rd );
-			nanosleep( &__interval__, NULL );
 		}
 		else {
 			FPRINTF( "Received %d additional header bytes on fd %d\n", rd, conn->fd );
-			int pending = 0;
 			bsize -= rd, total += rd, x += rd;
 			recvd = http_header_received( conn->req->preamble, total ); 
 			hlen = recvd;
 			if ( recvd == ZHTTP_PREAMBLE_SIZE ) {
 				break;
 			}
-			// FPRINTF( "bsize: %d, total: %d, recvd: %d,", bsize, total, recvd );
-			if ( ( pending = gnutls_record_check_pending( g->session ) ) == 0 ) {
-				FPRINTF( "No data left in buffer?\n" );
-				break;
-			}
-			else {
-				FPRINTF( "Data left in buffer: %d bytes\n", pending );
-				continue;
-			}
 		}
 	}
 
@@ -459,14 +963,23 @@ const int read_gnutls ( server_t *p, conn_t *conn ) {
 
 	// If the message is not idempotent, stop and return.
 	if ( !conn->req->idempotent ) {
+		conn->pipepos = hlen + bhsize;
+		conn->pipelen = total - conn->pipepos;
 		conn->stage = CONN_PROC;
 		FPRINTF( "%s: Read complete, no content body (read %d bytes)\n",
 				p->ctx->name, total );
 		return 1;
 	}
 
+	// Bodies that are chunked or too big for memory are streamed
+	if ( conn->req->chunked || conn->req->clen > CTX_READ_MAX ) {
+		return read_stream_gnutls( p, conn, hlen, total, &timer );
+	}
+
 	// Check to see if we've fully received the message
-	if ( total == ( hlen + bhsize + conn->req->clen ) ) {
+	if ( total >= ( hlen + bhsize + conn->req->clen ) ) {
+		conn->pipepos = hlen + bhsize + conn->req->clen;
+		conn->pipelen = total - conn->pipepos;
 		conn->req->msg = conn->req->preamble + ( hlen + bhsize );
 		if ( !http_parse_content( conn->req, conn->req->msg, conn->req->clen ) ) {
 			conn->stage = CONN_WRITE;
@@ -479,28 +992,9 @@ const int read_gnutls ( server_t *p, conn_t *conn ) {
 		return 1;
 	}
 
-	// Check here if the thing is too big
-	if ( conn->req->clen > CTX_READ_MAX ) {
-		snprintf( conn->err, sizeof( conn->err ),
-			"Content-Length (%d) exceeds read max (%d).", conn->req->clen, CTX_READ_MAX );
-		conn->stage = CONN_WRITE;
-		(void)http_set_error( conn->res, 500, (char *)conn->err ); 
-		return 1;
-	}
-
-	#if 1
+	// The client may be holding the body back until it hears from us
 	nsize = conn->req->clen;
-	#else
-	if ( !conn->req->chunked )
-		nsize = conn->req->mlen + conn->req->clen + 4;	
-	else {
-		// For chunked encoding, allocate a sensible size.
-		// Then send a 100-continue to the server...
-		nsize = conn->req->mlen + size + 4;
-		char *a = http_make_request( conn->res, 100, "Continue" );
-		send( a ); 
-	}
-	#endif
+	send_continue_gnutls( p, conn );
 
 	// Allocate space for the content of the message (may wish to initialize the memory)
 	conn->req->atype = ZHTTP_MESSAGE_MALLOC;
@@ -523,82 +1017,7 @@ const int read_gnutls ( server_t *p, conn_t *conn ) {
 		xp += crecvd;
 	}
 
-	// Get the rest of the message
-	// FPRINTF( "crecvd: %d, clen: %d\n", crecvd, conn->req->clen );
-	for ( int rd, bsize = size; crecvd < conn->req->clen; ) {
-		FPRINTF( "Attempting read of %d bytes in ptr %p\n", bsize, xp );
-		// FPRINTF( "crevd: %d, clen: %d\n", crecvd, conn->req->clen );
-		if ( ( rd = gnutls_record_recv( g->session, xp, bsize ) ) == 0 ) {
-			// TODO: Properly handle this case
-			conn->stage = CONN_PROC;
-			return 1;
-		}
-		else if ( rd < 1 ) {
-
-			// Handle any TLS/TLS errors
-			if ( rd == GNUTLS_E_INTERRUPTED || rd == GNUTLS_E_AGAIN ) {
-				// FPRINTF( "TLS was interrupted...  Try request again...\n" );
-				continue;
-			}
-			else if ( rd == GNUTLS_E_REHANDSHAKE ) {
-				// FPRINTF( "TLS got handshake reauth request...\n" );
-				continue;
-			}
-			else {
-				// FPRINTF( "TLS got error code: %d = %s.\n", rd, gnutls_strerror( rd ) );
-				snprintf( conn->err, sizeof( conn->err ), "%s",
-					(char *)gnutls_strerror( rd ) );
-				FPRINTF( "FATAL: %s\n", conn->err );
-				conn->stage = CONN_POST;
-				return 0;
-			}
-			
-			// Most likely the other side is closed
-			if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
-				snprintf( conn->err, sizeof( conn->err ),
-					"Got socket read error: %s\n", strerror( errno ) );
-				FPRINTF( "FATAL: %s\n", conn->err );
-				conn->stage = CONN_POST;
-				return 0;
-			}
-
-			memset( &n, 0, sizeof( struct timespec ) );
-			clock_gettime( CLOCK_REALTIME, &n );
-
-			if ( ( n.tv_sec - timer.tv_sec ) >= p->rtimeout ) {
-				conn->stage = CONN_WRITE;
-				(void)http_set_error( conn->res, 408, "Timeout reached." );
-				return 1;
-			}
-
-			FPRINTF("Trying again to read from socket. Got %d bytes.\n", rd );
-			nanosleep( &__interval__, NULL );
-		}
-		else {
-			// Process a successfully read buffer
-			FPRINTF( "Received %d additional bytes on fd %d\n", rd, conn->fd ); 
-			xp += rd, total += rd, crecvd += rd;
-			if ( ( conn->req->clen - crecvd ) < size ) {
-				bsize = conn->req->clen - crecvd;
-			}
-
-			// Set timer to keep track of long running requests
-			FPRINTF( "Total so far: %d\n", total );
-			clock_gettime( CLOCK_REALTIME, &timer );
-		}
-	}
-
-	// Finally, process the body (chunked may still need something fancy)
-	if ( !http_parse_content( conn->req, conn->req->msg, conn->req->clen ) ) {
-		conn->stage = CONN_WRITE;
-		(void)http_set_error( conn->res, 500, (char *)conn->req->errmsg );
-		return 1;
-	}
-
-	FPRINTF( "Read complete (read %d out of %d bytes for content)\n",
-		crecvd, conn->req->clen );
-	conn->stage = CONN_PROC;
-	return 1;
+	return read_body_gnutls( p, conn, crecvd, &timer );
 }
 
 
@@ -606,14 +1025,15 @@ const int read_gnutls ( server_t *p, conn_t *conn ) {
 // Write a message to secure socket
 const int write_gnutls ( server_t *p, conn_t *conn ) {
 
-	// Define
-	int sent = 0, pos = 0, pending;
+	// Define (a write that stopped to wait on the socket starts after what it got out)
+	int sent = 0, pos = conn->progress, pending;
 	// zhttp_t *rq = conn->req;
 	// zhttp_t *rs = conn->res;
 	unsigned char *ptr = conn->res->msg;
-	int total = conn->res->mlen;
+	int total = conn->res->mlen, blen = 0;
+	unsigned char *body = http_get_response_body( conn->res, &blen );
 	struct gnutls_abstr *g = (struct gnutls_abstr *)conn->data;
-	struct timespec timer = {0}, n = {0};
+	struct timespec timer = {0};
 
 	// Check that g is something
 	if ( !g || !g->session ) {
@@ -628,12 +1048,13 @@ const int write_gnutls ( server_t *p, conn_t *conn ) {
 	clock_gettime( CLOCK_REALTIME, &timer );
 
 	// For now, we're not rewriting anything or starting again.
-	conn->stage = CONN_POST;
+	conn->stage = CONN_POST, conn->progress = 0;
 
  #ifdef SENDFILE_ENABLED
 	if ( conn->res->atype == ZHTTP_MESSAGE_SENDFILE ) {
 		// Send the header first
 		int hlen = total;	
+		total = ( pos < hlen ) ? hlen - pos : 0, ptr += hlen - total;
 		for ( ; total; ) {
 			sent = gnutls_record_send( g->session, ptr, total );
 			if ( sent == 0 ) {
@@ -660,8 +1081,39 @@ const int write_gnutls ( server_t *p, conn_t *conn ) {
 					return 0;
 				}
 
-				if ( errno != EAGAIN || errno != EWOULDBLOCK ) {
-					// Most likely, the other end closed early
+				// Let the event loop do the waiting
+				if ( sent == GNUTLS_E_AGAIN && p->yield ) {
+					conn->progress = pos, conn->stage = CONN_WRITE;
+					conn->wait = POLLOUT;
+					return 1;
+				}
+
+				if ( sent == GNUTLS_E_AGAIN && srv_wait( conn->fd, POLLOUT, &timer, p->wtimeout ) < 1 ) {
+					// Cut if we can't get this message out for some reason
+					snprintf( conn->err, sizeof( conn->err ),
+						"Timeout reached on write end of socket - header." );
+					FPRINTF( "%s\n", conn->err );
+					conn->stage = CONN_POST;
+					return 0;
+				}
+			}
+			FPRINTF( "Bytes sent: %d, leftover: %d\n", pos, total );
+		}
+		FPRINTF( "Header write complete (sent %d out of %d bytes)\n", pos, hlen );
+
+		// Then send the file (descriptors can be shared, so keep our own offset)
+		off_t offset = ( pos > hlen ) ? pos - hlen : 0;
+	#ifdef CTXHTTPS_KTLS
+		// The kernel encrypts whatever lands on the socket, so the file never comes up to us
+		for ( total = conn->res->clen - offset; g->ktls && total; ) {
+			sent = sendfile( conn->fd, conn->res->fd, &offset, CTX_WRITE_SIZE );
+			FPRINTF( "Bytes sent from open file %d over kTLS: %d\n", conn->res->fd, sent );
+			if ( sent == 0 )
+				break;
+			else if ( sent > -1 )
+				total -= sent, pos += sent;
+			else {
+				if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
 					snprintf( conn->err, sizeof( conn->err ),
 						"Got socket write error: %s\n", strerror( errno ) );
 					FPRINTF( "FATAL: %s\n", conn->err );
@@ -669,60 +1121,61 @@ const int write_gnutls ( server_t *p, conn_t *conn ) {
 					return 0;
 				}
 
-				if ( !total ) {
-					FPRINTF( "sent == %d, %d bytes remain to be sent...\n", sent, total );
+				// Let the event loop do the waiting
+				if ( errno != EINTR && p->yield ) {
+					conn->progress = pos, conn->stage = CONN_WRITE;
+					conn->wait = POLLOUT;
 					return 1;
 				}
-				
-				memset( &n, 0, sizeof( struct timespec ) );	
-				clock_gettime( CLOCK_REALTIME, &n );
-				
-				if ( ( n.tv_sec - timer.tv_sec ) >= p->wtimeout ) {
-					// Cut if we can't get this message out for some reason
+
+				if ( errno != EINTR && srv_wait( conn->fd, POLLOUT, &timer, p->wtimeout ) < 1 ) {
 					snprintf( conn->err, sizeof( conn->err ),
-						"Timeout reached on write end of socket - header." );
-					FPRINTF( "%s\n", conn->err );
+						"Timeout reached on write end of socket - body." );
+					FPRINTF( "FATAL: %s\n", conn->err );
 					conn->stage = CONN_POST;
 					return 0;
 				}
-
-				FPRINTF("Trying again to send header to socket. (%d).\n", sent );
-				nanosleep( &__interval__, NULL );
 			}
 			FPRINTF( "Bytes sent: %d, leftover: %d\n", pos, total );
 		}
-		FPRINTF( "Header write complete (sent %d out of %d bytes)\n", pos, hlen );
 
-		// Then send the file
-		for ( total = conn->res->clen; total; ) {
-			sent = gnutls_record_send_file( g->session, conn->res->fd, NULL, CTX_WRITE_SIZE );
+		if ( g->ktls ) {
+			FPRINTF( "Write complete (sent %d out of %d bytes)\n", pos, conn->res->clen );
+			return 1;
+		}
+	#endif
+
+		// Otherwise GnuTLS reads the file and encrypts it here
+		for ( total = conn->res->clen - offset; total; ) {
+			sent = gnutls_record_send_file( g->session, conn->res->fd, &offset, CTX_WRITE_SIZE );
 			FPRINTF( "Bytes sent from open file %d: %d\n", conn->res->fd, sent );
 			if ( sent == 0 )
 				break;
 			else if ( sent > -1 )
 				total -= sent, pos += sent;
 			else {
-				if ( errno != EAGAIN || errno != EWOULDBLOCK ) {
+				if ( sent != GNUTLS_E_INTERRUPTED && sent != GNUTLS_E_AGAIN ) {
 					snprintf( conn->err, sizeof( conn->err ), 
-						"Got socket write error: %s\n", strerror( errno ) );
+						"Got socket write error: %s\n", gnutls_strerror( sent ) );
 					FPRINTF( "FATAL: %s\n", conn->err );
 					conn->stage = CONN_POST;
 					return 0;	
 				}
 
-				memset( &n, 0, sizeof( struct timespec ) );
-				clock_gettime( CLOCK_REALTIME, &n );
-				
-				if ( ( n.tv_sec - timer.tv_sec ) > p->wtimeout ) {
+				// Let the event loop do the waiting
+				if ( sent == GNUTLS_E_AGAIN && p->yield ) {
+					conn->progress = pos, conn->stage = CONN_WRITE;
+					conn->wait = POLLOUT;
+					return 1;
+				}
+
+				if ( sent == GNUTLS_E_AGAIN && srv_wait( conn->fd, POLLOUT, &timer, p->wtimeout ) < 1 ) {
 					snprintf( conn->err, sizeof( conn->err ),
 						"Timeout reached on write end of socket - body." );
 					FPRINTF( "FATAL: %s\n", conn->err );
 					conn->stage = CONN_POST;
 					return 0;
 				}
-
-				FPRINTF("Trying again to send file to socket. (%d).\n", sent );
-				nanosleep( &__interval__, NULL );
 			}
 			FPRINTF( "Bytes sent: %d, leftover: %d\n", pos, total );
 		}
@@ -733,7 +1186,14 @@ const int write_gnutls ( server_t *p, conn_t *conn ) {
 #endif
 
 
-	// Start writing data to socket
+	// Pick up after whatever went out before the socket filled
+	if ( pos >= total && blen > 0 )
+		ptr = body + ( pos - total ), total = blen - ( pos - total ), blen = 0;
+	else {
+		ptr += pos, total -= pos;
+	}
+
+	// Start writing data to socket, the body goes out from its own buffer once the headers are done
 	for ( ;; ) {
 		sent = gnutls_record_send( g->session, ptr, total );
 		FPRINTF( "Bytes sent: %d, over file %d\n", sent, conn->fd );
@@ -744,17 +1204,37 @@ const int write_gnutls ( server_t *p, conn_t *conn ) {
 		else if ( sent > -1 ) {
 			pos += sent, total -= sent, ptr += sent;
 			FPRINTF( "sent == %d, %d bytes remain to be sent...\n", sent, total );
-			if ( total == 0 ) {
+			if ( total == 0 && blen > 0 ) {
+				ptr = body, total = blen, blen = 0;
+			}
+			else if ( total == 0 ) {
 				FPRINTF( "total == 0, assuming all %d bytes have been sent...\n", conn->res->mlen );
 				break;
 			}
 		}
 		else {
 			FPRINTF( "Caught error condition: %d, %s\n", sent, gnutls_strerror( sent ) );
-			if ( sent == GNUTLS_E_INTERRUPTED || sent == GNUTLS_E_AGAIN ) {
+			if ( sent == GNUTLS_E_INTERRUPTED ) {
 				FPRINTF("TLS was interrupted...  Try request again...\n" );
 				continue;
 			}
+			else if ( sent == GNUTLS_E_AGAIN ) {
+				// Let the event loop do the waiting
+				if ( p->yield ) {
+					conn->progress = pos, conn->stage = CONN_WRITE;
+					conn->wait = POLLOUT;
+					return 1;
+				}
+
+				if ( srv_wait( conn->fd, POLLOUT, &timer, p->wtimeout ) < 1 ) {
+					snprintf( conn->err, sizeof( conn->err ),
+						"Timeout reached on write end of socket - body." );
+					FPRINTF( "%s\n", conn->err );
+					conn->stage = CONN_POST;
+					return 0;
+				}
+				continue;
+			}
 			#if 0
 			else if ( sent == EAGAIN || sent == EWOULDBLOCK ) {
 				if ( ++try == 2 ) {
@@ -771,32 +1251,6 @@ const int write_gnutls ( server_t *p, conn_t *conn ) {
 					"Caught unknown condition: %s\n", gnutls_strerror( sent ) );
 				return 0;
 			}
-
-			if ( !total ) {
-				FPRINTF( "sent == %d, total = 0:  Message should be done\n", sent );
-				return 1;
-			}
-			
-			if ( errno != EAGAIN || errno != EWOULDBLOCK ) {
-				snprintf( conn->err, sizeof( conn->err ),
-					"Got socket write error: %s\n", strerror( errno ) );
-				FPRINTF( "FATAL: %s\n", conn->err );
-				conn->stage = CONN_POST;
-				return 0;
-			}
-
-			memset( &n, 0, sizeof( struct timespec ) );
-			clock_gettime( CLOCK_REALTIME, &n );
-			
-			if ( ( n.tv_sec - timer.tv_sec ) > p->wtimeout ) {
-				snprintf( conn->err, sizeof( conn->err ),
-					"Timeout reached on write end of socket - body." );
-				FPRINTF( "%s\n", conn->err );
-				conn->stage = CONN_POST;
-				return 0;
-			}
-
-			nanosleep( &__interval__, NULL );
 		}
 		FPRINTF( "Bytes sent: %d, leftover: %d\n", pos, total );
 	}
@@ -814,12 +1268,19 @@ const void post_gnutls ( server_t *p, conn_t *conn ) {
 	// Close TLS sesssion
 	struct gnutls_abstr *g = (struct gnutls_abstr *)conn->data;
 	int stat = 0;
-	if ( ( stat = gnutls_bye( g->session, GNUTLS_SHUT_RDWR ) ) < 0 ) {
+	if ( g && ( stat = gnutls_bye( g->session, GNUTLS_SHUT_RDWR ) ) < 0 ) {
 		FPRINTF( "Could not shut down GnuTLS connection: %s.\n", gnutls_strerror( stat ) );
 	}
 
 	// Destroy the context and the session
-	destroy_gnutls( g );
+	destroy_gnutls( g ), conn->data = NULL;
+
+	// A handshake or body can be left part way through if the client went quiet
+	body_drop( conn->stream ), conn->stream = NULL;
+	if ( !conn->req || !conn->res ) {
+		free( conn->req ), free( conn->res );
+		return;
+	}
 
 	// Also need to destroy the http bodies
 	http_free_body( conn->req ), http_free_body( conn->res );
@@ -836,9 +1297,12 @@ const void post_gnutls ( server_t *p, conn_t *conn ) {
 // Destroy the GnuTLS context completely
 void free_gnutls( server_t *p ) {
 	FPRINTF( "Destroying pre data for current protocol.\n" );
-	gnutls_certificate_credentials_t *cred =   
-		(gnutls_certificate_credentials_t *)p->data;
-	gnutls_certificate_free_credentials( *cred );
+	struct gnutls_ctx_t *cred = (struct gnutls_ctx_t *)p->data;
+	FPRINTF( "TLS handshakes: %lu full, %lu resumed\n", cred->full, cred->resumed );
+	gnutls_certificate_free_credentials( cred->creds );
+	free_certs( cred );
+	gnutls_memset( cred->ticketkey.data, 0, cred->ticketkey.size );
+	gnutls_free( cred->ticketkey.data );
 	free( p->data );
 	p->data = NULL;
 	gnutls_global_deinit();
@@ -21,12 +21,15 @@
  * - 
  * ------------------------------------------- */
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stddef.h>
+#include <pthread.h>
 #include <zwalker.h>
 #include <ztable.h>
 #include "../server/server.h"
 #include "../util.h"
 #include "../config.h"
+#include "ctx-body.h"
 
 #ifdef SENDFILE_ENABLED
  #include <sys/sendfile.h>
@@ -34,14 +37,56 @@
 
 #if !defined(DISABLE_TLS) && !defined(CTXHTTPS_H)
  #include <gnutls/gnutls.h>
+ #include <gnutls/abstract.h>
+ #include <gnutls/socket.h>
  #define CTXHTTPS_H
  #define CTXHTTPS_SNI_LENGTH 128
+ #define CTXHTTPS_CHAIN_MAX 16
+ #if TLS_KTLS && GNUTLS_VERSION_NUMBER >= 0x030703
+  #define CTXHTTPS_KTLS
+ #endif
+
+//A host's certificate chain and key, handed over when a client asks for it by name
+struct gnutls_cert_t {
+	gnutls_pcert_st pcert[ CTXHTTPS_CHAIN_MAX ];
+	unsigned int plen;
+	gnutls_privkey_t key;
+};
+
+//What every TLS connection on a listener shares
+struct gnutls_ctx_t {
+	gnutls_certificate_credentials_t creds;
+	struct sconfig *config;
+	struct gnutls_cert_t *certs;
+	int clen;
+	int fallback;
+	gnutls_datum_t ticketkey;
+	unsigned long full;
+	unsigned long resumed;
+	unsigned long ktls;
+};
+
+//A TLS session kept for a client that resumes by session ID
+struct gnutls_sess_t {
+	time_t expires;
+	unsigned int klen;
+	unsigned int dlen;
+	unsigned char key[ GNUTLS_MAX_SESSION_ID_SIZE ];
+	unsigned char data[ TLS_SESSION_DATA_SIZE ];
+};
+
+//Every saved session, mapped before the workers fork so all of them share it
+struct gnutls_sesscache_t {
+	pthread_mutex_t lock;
+	struct gnutls_sess_t slots[ TLS_SESSION_CACHE_SIZE ];
+};
 
 // TODO: Can probably trim this even more
 struct gnutls_abstr {
 	gnutls_certificate_credentials_t *cbob;
 	gnutls_session_t session;
 	char sniname[ CTXHTTPS_SNI_LENGTH ]; // The SNI name?
+	int ktls; // Does the kernel encrypt what we write?
 };
 
 const int pre_gnutls ( server_t *, conn_t * );
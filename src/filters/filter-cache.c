@@ -0,0 +1,476 @@
+/* ------------------------------------------- *
+ * filter-cache.c
+ * ===========
+ *
+ * Summary
+ * -------
+ * Finished responses kept in memory for routes that ask for it.
+ *
+ * Usage
+ * -----
+ * A route in a site's config.lua opts in with a 'cache' key holding the
+ * number of seconds a response stays fresh.  An optional 'vary' list
+ * names the request headers (or, starting with '?', the query keys)
+ * that get a response of their own:
+ *
+ *   routes = {
+ *     ["posts"] = { model = "posts", view = "posts", cache = 30, vary = { "Accept-Language", "?page" } }
+ *   }
+ *
+ * Without any '?' keys in 'vary', the whole query string is part of the
+ * key.  Requests carrying a Cookie are passed to the filter unless the
+ * route lists "Cookie" in 'vary'.  Only GET requests that came back 200
+ * without setting a cookie are kept, and each copy that goes out gets
+ * a Date of its own.  Once a response is older than its ttl, the next request
+ * rebuilds it while everyone else is served the old copy for up to
+ * another ttl seconds.
+ *
+ * Responses live in RESPONSE_CACHE_SHARDS separately locked tables, each
+ * dropping its least recently used entries once it holds more than its
+ * share of RESPONSE_CACHE_BYTES.
+ *
+ * LICENSE
+ * -------
+ * Copyright 2020-2021 Tubular Modular Inc. dba Collins Design
+ *
+ * See LICENSE in the top-level directory for more information.
+ *
+ * CHANGELOG
+ * ---------
+ *
+ * ------------------------------------------- */
+#define _GNU_SOURCE
+#include "filter-cache.h"
+
+static const char datefmt[] = "%a, %d %b %Y %H:%M:%S GMT";
+
+//A slice of the response cache with its own lock
+struct rshard_t {
+	pthread_mutex_t lock;
+	struct rentry_t *buckets[ RCACHE_BUCKETS ];
+	struct rentry_t *newest, *oldest;
+	long bytes;
+};
+
+static struct rshard_t rshards[ RESPONSE_CACHE_SHARDS ];
+
+static pthread_once_t rshard_once = PTHREAD_ONCE_INIT;
+
+//Sites that have been checked for cacheable routes
+static struct chost_t *chosts = NULL;
+
+static pthread_rwlock_t chost_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+
+//Set up every shard
+static void rshard_init ( void ) {
+	for ( int i = 0; i < RESPONSE_CACHE_SHARDS; i++ ) {
+		pthread_mutex_init( &rshards[ i ].lock, NULL );
+	}
+}
+
+
+
+//Free the rules of a site
+static void free_rules ( struct crule_t *rules, int len ) {
+	for ( int i = 0; i < len; i++ ) {
+		for ( char **v = rules[ i ].vary; v && *v; v++ ) {
+			free( *v );
+		}
+		free( rules[ i ].vary );
+	}
+	free( rules );
+}
+
+
+
+//Read a route's 'cache' and 'vary' keys, skipping whatever routes are nested under it
+static int read_rule ( zKeyval *kv, int i, void *p ) {
+	struct cread_t *cr = (struct cread_t *)p;
+	const char *key = ( kv->key.type == ZTABLE_TXT ) ? kv->key.v.vchar : NULL;
+
+	if ( cr->depth == 1 && key && !strcmp( key, "cache" ) ) {
+		if ( kv->value.type == ZTABLE_INT && kv->value.v.vint > 0 )
+			cr->rule->ttl = kv->value.v.vint;
+		else if ( kv->value.type == ZTABLE_FLT && kv->value.v.vfloat >= 1 ) {
+			cr->rule->ttl = kv->value.v.vfloat;
+		}
+	}
+
+	if ( kv->value.type == ZTABLE_TBL ) {
+		cr->vary = ( cr->depth == 1 && key && !strcmp( key, "vary" ) );
+		cr->depth++;
+		return 1;
+	}
+
+	if ( cr->vary && cr->depth == 2 && kv->value.type == ZTABLE_TXT && *kv->value.v.vchar ) {
+		add_item( &cr->rule->vary, strdup( kv->value.v.vchar ), char *, &cr->vlen );
+	}
+
+	if ( kv->key.type == ZTABLE_TRM && --cr->depth == 1 ) {
+		cr->vary = 0;
+	}
+	return 1;
+}
+
+
+
+//Read the cache rules of every route out of a site's compiled config.lua
+static int load_rules ( struct lstate_t *ls, void *data ) {
+	struct chost_t *ch = (struct chost_t *)data;
+
+	for ( int i = 0; ls->iroutes && ls->iroutes[ i ]; i++ ) {
+		struct crule_t *rules = NULL;
+		struct cread_t cr = { 0 };
+		ztable_t *t = NULL;
+
+		if ( !( rules = realloc( ch->rules, sizeof( struct crule_t ) * ( ch->rulelen + 1 ) ) ) ) {
+			return 0;
+		}
+
+		//Rules line up with the filter's own routes, so both resolve a path the same way
+		ch->rules = rules, cr.rule = &rules[ ch->rulelen++ ], cr.depth = 1;
+		memset( cr.rule, 0, sizeof( struct crule_t ) );
+		if ( !route_trie_add( &ch->rtrie, ls->iroutes[ i ]->route, i ) ) {
+			return 0;
+		}
+
+		if ( ( t = lt_copy_by_index( ls->zroutes, ls->iroutes[ i ]->index ) ) ) {
+			lt_exec_complex( t, 1, t->count, &cr, read_rule );
+			lt_free( t ), free( t );
+		}
+
+		//A rule that can't be cached has nothing to vary on
+		if ( !cr.rule->ttl && cr.rule->vary ) {
+			for ( char **v = cr.rule->vary; *v; v++ ) free( *v );
+			free( cr.rule->vary ), cr.rule->vary = NULL;
+		}
+	}
+
+	return 1;
+}
+
+
+
+//Find a site's routes, reading them again if its configuration changed
+static struct chost_t * find_chost ( const struct lconfig *host ) {
+	struct chost_t *ch = NULL, n = { 0 };
+	int generation = 0, last = 0;
+
+	pthread_rwlock_rdlock( &chost_lock );
+	for ( ch = chosts; ch && ch->host != host; ch = ch->next ) ;
+	generation = last = ( ch ) ? ch->generation : 0;
+	pthread_rwlock_unlock( &chost_lock );
+
+	if ( !ch ) {
+		pthread_rwlock_wrlock( &chost_lock );
+		for ( ch = chosts; ch && ch->host != host; ch = ch->next ) ;
+		if ( !ch && ( ch = malloc( sizeof( struct chost_t ) ) ) ) {
+			memset( ch, 0, sizeof( struct chost_t ) );
+			ch->host = host, ch->generation = -1;
+			ch->next = chosts, chosts = ch;
+		}
+		generation = last = ( ch ) ? ch->generation : 0;
+		pthread_rwlock_unlock( &chost_lock );
+	}
+
+	if ( !ch ) {
+		return NULL;
+	}
+
+	//The Lua filter already keeps the site's routes compiled, and knows when they changed
+	if ( !filter_lua_config( host, &generation, load_rules, &n ) ) {
+		route_trie_free( n.rtrie ), free_rules( n.rules, n.rulelen );
+		memset( &n, 0, sizeof( struct chost_t ) );
+	}
+
+	//Responses built under the old routes are thrown out as they're found
+	if ( generation != last ) {
+		FPRINTF( "Loaded cacheable routes for '%s'\n", host->name );
+		pthread_rwlock_wrlock( &chost_lock );
+		if ( generation > ch->generation ) {
+			route_trie_free( ch->rtrie ), free_rules( ch->rules, ch->rulelen );
+			ch->rtrie = n.rtrie, ch->rules = n.rules, ch->rulelen = n.rulelen;
+			ch->generation = generation;
+			memset( &n, 0, sizeof( struct chost_t ) );
+		}
+		pthread_rwlock_unlock( &chost_lock );
+	}
+
+	route_trie_free( n.rtrie ), free_rules( n.rules, n.rulelen );
+	return ch;
+}
+
+
+
+//Find the value of a request record
+static zhttpr_t * get_record ( zhttpr_t **list, const char *name ) {
+	for ( zhttpr_t **h = list; h && *h; h++ ) {
+		if ( (*h)->field && !strcasecmp( (*h)->field, name ) ) {
+			return *h;
+		}
+	}
+	return NULL;
+}
+
+
+
+//Build the key of a request if its route is cached
+static int make_key ( struct chost_t *ch, conn_t *conn, struct cfill_t *cf ) {
+	char path[ RCACHE_KEY_LEN ] = { 0 };
+	const char *query = conn->req->path + strcspn( conn->req->path, "?#" );
+	int plen = query - conn->req->path, qlen = 0, i = -1, len = 0, keyed = 0, cookie = 0;
+	struct crule_t *r = NULL;
+
+	if ( plen >= (int)sizeof( path ) ) {
+		return 0;
+	}
+
+	memcpy( path, conn->req->path, plen );
+	len = snprintf( cf->key, RCACHE_KEY_LEN, "%s\n%s", conn->config->name, path );
+	qlen = ( *query == '?' ) ? (int)strcspn( query, "#" ) : 0;
+
+	pthread_rwlock_rdlock( &chost_lock );
+	if ( ( i = route_trie_resolve( ch->rtrie, path ) ) == -1 || !( r = &ch->rules[ i ] )->ttl ) {
+		pthread_rwlock_unlock( &chost_lock );
+		return 0;
+	}
+
+	//Each varying header or query key gets its own line, missing ones are left empty
+	for ( char **v = r->vary; v && *v && len < RCACHE_KEY_LEN; v++ ) {
+		zhttpr_t *h = ( **v == '?' ) ? get_record( conn->req->url, *v + 1 ) : get_record( conn->req->headers, *v );
+		keyed |= ( **v == '?' ), cookie |= !strcasecmp( *v, "Cookie" );
+		len += ( h )
+			? snprintf( &cf->key[ len ], RCACHE_KEY_LEN - len, "\n=%.*s", h->size, h->value )
+			: snprintf( &cf->key[ len ], RCACHE_KEY_LEN - len, "\n" );
+	}
+
+	cf->ttl = r->ttl, cf->generation = ch->generation;
+	pthread_rwlock_unlock( &chost_lock );
+
+	//Unless the route names the query keys it cares about, the whole query string counts
+	if ( !keyed && qlen && len < RCACHE_KEY_LEN ) {
+		len += snprintf( &cf->key[ len ], RCACHE_KEY_LEN - len, "\n%.*s", qlen, query );
+	}
+
+	//A request with cookies could be anybody's, so it's only cached if the route varies on them
+	if ( len >= RCACHE_KEY_LEN || ( !cookie && get_record( conn->req->headers, "Cookie" ) ) ) {
+		cf->ttl = 0;
+		return 0;
+	}
+
+	cf->klen = len, cf->hash = 2166136261u;
+	for ( i = 0; i < len; i++ ) {
+		cf->hash = ( cf->hash ^ (unsigned char)cf->key[ i ] ) * 16777619u;
+	}
+	return 1;
+}
+
+
+
+//Let go of an entry, freeing it once nobody is sending it anymore
+static void rentry_release ( struct rentry_t *e ) {
+	if ( __atomic_sub_fetch( &e->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+		free( e );
+	}
+}
+
+
+
+static struct rentry_t ** rentry_bucket ( struct rshard_t *s, unsigned int hash ) {
+	return &s->buckets[ ( hash / RESPONSE_CACHE_SHARDS ) % RCACHE_BUCKETS ];
+}
+
+
+
+//Take an entry out of its shard (which must be locked)
+static void rentry_unlink ( struct rshard_t *s, struct rentry_t *e ) {
+	struct rentry_t **b = rentry_bucket( s, e->hash );
+	for ( ; *b && *b != e; b = &(*b)->next ) ;
+	( *b ) ? *b = e->next : 0;
+
+	( e->lprev ) ? e->lprev->lnext = e->lnext : ( s->newest = e->lnext );
+	( e->lnext ) ? e->lnext->lprev = e->lprev : ( s->oldest = e->lprev );
+
+	s->bytes -= sizeof( struct rentry_t ) + e->klen + e->mlen;
+	rentry_release( e );
+}
+
+
+
+//Find the entry for a key, dropping it if it's past saving (the shard must be locked)
+static struct rentry_t * rentry_find ( struct rshard_t *s, struct cfill_t *cf, time_t now ) {
+	for ( struct rentry_t *e = *rentry_bucket( s, cf->hash ); e; e = e->next ) {
+		if ( e->hash == cf->hash && e->klen == cf->klen && !memcmp( e->data, cf->key, cf->klen ) ) {
+			if ( e->generation != cf->generation || e->stale <= now ) {
+				rentry_unlink( s, e );
+				return NULL;
+			}
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+
+//Send a copy of a cached response, with the Connection (and Date) header this request needs
+static int rentry_send ( conn_t *conn, struct rentry_t *e ) {
+	const char *conn_value = ( conn->res->keepalive ) ? "keep-alive" : "close";
+	const unsigned char *msg = e->data + e->klen;
+	char extra[ 128 ] = { 0 }, date[ RCACHE_DATE_LEN ] = { 0 };
+	unsigned char *out = NULL;
+	int xlen = 0, len = 0;
+	time_t now = time( NULL );
+	struct tm tm = { 0 };
+
+	if ( e->date ) {
+		strftime( date, sizeof( date ), datefmt, gmtime_r( &now, &tm ) );
+		xlen = snprintf( extra, sizeof( extra ), "Connection: %s\r\nDate: %s\r\n", conn_value, date );
+	}
+	else {
+		xlen = snprintf( extra, sizeof( extra ), "Connection: %s\r\n", conn_value );
+	}
+
+	if ( !( out = malloc( len = e->mlen + xlen ) ) ) {
+		return 0;
+	}
+
+	memcpy( out, msg, e->head );
+	memcpy( out + e->head, extra, xlen );
+	memcpy( out + e->head + xlen, msg + e->head, e->mlen - e->head );
+
+	conn->res->msg = out, conn->res->mlen = len;
+	conn->res->atype = ZHTTP_MESSAGE_MALLOC;
+	conn->res->status = 200;
+	return 1;
+}
+
+
+
+//Answer a request from the cache, returns 0 if the filter needs to run
+const int filter_cache_serve ( const server_t *p, conn_t *conn, struct cfill_t *cf ) {
+	struct chost_t *ch = NULL;
+	struct rshard_t *s = NULL;
+	struct rentry_t *e = NULL;
+	zhttp_t *req = conn->req;
+	time_t now = 0;
+	int sent = 0;
+
+	cf->ttl = 0;
+	if ( !req->path || !req->method || strcmp( req->method, "GET" ) ) {
+		return 0;
+	}
+
+	if ( !conn->config->dir || !conn->config->filter || strcmp( conn->config->filter, "lua" ) ) {
+		return 0;
+	}
+
+	if ( !( ch = find_chost( conn->config ) ) || !make_key( ch, conn, cf ) ) {
+		return 0;
+	}
+
+	pthread_once( &rshard_once, rshard_init );
+	s = &rshards[ cf->hash % RESPONSE_CACHE_SHARDS ];
+	now = time( NULL );
+
+	pthread_mutex_lock( &s->lock );
+	if ( ( e = rentry_find( s, cf, now ) ) ) {
+		//The first request to find an expired response rebuilds it, the rest get the old one
+		if ( e->expires <= now && !e->refreshing ) {
+			e->refreshing = 1, e = NULL;
+		}
+		else if ( s->newest != e ) {
+			e->lprev->lnext = e->lnext;
+			( e->lnext ) ? e->lnext->lprev = e->lprev : ( s->oldest = e->lprev );
+			e->lprev = NULL, e->lnext = s->newest;
+			s->newest->lprev = e, s->newest = e;
+		}
+		( e ) ? __atomic_add_fetch( &e->refs, 1, __ATOMIC_RELAXED ) : 0;
+	}
+	pthread_mutex_unlock( &s->lock );
+
+	if ( !e ) {
+		return 0;
+	}
+
+	FPRINTF( "Serving cached response for '%s'\n", req->path );
+	sent = rentry_send( conn, e );
+	rentry_release( e );
+	return sent;
+}
+
+
+
+//Keep the response a filter built if its route is cached
+void filter_cache_store ( conn_t *conn, struct cfill_t *cf ) {
+	zhttp_t *res = conn->res;
+	struct rshard_t *s = NULL;
+	struct rentry_t *e = NULL, *old = NULL;
+	unsigned char *end = NULL, *body = NULL;
+	int head = 0, tail = 0, mlen = 0, size = 0, blen = 0;
+	time_t now = time( NULL );
+
+	if ( !cf->ttl ) {
+		return;
+	}
+
+	s = &rshards[ cf->hash % RESPONSE_CACHE_SHARDS ];
+
+	//Only plain successful responses are worth repeating
+	if ( res->status == 200 && res->msg && res->atype == ZHTTP_MESSAGE_MALLOC && !res->fd && !get_record( res->headers, "Set-Cookie" ) ) {
+		end = memmem( res->msg, res->mlen, "\r\n\r\n", 4 );
+	}
+
+	//Connection and Date are left out, since they belong to whoever is asking and when
+	if ( end ) {
+		tail = end - res->msg + 2;
+		body = http_get_response_body( res, &blen );
+		size = sizeof( struct rentry_t ) + cf->klen + res->mlen + blen;
+	}
+
+	if ( end && size <= RESPONSE_CACHE_BYTES / RESPONSE_CACHE_SHARDS && ( e = malloc( size ) ) ) {
+		unsigned char *dst = e->data + cf->klen;
+		memset( e, 0, sizeof( struct rentry_t ) );
+		for ( unsigned char *line = res->msg, *eol = NULL; ( eol = memmem( line, res->msg + tail - line, "\r\n", 2 ) ); line = eol + 2 ) {
+			if ( line > res->msg && !strncasecmp( (char *)line, "Connection:", 11 ) )
+				continue;
+			else if ( line > res->msg && !strncasecmp( (char *)line, "Date:", 5 ) ) {
+				e->date = 1;
+				continue;
+			}
+			memcpy( dst + head, line, eol + 2 - line );
+			head += eol + 2 - line;
+		}
+
+		mlen = head + ( res->mlen - tail ) + blen;
+		size = sizeof( struct rentry_t ) + cf->klen + mlen;
+		e->hash = cf->hash, e->generation = cf->generation, e->refs = 1;
+		e->expires = now + cf->ttl, e->stale = e->expires + cf->ttl;
+		e->klen = cf->klen, e->head = head, e->mlen = mlen;
+		memcpy( e->data, cf->key, cf->klen );
+		memcpy( dst + head, res->msg + tail, res->mlen - tail );
+		memcpy( dst + head + res->mlen - tail, body, blen );
+	}
+
+	pthread_mutex_lock( &s->lock );
+	if ( ( old = rentry_find( s, cf, now ) ) ) {
+		( e ) ? rentry_unlink( s, old ) : ( old->refreshing = 0 );
+	}
+
+	if ( e ) {
+		struct rentry_t **b = rentry_bucket( s, e->hash );
+		e->next = *b, *b = e;
+		e->lnext = s->newest, s->newest = e;
+		( e->lnext ) ? e->lnext->lprev = e : ( s->oldest = e );
+		s->bytes += size;
+
+		//Make room by dropping whatever was used longest ago
+		while ( s->bytes > RESPONSE_CACHE_BYTES / RESPONSE_CACHE_SHARDS && s->oldest != e ) {
+			rentry_unlink( s, s->oldest );
+		}
+	}
+	pthread_mutex_unlock( &s->lock );
+}
+
@@ -0,0 +1,101 @@
+/* ------------------------------------------- *
+ * filter-cache.h
+ * ===========
+ *
+ * Summary
+ * -------
+ * Header file for the response cache, which answers repeat requests for
+ * a site's cacheable routes without running its filter.
+ *
+ * Usage
+ * -----
+ * filter_cache_serve runs right after a request's host is found, and
+ * filter_cache_store saves whatever the filter built if the route asked
+ * to be cached.
+ *
+ * LICENSE
+ * -------
+ * Copyright 2020-2021 Tubular Modular Inc. dba Collins Design
+ *
+ * See LICENSE in the top-level directory for more information.
+ *
+ * CHANGELOG
+ * ---------
+ *
+ * ------------------------------------------- */
+#include <zhttp.h>
+#include <pthread.h>
+#include <router.h>
+#include "../lua.h"
+#include "../util.h"
+#include "../server/server.h"
+#include "filter-lua.h"
+
+#ifndef FILTER_CACHE_H
+#define FILTER_CACHE_H
+
+#define RCACHE_KEY_LEN 2048
+
+#define RCACHE_BUCKETS 1024
+
+#define RCACHE_DATE_LEN 64
+
+//How a route is cached, a ttl of 0 means it isn't
+struct crule_t {
+	int ttl;
+	char **vary;
+};
+
+
+//Where read_rule is within a route's table
+struct cread_t {
+	struct crule_t *rule;
+	int depth;
+	int vary;
+	int vlen;
+};
+
+
+//The routes of a site, as of the last time its config.lua was compiled
+struct chost_t {
+	const struct lconfig *host;
+	struct rnode *rtrie;
+	struct crule_t *rules;
+	int rulelen;
+	int generation;
+	struct chost_t *next;
+};
+
+
+//A finished response, with its key and message (minus the Connection and Date headers) laid out after it
+struct rentry_t {
+	struct rentry_t *next;
+	struct rentry_t *lprev, *lnext;
+	unsigned int hash;
+	int generation;
+	int refs;
+	int refreshing;
+	int date;
+	time_t expires;
+	time_t stale;
+	int klen;
+	int head;
+	int mlen;
+	unsigned char data[];
+};
+
+
+//What a request needs to put its response in the cache once it's built
+struct cfill_t {
+	unsigned int hash;
+	int ttl;
+	int generation;
+	int klen;
+	char key[ RCACHE_KEY_LEN ];
+};
+
+const int filter_cache_serve ( const server_t *, conn_t *, struct cfill_t * );
+
+void filter_cache_store ( conn_t *, struct cfill_t * );
+
+#endif
@@ -76,10 +76,9 @@ const int filter_echo ( const server_t *p, conn_t *conn ) {
 	//Package a message
 	http_set_status( conn->res, 200 );
 	http_set_ctype( conn->res, "text/html" );
-	http_set_content( conn->res, buf, bl );
+	http_take_content( conn->res, buf, bl );
 
 	if ( !http_finalize_response( conn->res, conn->err, sizeof( conn->err ) ) ) {
-		free( buf );
 		return http_set_error( conn->res, 500, conn->err );
 	}
 
@@ -77,7 +77,9 @@ static int http_error( zhttp_t *res, int status, char *fmt, ... ) {
 	va_start( ap, fmt );
 	vsnprintf( err, sizeof( err ), fmt, ap );
 	va_end( ap );
+	char keepalive = res->keepalive;
 	memset( res, 0, sizeof( zhttp_t ) );
+	res->keepalive = keepalive;
 	res->clen = strlen( err );
 	http_set_status( res, status ); 
 	http_set_ctype( res, ctype_def );
@@ -116,6 +118,7 @@ static struct mvcmeta_t {
 ,	{ "sql", "sql", "query,queries" }
 ,	{ "views", "tpl", "view,views" } 
 ,	{ NULL, NULL, "content-type" }
+,	{ NULL, NULL, "cache,vary" }
 //,	{ NULL, "inherit", NULL }
 };
 
@@ -163,7 +166,8 @@ int lua_loadlibs( lua_State *L, struct lua_fset *set ) {
 		lua_newtable( L );
 		for ( struct luaL_Reg *f = set->functions; f->name; f++ ) {
 			lua_pushstring( L, f->name );
-			lua_pushcfunction( L, f->func );	
+			//Entries without a function are placeholders (like json.null) that only have to compare equal
+			( f->func ) ? lua_pushcfunction( L, f->func ) : lua_pushlightuserdata( L, NULL );
 			lua_settable( L, 1 );
 		}
 		lua_setglobal( L, set->namespace );
@@ -450,105 +454,6 @@ static int load_lua_config( struct luadata_t *l ) {
 
 
 
-//Checking for static paths is important, also need to check for disallowed paths
-static int path_is_static ( struct luadata_t *l ) {
-	int i, size, ulen = strlen( l->req->path );
-	if ( ( i = lt_geti( l->zconfig, "static" ) ) == -1 ) {
-		return 0;
-	}
-	
-	//Start at the pulled index, count x times, and reset?
-	for ( int len, ii = 1, size = lt_counta( l->zconfig, i ); ii < size; ii++ ) {
-		zKeyval *kv = lt_retkv( l->zconfig, i + ii );
-		//pbuf[ ii - 1 ] = kv->value.v.vchar;
-		len = strlen( kv->value.v.vchar );
-
-		//I think I can just calculate the current path
-		if ( len <= ulen && memcmp( kv->value.v.vchar, l->req->path, len ) == 0 ) {
-			return 1;
-		}
-	}
-
-	return 0;
-}
-
-
-
-//Send a static file
-static const int send_static ( zhttp_t *res, const char *dir, const char *uri ) {
-	//Read_file and return that...
-	struct stat sb;
-	int fd = 0;
-	char err[ 2048 ] = { 0 }, spath[ 2048 ] = { 0 };
-	unsigned char *data;
-	const struct mime_t *mime;
-	memset( spath, 0, sizeof( spath ) );
-	snprintf( spath, sizeof( spath ) - 1, "%s/%s", dir, ++uri );
-
-	//Check if the path is there at all (read-file can't do this)
-	if ( stat( spath, &sb ) == -1 ) {
-		return http_error( res, 404, "File '%s' not found", spath );
-	}
-
-	//Get its mimetype
-	if ( !( mime = zmime_get_by_filename( spath ) ) ) {
-		mime = zmime_get_default();
-	}
-#if 0
-	//write max should be checked.
-	//...
-	int dlen = 0;
-
-	//read_file and send back
-	if ( !( data = read_file( spath, &dlen, err, sizeof( err ) ) ) ) {
-		return http_error( res, 500, "static read failed: %s", err );
-	}
-
-	//Gotta get the mimetype too	
-	if ( !( mime = zmime_get_by_filename( spath ) ) ) {
-		mime = zmime_get_default();
-	}
-
-	//Send the message out
-	res->clen = dlen;
-	http_set_status( res, 200 ); 
-	http_set_ctype( res, mime->mimetype );
-	http_set_content( res, data, dlen );
-	if ( !http_finalize_response( res, err, sizeof(err) ) ) {
-		return http_error( res, 500, err );
-	}
-
-	free( data );
-#else
-	//Open the file
-	if ( ( fd = open( spath, O_RDONLY ) ) == -1 ) {
-		return http_error( res, 404, strerror( errno ) );
-	}
-
-	//Prepare the message
-	#if 1
-	//TODO: Enable non sendfile capable systems to be able to send a file the old crappy way.
-	res->atype = ZHTTP_MESSAGE_SENDFILE;
-	res->clen = sb.st_size;
-	res->fd = fd;
-	res->status = 200;
-	res->ctype = (char *)mime->mimetype;
-	#else
-	http_set_fd( res, fd );
-	http_set_content_length( res, sb.st_size );
-	http_set_message_type( res, ZHTTP_MESSAGE_SENDFILE );
-	http_set_status( res, 200 );
-	http_set_ctype( res, mime->mimetype );
-	#endif
-
-	if ( !http_finalize_response( res, err, sizeof(err) ) ) {
-		return http_error( res, 500, err );
-	}
-#endif
-	return 1;
-}
-
-
 //...
 static void dump_records( struct HTTPRecord **r ) {
 	int b = 0;
@@ -751,21 +656,31 @@ static int init_lua_request ( struct luadata_t *l ) {
 	struct HTTPRecord **b; 
 	if ( ( b = l->req->body ) ) {
 		lua_pushstring( l->state, "body" ), lua_newtable( l->state );
+		//Values too big for memory were streamed to a file, so hand over its path instead
 		if ( l->req->formtype == ZHTTP_OTHER ) {
-			lua_setstrbin( l->state, "value", (*b)->value, (*b)->size, 3 );
+			if ( (*b)->path )
+				lua_setstrstr( l->state, "path", (*b)->path, 3 );
+			else {
+				lua_setstrbin( l->state, "value", (*b)->value, (*b)->size, 3 );
+			}
 			lua_setstrint( l->state, "size", (*b)->size, 3 );
 		}
 		else {
 			for ( ; b && *b; b++ ) {
 				lua_pushstring( l->state, (*b)->field );
 				lua_newtable( l->state );
-				lua_setstrbin( l->state, "value", (*b)->value, (*b)->size, 5 );
+				if ( (*b)->path )
+					lua_setstrstr( l->state, "path", (*b)->path, 5 );
+				else {
+					lua_setstrbin( l->state, "value", (*b)->value, (*b)->size, 5 );
+				}
 				lua_setstrint( l->state, "size", (*b)->size, 5 );
-			#if 0
-				//Content-disposition
-				//Filename?
-				//Any other fields?
-			#endif
+				if ( (*b)->filename ) {
+					lua_setstrstr( l->state, "filename", (*b)->filename, 5 );
+				}
+				if ( (*b)->ctype ) {
+					lua_setstrstr( l->state, "ctype", (*b)->ctype, 5 );
+				}
 				lua_settable( l->state, 3 );
 			} 
 		}
@@ -799,15 +714,473 @@ static struct lua_readonly_t {
 , { "route", init_lua_routes }
 #if 0
 , { "shadow", init_lua_shadowpath }
-, { "cache", init_lua_cache }
 #endif
 , { NULL }
 };
 
 
+//Sites with warm Lua states waiting to be reused
+static struct lpool_t *lpools = NULL;
+
+static pthread_mutex_t lpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+//Close a pooled state and everything that was loaded with it
+static void lstate_free ( struct lstate_t *ls ) {
+	lua_close( ls->state );
+	lt_free( ls->zconfig ), free( ls->zconfig );
+	lt_free( ls->zroutes ), free( ls->zroutes );
+	( ls->iroutes ) ? free_route_list( ls->iroutes ) : 0;
+	route_trie_free( ls->rtrie );
+	free( ls );
+}
+
+
+//Mix a file's identity into a signature
+static unsigned long long lpool_sign ( unsigned long long sig, const char *path ) {
+	struct stat sb = { 0 };
+	if ( stat( path, &sb ) == -1 ) {
+		return sig * 31;
+	}
+	sig = sig * 31 + ( (unsigned long long)sb.st_mtim.tv_sec * 1000000000ULL + sb.st_mtim.tv_nsec );
+	return sig * 31 + sb.st_size + sb.st_ino;
+}
+
+
+//Fingerprint config.lua and every route file so changes can be spotted
+static unsigned long long lpool_signature ( const char *root ) {
+	char path[ PATH_MAX ] = { 0 };
+	unsigned long long sig = 17;
+	struct dirent *d = NULL;
+	DIR *dir = NULL;
+
+	snprintf( path, sizeof( path ) - 1, "%s/%s", root, confname );
+	sig = lpool_sign( sig, path );
+
+	snprintf( path, sizeof( path ) - 1, "%s/%s", root, rkey );
+	sig = lpool_sign( sig, path );
+
+	if ( ( dir = opendir( path ) ) ) {
+		//Only names that end in .lua, so backups and swap files don't count
+		for ( int len; ( d = readdir( dir ) ); ) {
+			if ( ( len = strlen( d->d_name ) ) > 4 && !strcmp( &d->d_name[ len - 4 ], ".lua" ) ) {
+				snprintf( path, sizeof( path ) - 1, "%s/%s/%s", root, rkey, d->d_name );
+				sig = lpool_sign( sig, path );
+			}
+		}
+		closedir( dir );
+	}
+
+	return sig;
+}
+
+
+//Copy the table at index t and every table under it into the map at index map, keyed by the original
+static void lstate_snapshot ( lua_State *L, int map, int t ) {
+	map = lua_absindex( L, map ), t = lua_absindex( L, t );
+
+	//Tables show up more than once (package.loaded, _G), copy each one once
+	lua_pushvalue( L, t );
+	if ( lua_rawget( L, map ) != LUA_TNIL || !lua_checkstack( L, 8 ) ) {
+		lua_pop( L, 1 );
+		return;
+	}
+	lua_pop( L, 1 );
+
+	lua_newtable( L );
+	lua_pushvalue( L, t );
+	lua_pushvalue( L, -2 );
+	lua_rawset( L, map );
+
+	for ( lua_pushnil( L ); lua_next( L, t ); lua_pop( L, 1 ) ) {
+		lua_pushvalue( L, -2 );
+		lua_pushvalue( L, -2 );
+		lua_rawset( L, -5 );
+		if ( lua_type( L, -1 ) == LUA_TTABLE ) {
+			lstate_snapshot( L, map, -1 );
+		}
+	}
+
+	if ( lua_getmetatable( L, t ) ) {
+		lstate_snapshot( L, map, -1 );
+		lua_pop( L, 1 );
+	}
+	lua_pop( L, 1 );
+}
+
+
+//Load libraries, configuration, routes and package paths into a brand new state
+static struct lstate_t * lstate_create ( struct luadata_t *l ) {
+	struct lstate_t *ls = NULL;
+	struct route_t p = { 0 };
+
+	if ( !( ls = malloc( sizeof( struct lstate_t ) ) ) || !memset( ls, 0, sizeof( struct lstate_t ) ) ) {
+		snprintf( l->err, LD_ERRBUF_LEN, "%s", "Failed to allocate Lua state." );
+		return NULL;
+	}
+
+	//Then initialize the Lua state
+	if ( !( l->state = ls->state = luaL_newstate() ) ) {
+		snprintf( l->err, LD_ERRBUF_LEN, "%s", "Failed to initialize Lua environment." );
+		free( ls );
+		return NULL;
+	}
+
+	//Load the standard libraries first
+	luaL_openlibs( ls->state );
+
+	//Then load the Hypno extensions 
+	if ( !lua_loadlibs( ls->state, functions ) ) {
+		snprintf( l->err, LD_ERRBUF_LEN, "%s", "Failed to initialize Lua standard libs." );
+		lstate_free( ls );
+		return NULL;
+	}
+
+	//Then start loading our configuration
+	if ( !load_lua_config( l ) ) {
+		ls->zconfig = l->zconfig, l->zconfig = NULL;
+		lstate_free( ls );
+		return NULL;
+	}
+
+	//Build the route list once, rather than on every request
+	if ( lt_geti( ls->zconfig = l->zconfig, "routes" ) > -1 ) {
+		p.src = ls->zroutes = lt_copy_by_key( ls->zconfig, "routes" );
+		lt_exec_complex( p.src, 1, p.src->count, &p, make_route_list );
+		ls->iroutes = p.iroute_tlist;
+	}
+
+	//Compile the routes into a trie, keeping their original order
+	for ( int i = 0; ls->iroutes && ls->iroutes[ i ]; i++ ) {
+		if ( !route_trie_add( &ls->rtrie, ls->iroutes[ i ]->route, i ) ) {
+			snprintf( l->err, LD_ERRBUF_LEN, "Failed to compile route '%s'.", ls->iroutes[ i ]->route );
+			lstate_free( ls );
+			return NULL;
+		}
+	}
+
+	//Set package path
+	lua_settop( ls->state, 0 );
+	if ( lua_retglobal( ls->state, "package", LUA_TTABLE ) ) {
+		//Get the path of whatever we're talking about
+		char ppath[ PATH_MAX / 2 ] = { 0 }, cpath[ PATH_MAX / 2 ] = {0};
+		const char *lpath = lua_getv( ls->state, "path", 1 );
+		snprintf( ppath, sizeof( ppath ) - 1, extfmt, lpath, l->root, l->root );
+		lua_pop( ls->state, lua_gettop( ls->state ) - 1 );
+
+		const char *lcpath = lua_getv( ls->state, "cpath", 1 );
+		snprintf( cpath, sizeof( cpath ) - 1, libcfmt, lcpath, l->root );
+		lua_pop( ls->state, lua_gettop( ls->state ) - 1 );
+
+		//Re-add to the table
+		lua_setstrstr( ls->state, "path", ppath, 1 );
+		lua_setstrstr( ls->state, "cpath", cpath, 1 );
+		lua_setglobal( ls->state, "package" );
+	}
+
+	//Keep a copy of every table reachable from the globals so requests can't leak into each other
+	lua_settop( ls->state, 0 );
+	lua_newtable( ls->state );
+	lua_pushglobaltable( ls->state );
+	lstate_snapshot( ls->state, 1, 2 );
+
+	//Strings share one metatable, and its __index is the string library
+	lua_pushliteral( ls->state, "" );
+	if ( lua_getmetatable( ls->state, -1 ) ) {
+		lstate_snapshot( ls->state, 1, -1 );
+	}
+	lua_settop( ls->state, 1 );
+	ls->baseline = luaL_ref( ls->state, LUA_REGISTRYINDEX );
+	return ls;
+}
+
+
+//Put every table a used state started with back the way it was after loading
+static void lstate_reset ( struct lstate_t *ls ) {
+	lua_State *L = ls->state;
+	lua_settop( L, 0 );
+	lua_rawgeti( L, LUA_REGISTRYINDEX, ls->baseline );
+
+	for ( lua_pushnil( L ); lua_next( L, 1 ); lua_settop( L, 2 ) ) {
+		//Drop anything the request added...
+		for ( lua_pushnil( L ); lua_next( L, 2 ); ) {
+			lua_pop( L, 1 );
+			lua_pushvalue( L, -1 );
+			if ( lua_rawget( L, 3 ) == LUA_TNIL ) {
+				lua_pushvalue( L, -2 );
+				lua_pushnil( L );
+				lua_rawset( L, 2 );
+			}
+			lua_pop( L, 1 );
+		}
+
+		//...and restore anything it replaced
+		for ( lua_pushnil( L ); lua_next( L, 3 ); ) {
+			lua_pushvalue( L, -2 );
+			lua_insert( L, -2 );
+			lua_rawset( L, 2 );
+		}
+	}
+
+	lua_settop( L, 0 );
+}
+
+
+//Find the pool of a site, throwing out its idle states if the site's configuration changed
+static struct lpool_t * lpool_find ( const struct lconfig *host, const char *root, int *generation ) {
+	struct lpool_t *pool = NULL;
+	struct lstate_t *stale = NULL;
+	struct timespec now = {0};
+	unsigned long long sig = 0;
+	int check = 0;
+
+	clock_gettime( CLOCK_REALTIME, &now );
+
+	pthread_mutex_lock( &lpool_mutex );
+	for ( pool = lpools; pool && pool->host != host; pool = pool->next ) ;
+
+	if ( !pool && ( pool = malloc( sizeof( struct lpool_t ) ) ) ) {
+		memset( pool, 0, sizeof( struct lpool_t ) );
+		pool->host = host;
+		pool->next = lpools, lpools = pool;
+	}
+
+	//Only look at the disk every so often
+	if ( pool && ( now.tv_sec - pool->checked ) >= CONFIG_CHECK_INTERVAL ) {
+		pool->checked = now.tv_sec, check = 1;
+	}
+	pthread_mutex_unlock( &lpool_mutex );
+
+	if ( !pool ) {
+		return NULL;
+	}
+
+	if ( check ) {
+		sig = lpool_signature( root );
+	}
+
+	pthread_mutex_lock( &lpool_mutex );
+	if ( check && sig != pool->signature ) {
+		FPRINTF( "Configuration for '%s' changed, reloading.\n", host->name );
+		stale = pool->idle, pool->idle = NULL, pool->count = 0;
+		pool->signature = sig, pool->generation++;
+	}
+	*generation = pool->generation;
+	pthread_mutex_unlock( &lpool_mutex );
+
+	for ( struct lstate_t *n = NULL; stale; stale = n ) {
+		n = stale->next;
+		lstate_free( stale );
+	}
+
+	return pool;
+}
+
+
+//Check out a warm state for the current site, creating one if none are idle
+static struct lstate_t * lpool_acquire ( const struct lconfig *host, struct luadata_t *l ) {
+	struct lpool_t *pool = NULL;
+	struct lstate_t *ls = NULL;
+	int generation = 0;
+
+	if ( !( pool = lpool_find( host, l->root, &generation ) ) ) {
+		snprintf( l->err, LD_ERRBUF_LEN, "%s", "Failed to allocate Lua state pool." );
+		return NULL;
+	}
+
+	pthread_mutex_lock( &lpool_mutex );
+	if ( ( ls = pool->idle ) ) {
+		pool->idle = ls->next, pool->count--;
+	}
+	generation = pool->generation;
+	pthread_mutex_unlock( &lpool_mutex );
+
+	if ( !ls ) {
+		if ( !( ls = lstate_create( l ) ) ) {
+			return NULL;
+		}
+		ls->generation = generation;
+	}
+
+	ls->pool = pool, ls->next = NULL;
+	l->state = ls->state;
+	l->zconfig = ls->zconfig;
+
+	//TODO: use pointers instead.  There is no reason to copy all of this...
+	char *db, *fqdn;
+	if ( ( db = lt_text( ls->zconfig, "db" ) ) ) {
+		memcpy( (void *)l->db, db, strlen( db ) ); 
+	}
+
+	if ( ( fqdn = lt_text( ls->zconfig, "fqdn" ) ) ) {
+		memcpy( (void *)l->fqdn, fqdn, strlen( fqdn ) ); 
+	}
+
+	return ls;
+}
+
+
+//Return a state to its pool, or close it if the pool is full or out of date
+static void lpool_release ( struct lstate_t *ls ) {
+	struct lpool_t *pool = ls->pool;
+	db_release( ls->state );
+	lstate_reset( ls );
+
+	pthread_mutex_lock( &lpool_mutex );
+	if ( pool->count < LUA_POOL_SIZE && ls->generation == pool->generation ) {
+		ls->next = pool->idle, pool->idle = ls, pool->count++;
+		ls = NULL;
+	}
+	pthread_mutex_unlock( &lpool_mutex );
+
+	if ( ls ) {
+		lstate_free( ls );
+	}
+}
+
+
+//Let another filter read a site's compiled configuration, fn only runs if it changed since *generation
+const int filter_lua_config ( const struct lconfig *host, int *generation, int (*fn)( struct lstate_t *, void * ), void *data ) {
+	struct luadata_t ld = {0};
+	struct lstate_t *ls = NULL;
+	int current = 0, ok = 0;
+
+	snprintf( (char *)ld.root, sizeof( ld.root ), "%s", host->dir );
+	if ( !lpool_find( host, ld.root, &current ) ) {
+		return 0;
+	}
+
+	if ( current == *generation ) {
+		return 1;
+	}
+
+	//A config that can't be loaded isn't tried again until it changes
+	if ( !( ls = lpool_acquire( host, &ld ) ) ) {
+		FPRINTF( "Could not load configuration for '%s': %s\n", host->name, ld.err );
+		*generation = current;
+		return 0;
+	}
+
+	ok = fn( ls, data );
+	*generation = ls->generation;
+	lpool_release( ls );
+	return ok;
+}
+
+
+//Free a compiled view
+static void vcache_free ( struct vcache_t *vc ) {
+	zrender_free_template( vc->tpl );
+	free( vc->path );
+	free( vc );
+}
+
+
+//Check out the compiled template for a view, (re)compiling it if the file changed
+static struct vcache_t * vcache_acquire ( struct lpool_t *pool, const char *path, char *err, int errlen ) {
+	struct vcache_t *vc = NULL, *nc = NULL, *old = NULL;
+	struct timespec now = {0};
+	unsigned char *src = NULL;
+	unsigned long long sig = 0;
+	zRender *rz = NULL;
+	int len = 0;
+
+	clock_gettime( CLOCK_REALTIME, &now );
+
+	//Use what we have if it was looked at recently
+	pthread_mutex_lock( &lpool_mutex );
+	for ( vc = pool->views; vc && strcmp( vc->path, path ); vc = vc->next ) ;
+	if ( vc && ( now.tv_sec - vc->checked ) < CONFIG_CHECK_INTERVAL ) {
+		vc->refs++;
+		pthread_mutex_unlock( &lpool_mutex );
+		return vc;
+	}
+	pthread_mutex_unlock( &lpool_mutex );
+
+	sig = lpool_sign( 17, path );
+
+	pthread_mutex_lock( &lpool_mutex );
+	for ( vc = pool->views; vc && strcmp( vc->path, path ); vc = vc->next ) ;
+	if ( vc && vc->signature == sig ) {
+		vc->checked = now.tv_sec, vc->refs++;
+		pthread_mutex_unlock( &lpool_mutex );
+		return vc;
+	}
+	pthread_mutex_unlock( &lpool_mutex );
+
+	//Read and compile outside of the lock
+	if ( !( src = read_file( path, &len, err, errlen ) ) ) {
+		return NULL;
+	}
+	else if ( !len ) {
+		snprintf( err, errlen, "%s", "View is empty." );
+		free( src );
+		return NULL;
+	}
+
+	if ( !( rz = zrender_init() ) ) {
+		snprintf( err, errlen, "%s", "Failed to allocate renderer." );
+		free( src );
+		return NULL;
+	}
+
+	zrender_set_default_dialect( rz );
+	if ( !( nc = malloc( sizeof( struct vcache_t ) ) ) || !memset( nc, 0, sizeof( struct vcache_t ) ) ) {
+		snprintf( err, errlen, "%s", "Failed to allocate view cache." );
+		zrender_free( rz ), free( src );
+		return NULL;
+	}
+
+	if ( !( nc->tpl = zrender_compile( rz, src, strlen( (char *)src ) ) ) ) {
+		snprintf( err, errlen, "%s", rz->errmsg );
+		zrender_free( rz ), free( src ), free( nc );
+		return NULL;
+	}
+
+	zrender_free( rz ), free( src );
+	nc->path = zhttp_dupstr( path );
+	nc->signature = sig, nc->checked = now.tv_sec, nc->refs = 1;
+
+	//Swap in the new template, holding on to the old one until nobody uses it
+	pthread_mutex_lock( &lpool_mutex );
+	for ( struct vcache_t **v = &pool->views; *v; v = &(*v)->next ) {
+		if ( !strcmp( (*v)->path, path ) ) {
+			old = *v, *v = old->next, old->stale = 1;
+			old = ( !old->refs ) ? old : NULL;
+			break;
+		}
+	}
+	nc->next = pool->views, pool->views = nc;
+	pthread_mutex_unlock( &lpool_mutex );
+
+	if ( old ) {
+		vcache_free( old );
+	}
+
+	return nc;
+}
+
+
+//Give back a compiled view
+static void vcache_release ( struct vcache_t *vc ) {
+	int drop = 0;
+	pthread_mutex_lock( &lpool_mutex );
+	drop = ( --vc->refs == 0 && vc->stale );
+	pthread_mutex_unlock( &lpool_mutex );
+
+	if ( drop ) {
+		vcache_free( vc );
+	}
+}
+
+
 static int free_ld ( struct luadata_t *l ) {
-	lua_close( l->state );
-	lt_free( l->zconfig ), free( l->zconfig );
+	if ( l->ls )
+		lpool_release( l->ls );
+	else if ( l->state ) {
+		lua_close( l->state );
+		lt_free( l->zconfig ), free( l->zconfig );
+	}
 	lt_free( l->zroute ), free( l->zroute );
 	lt_free( l->zmodel ), free( l->zmodel );
 	free_mvc_list( (void ***)&(l->pp.imvc_tlist) );
@@ -837,20 +1210,13 @@ static zhttp_t * return_as_serializable ( struct luadata_t *l, ctype_t *t ) {
 	}
 	#endif
 	else if ( t->ctype == CTYPE_JSON ) {
-	#if 0
-		content = zjson_encode( l->zmodel, l->err, 1024 );
-	#else
-		struct mjson **zjson = NULL;
-		if ( !( zjson = ztable_to_zjson( l->zmodel, l->err, 1024 ) ) ) {
-			return NULL;
-		}
-		if ( !( content = zjson_stringify( zjson, l->err, 1024 ) ) ) {
-			zjson_free( zjson );
+		//The model is still on the stack, so write it out from there in one pass
+		struct xbuf out = { 0 };
+		if ( !lua_to_json( l->state, 1, &out, l->err, LD_ERRBUF_LEN ) ) {
+			free( out.ptr );
 			return NULL;
 		}
-		zjson_free( zjson );
-	#endif
-		clen = strlen( content );
+		content = (char *)out.ptr, clen = out.len;
 		ctype = t->ctypename;
 	}
 	else {
@@ -863,12 +1229,10 @@ static zhttp_t * return_as_serializable ( struct luadata_t *l, ctype_t *t ) {
 	l->res->clen = clen;
 	http_set_status( l->res, 200 ); 
 	http_set_ctype( l->res, t->ctypename );
-	http_set_content( l->res, (unsigned char *)content, l->res->clen ); 
+	http_take_content( l->res, (unsigned char *)content, l->res->clen ); 
 
-	//Return the finished message if we got this far
+	//Return the finished message if we got this far, the response frees the content
 	p = http_finalize_response( l->res, l->err, LD_ERRBUF_LEN );
-
-	free( content );
 	return p;
 }
 
@@ -910,7 +1274,7 @@ static int return_as_response ( struct luadata_t *l ) {
 		return 0;
 	}
 
-	if ( !( rt = lt_make( count * 2 ) ) ) {
+	if ( !( rt = lt_make( count * 2 ) ) || !lt_use_arena( rt ) ) {
 		lt_free( rt ), free( rt );
 		snprintf( l->err, LD_ERRBUF_LEN, "Could not generate response table." );
 		return 0;
@@ -1024,14 +1388,17 @@ static int return_as_response ( struct luadata_t *l ) {
 		l->res->clen = clen;
 		http_set_status( l->res, status ); 
 		http_set_ctype( l->res, ctype );
-		http_set_content( l->res, content, clen ); 
+
+		//Content that lives in the response table has to outlive it
+		if ( file_i > -1 || prepped_own_content )
+			http_take_content( l->res, content, clen ); 
+		else {
+			http_copy_content( l->res, content, clen ); 
+		}
 
 		//Return finalized content
 		zhttp_t *rr = http_finalize_response( l->res, l->err, LD_ERRBUF_LEN ); 
 		lt_free( rt ), free( rt );
-		if ( file_i > -1 || prepped_own_content ) {
-			free( content );
-		}
 	}
 
 	return ( !delayed ) ? 1: 2;
@@ -1040,37 +1407,23 @@ static int return_as_response ( struct luadata_t *l ) {
 
 //Compare the path against the instance routes
 int find_matching_route ( struct luadata_t *l ) {
-	ztable_t *t = NULL;
-	struct route_t p =  { 0 };
-
-	if ( lt_geti( l->zconfig, "routes" ) > -1 ) { 
-		//Create a mini table
-		p.src = t = lt_copy_by_key( l->zconfig, "routes" );
-
-		//Loop through the routes...
-		lt_exec_complex( t, 1, t->count, &p, make_route_list );
-
-		//Loop through the routes
-		l->pp.depth = 1;
-		int notfound = 1;
-		for ( struct iroute_t **lroutes = p.iroute_tlist; *lroutes; lroutes++ ) {
-			if ( route_resolve( l->apath, (*lroutes)->route ) ) {
-				memcpy( (void *)l->rroute, (*lroutes)->route, strlen( (*lroutes)->route ) );
-				ztable_t * croute = lt_copy_by_index( t, (*lroutes)->index );
-				lt_exec_complex( croute, 1, croute->count, &l->pp, make_mvc_list );
-				l->zroute = croute;
-				notfound = 0;
-				lt_free( t ), free( t );
-				break;
-			}
-		}
+	struct lstate_t *ls = l->ls;
+
+	struct iroute_t *lroute = NULL;
+	int i = -1;
 
-		//Free the route list
-		free_route_list( p.iroute_tlist );
-		return !notfound;
+	//Walk the compiled routes once instead of trying each one in turn
+	if ( ( i = route_trie_resolve( ls->rtrie, l->apath ) ) == -1 ) {
+		return 0;
 	}
 
-	return 0;
+	lroute = ls->iroutes[ i ];
+	memcpy( (void *)l->rroute, lroute->route, strlen( lroute->route ) );
+	ztable_t * croute = lt_copy_by_index( ls->zroutes, lroute->index );
+	l->pp.depth = 1;
+	lt_exec_complex( croute, 1, croute->count, &l->pp, make_mvc_list );
+	l->zroute = croute;
+	return 1;
 }
 
 
@@ -1091,8 +1444,10 @@ const int filter_lua( const server_t *serv, conn_t *conn ) {
 	int clen = 0, ccount = 0, tcount = 0, model = 0, view = 0;
 	unsigned char *content = NULL;
 
-	//Prepare the response
+	//Prepare the response (but keep the server's keep-alive decision)
+	char keepalive = conn->res->keepalive;
 	memset( conn->res, 0, sizeof( zhttp_t ) );
+	conn->res->keepalive = keepalive;
 
 	//Initialize Lua data structure
 	ld.req = conn->req; 
@@ -1100,32 +1455,11 @@ const int filter_lua( const server_t *serv, conn_t *conn ) {
 	ld.res->atype = ZHTTP_MESSAGE_MALLOC;
 	memcpy( (void *)ld.root, conn->config->dir, strlen( conn->config->dir ) );
 
-	//Then initialize the Lua state
-	if ( !( ld.state = luaL_newstate() ) ) {
-		return http_error( conn->res, 500, "%s", "Failed to initialize Lua environment." );
-	}
-
-	//Load the standard libraries first
-	luaL_openlibs( ld.state );
-
-	//Then load the Hypno extensions 
-	if ( !lua_loadlibs( ld.state, functions ) ) {
-		free_ld( &ld );
-		return http_error( conn->res, 500, "Failed to initialize Lua standard libs." ); 
-	}
-
-	//Then start loading our configuration
-	if ( !load_lua_config( &ld ) ) {
-		free_ld( &ld );
+	//Check out a Lua state with libraries and configuration already loaded
+	if ( !( ld.ls = lpool_acquire( conn->config, &ld ) ) ) {
 		return http_error( conn->res, 500, "%s\n", ld.err );
 	}
 
-	//Need to delegate to static handler when request points to one of the static paths
-	if ( path_is_static( &ld ) ) {
-		free_ld( &ld );
-		return send_static( conn->res, ld.root, conn->req->path );
-	}
-
 	//req->path needs to be modified to return just the path without the ?
 	if ( !getpath( conn->req->path, (char *)ld.apath, LD_LEN ) ) {
 		free_ld( &ld );
@@ -1147,33 +1481,6 @@ const int filter_lua( const server_t *serv, conn_t *conn ) {
 		lua_setglobal( ld.state, t->name );
 	}
 
-	//Set package path
-	if ( lua_retglobal( ld.state, "package", LUA_TTABLE ) ) {
-		//Get the path of whatever we're talking about
-		char ppath[ PATH_MAX / 2 ] = { 0 }, cpath[ PATH_MAX / 2 ] = {0};
-		const char *lpath = lua_getv( ld.state, "path", 1 );
-		snprintf( ppath, sizeof( ppath ) - 1, extfmt, lpath, ld.root, ld.root );
-		lua_pop( ld.state, lua_gettop( ld.state ) - 1 );
-
-		const char *lcpath = lua_getv( ld.state, "cpath", 1 );
-		snprintf( cpath, sizeof( cpath ) - 1, libcfmt, lcpath, ld.root );
-		lua_pop( ld.state, lua_gettop( ld.state ) - 1 );
-
-		//Re-add to the table
-		#if 1
-		lua_setstrstr( ld.state, "path", ppath, 1 );
-		lua_setstrstr( ld.state, "cpath", cpath, 1 );
-		#else
-		lua_pushstring( ld.state, "path" );
-		lua_pushstring( ld.state, ppath );
-		lua_settable( ld.state, 1 );
-		lua_pushstring( ld.state, "cpath" );
-		lua_pushstring( ld.state, cpath );
-		lua_settable( ld.state, 1 );
-		#endif
-		lua_setglobal( ld.state, "package" );
-	}
-
 	//Execute each model
 	for ( struct imvc_t **m = ld.pp.imvc_tlist; m && *m; m++ ) {
 		//Define
@@ -1266,19 +1573,7 @@ const int filter_lua( const server_t *serv, conn_t *conn ) {
 		FPRINTF( "Adding model...\n" );
 		const char **c = ctype_tags;
 		char tkey[ 1024 ] = { 0 }, *key = lt_retkv( ld.zroute, 0 )->key.v.vchar;
-		int count = lua_count( ld.state, 1 ), ksize = sizeof( tkey );
-
-		//Initialize a table
-		if ( !( ld.zmodel = lt_make( ( count = ( count < 1 ) ? 16 : count ) * 2 ) ) ) {
-			free_ld( &ld );
-			return http_error( conn->res, 500, "Couldn't allocate table." );
-		}
-		
-		//Convert the model
-		if ( !lua_to_ztable( ld.state, 1, ld.zmodel ) ) {
-			free_ld( &ld );
-			return http_error( conn->res, 500, "Error in model conversion." );
-		}
+		int count = 0, ksize = sizeof( tkey );
 
 		//TODO: Check for an inherited content-type then a default content-type
 		for ( int index = -1; *c; c++ ) {
@@ -1314,20 +1609,33 @@ const int filter_lua( const server_t *serv, conn_t *conn ) {
 			free_ld( &ld );
 			return 1;
 		}
+
+		//Only views need the model as a table
+		count = lua_count( ld.state, 1 );
+		if ( !( ld.zmodel = lt_make( ( ( count < 1 ) ? 16 : count ) * 2 ) ) || !lt_use_arena( ld.zmodel ) ) {
+			free_ld( &ld );
+			return http_error( conn->res, 500, "Couldn't allocate table." );
+		}
+		
+		//Convert the model
+		if ( !lua_to_ztable( ld.state, 1, ld.zmodel ) ) {
+			free_ld( &ld );
+			return http_error( conn->res, 500, "Error in model conversion." );
+		}
+
 		lua_pop( ld.state, 1 );
 		lt_lock( ld.zmodel );
 		FPRINTF( "Done with model...\n" );
 	}
 
 	//TODO: routes with no special keys need not be added
-	//Load all views
+	//Load all views, rendering each one straight onto the end of the body
+	struct xbuf out = { 0 };
 	for ( struct imvc_t **v = ld.pp.imvc_tlist; v && *v; v++ ) {
 		if ( *(*v)->file == 'v' ) {
-			int len = 0, renlen = 0;
 			char vpath[ 2192 ] = {0};
-			unsigned char *src, *render;
+			struct vcache_t *vc = NULL;
 			zRender * rz = zrender_init();
-			zrender_set_default_dialect( rz );
 			zrender_set_fetchdata( rz, ld.zmodel );
 			
 			if ( *(*v)->base != '@' )
@@ -1337,23 +1645,23 @@ const int filter_lua( const server_t *serv, conn_t *conn ) {
 			}
 
 			FPRINTF( "Loading view at: %s\n", vpath );
-			if ( !( src = read_file( vpath, &len, ld.err, LD_ERRBUF_LEN )	) || !len ) {
-				zrender_free( rz ), free( src ), free_ld( &ld );
+			if ( !( vc = vcache_acquire( ld.ls->pool, vpath, ld.err, LD_ERRBUF_LEN ) ) ) {
+				zrender_free( rz ), free( out.ptr ), free_ld( &ld );
 				return http_error( conn->res, 500, "Error opening view '%s': %s", vpath, ld.err );
 			}
 
-			if ( !( render = zrender_render( rz, src, strlen((char *)src), &renlen ) ) ) {
+			if ( !zrender_exec( rz, vc->tpl, &out ) ) {
 				char errbuf[ 2048 ] = { 0 };
 				snprintf( errbuf, sizeof( errbuf ), "%s", rz->errmsg );
-				zrender_free( rz ), free( src ), free_ld( &ld );
+				vcache_release( vc ), zrender_free( rz ), free( out.ptr ), free_ld( &ld );
 				return http_error( conn->res, 500, "%s", errbuf );
 			}
 
-			zhttp_append_to_uint8t( &content, &clen, render, renlen ); 
-			zrender_free( rz ), free( render ), free( src );
+			vcache_release( vc ), zrender_free( rz );
 			view = 1;
 		}
 	}
+	content = out.ptr, clen = out.len;
 
 	//Fail out when neither model or view is specified
 	if ( !model && !view ) {
@@ -1372,7 +1680,7 @@ const int filter_lua( const server_t *serv, conn_t *conn ) {
 	char *ctype = zhttp_dupstr( ctype_def );
 	conn->res->ctype = ctype;
 	#endif
-	http_set_content( conn->res, content, clen ); 
+	http_take_content( conn->res, content, clen ); 
 
 	//Return the finished message if we got this far
 	if ( !http_finalize_response( conn->res, ld.err, LD_ERRBUF_LEN ) ) {
@@ -1386,7 +1694,6 @@ const int filter_lua( const server_t *serv, conn_t *conn ) {
 	//Destroy model & Lua
 	free( ctype );
 	free_ld( &ld );
-	free( content );
 	return 1;
 }
 
@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include <router.h>
 #include <dirent.h>
 #include <zjson.h>
@@ -36,6 +37,7 @@
 #include "../server/server.h"
 #include "../lua.h"
 #include "../lua/lib.h"
+#include "../lua/db.h"
 #include "../mime.h"
 
 #ifndef FILTER_LUA_H
@@ -74,9 +76,45 @@ struct mvc_t {
 };
 
 
+struct lstate_t {
+	lua_State *state;
+	ztable_t *zconfig;
+	ztable_t *zroutes;
+	struct iroute_t **iroutes;
+	struct rnode *rtrie;
+	int baseline; //registry reference to copies of every table reachable from the globals after loading
+	int generation;
+	struct lpool_t *pool;
+	struct lstate_t *next;
+};
+
+
+struct vcache_t {
+	char *path;
+	zTemplate *tpl;
+	unsigned long long signature; //view file as of the last check
+	time_t checked;
+	int refs, stale;
+	struct vcache_t *next;
+};
+
+
+struct lpool_t {
+	const struct lconfig *host;
+	unsigned long long signature; //config.lua and routes/*.lua as of the last check
+	time_t checked;
+	int generation;
+	int count;
+	struct lstate_t *idle;
+	struct vcache_t *views;
+	struct lpool_t *next;
+};
+
+
 struct luadata_t {
 	zhttp_t *req, *res;
 	lua_State *state;
+	struct lstate_t *ls;
 	//TODO: This might be able to be pointers again...
 	const char aroute[ LD_LEN ];
 	const char rroute[ LD_ROUTE_LEN ];
@@ -96,4 +134,6 @@ struct luadata_t {
 
 //const int filter_lua( int , zhttp_t *, zhttp_t *, struct cdata * );
 const int filter_lua( const server_t *, conn_t * );
+
+const int filter_lua_config ( const struct lconfig *, int *, int (*)( struct lstate_t *, void * ), void * );
 #endif
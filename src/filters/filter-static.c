@@ -0,0 +1,340 @@
+/* ------------------------------------------- *
+ * filter-static.c
+ * ===========
+ *
+ * Summary
+ * -------
+ * Functions comprising the static filter, which serves files straight
+ * from disk.
+ *
+ * Usage
+ * -----
+ * filter_static serves every request for a site as a file relative to
+ * its directory.  filter_static_prefix runs ahead of a site's filter and
+ * answers requests for any path listed in the 'static' table of the
+ * site's config.lua, so that assets never have to start up Lua.
+ *
+ * Open files are kept in a small cache and checked against the disk at
+ * most every CONFIG_CHECK_INTERVAL seconds.  Responses carry an ETag and
+ * Last-Modified header, and conditional requests get a 304.
+ *
+ * LICENSE
+ * -------
+ * Copyright 2020-2021 Tubular Modular Inc. dba Collins Design
+ *
+ * See LICENSE in the top-level directory for more information.
+ *
+ * CHANGELOG
+ * ---------
+ *
+ * ------------------------------------------- */
+#define _GNU_SOURCE
+#include "filter-static.h"
+
+static const char skey[] = "static";
+
+static const char index_def[] = "index.html";
+
+static const char datefmt[] = "%a, %d %b %Y %H:%M:%S GMT";
+
+//Files that were opened recently, one per slot
+static struct sfile_t sfiles[ STATIC_CACHE_SIZE ];
+
+static pthread_mutex_t sfile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//Sites that have been checked for static paths
+static struct shost_t *shosts = NULL;
+
+static pthread_mutex_t shost_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+//Free a list of prefixes
+static void free_prefixes ( char **list ) {
+	for ( char **l = list; l && *l; l++ ) {
+		free( *l );
+	}
+	free( list );
+}
+
+
+
+//Read the 'static' table out of a site's compiled config.lua
+static int load_prefixes ( struct lstate_t *ls, void *data ) {
+	char ***list = (char ***)data;
+	int i = lt_geti( ls->zconfig, skey ), len = 0;
+
+	for ( int j = i + 1, n = ( i > -1 ) ? i + lt_counti( ls->zconfig, i ) : i; j <= n; j++ ) {
+		zKeyval *kv = lt_retkv( ls->zconfig, j );
+		if ( kv && kv->value.type == ZTABLE_TXT && kv->value.v.vchar && *kv->value.v.vchar ) {
+			add_item( list, strdup( kv->value.v.vchar ), char *, &len );
+		}
+	}
+	return 1;
+}
+
+
+
+//Find a site's static paths, reading them again if its configuration changed
+static struct shost_t * find_shost ( const server_t *p, const struct lconfig *host ) {
+	struct shost_t *sh = NULL;
+	char **list = NULL;
+	int generation = 0, last = 0;
+
+	pthread_mutex_lock( &shost_mutex );
+	for ( sh = shosts; sh && sh->host != host; sh = sh->next ) ;
+
+	if ( !sh && ( sh = malloc( sizeof( struct shost_t ) ) ) ) {
+		memset( sh, 0, sizeof( struct shost_t ) );
+		sh->host = host, sh->generation = -1;
+		if ( *host->dir == '/' )
+			snprintf( sh->root, sizeof( sh->root ), "%s", host->dir );
+		else {
+			snprintf( sh->root, sizeof( sh->root ), "%s/%s", p->config->wwwroot, host->dir );
+		}
+		sh->next = shosts, shosts = sh;
+	}
+	generation = last = ( sh ) ? sh->generation : 0;
+	pthread_mutex_unlock( &shost_mutex );
+
+	if ( !sh ) {
+		return NULL;
+	}
+
+	//The Lua filter already keeps the site's config compiled, and knows when it changed
+	(void)filter_lua_config( host, &generation, load_prefixes, &list );
+	if ( generation != last ) {
+		FPRINTF( "Loaded static paths for '%s'\n", host->name );
+		pthread_mutex_lock( &shost_mutex );
+		if ( generation > sh->generation ) {
+			free_prefixes( sh->prefixes );
+			sh->prefixes = list, sh->generation = generation, list = NULL;
+		}
+		pthread_mutex_unlock( &shost_mutex );
+	}
+
+	free_prefixes( list );
+	return sh;
+}
+
+
+
+//Check a path against a site's static paths, which only match whole segments
+static int match_shost ( struct shost_t *sh, const char *path, int plen ) {
+	int match = 0;
+	pthread_mutex_lock( &shost_mutex );
+	for ( char **l = sh->prefixes; l && *l && !match; l++ ) {
+		int len = strlen( *l );
+		match = ( len <= plen && memcmp( *l, path, len ) == 0 )
+			&& ( len == plen || path[ len ] == '/' || (*l)[ len - 1 ] == '/' );
+	}
+	pthread_mutex_unlock( &shost_mutex );
+	return match;
+}
+
+
+
+//Get an open descriptor and the details of a file, opening it only if needed
+static int open_sfile ( const char *path, struct sfile_t *f ) {
+	struct sfile_t *slot = NULL, n = { 0 };
+	struct timespec now = {0};
+	struct stat sb = {0};
+	struct tm tm = {0};
+	const struct mime_t *mime = NULL;
+	unsigned int hash = 5381;
+
+	for ( const char *c = path; *c; c++ ) {
+		hash = ( ( hash << 5 ) + hash ) + (unsigned char)*c;
+	}
+
+	clock_gettime( CLOCK_REALTIME, &now );
+	slot = &sfiles[ hash % STATIC_CACHE_SIZE ];
+
+	//Hand out the cached file if it was looked at recently
+	pthread_mutex_lock( &sfile_mutex );
+	if ( slot->path && !strcmp( slot->path, path ) && ( now.tv_sec - slot->checked ) < CONFIG_CHECK_INTERVAL ) {
+		*f = *slot, f->path = NULL;
+		f->fd = dup( slot->fd );
+		pthread_mutex_unlock( &sfile_mutex );
+		return f->fd > -1;
+	}
+	pthread_mutex_unlock( &sfile_mutex );
+
+	if ( stat( path, &sb ) == -1 || !S_ISREG( sb.st_mode ) ) {
+		return 0;
+	}
+
+	//Still the same file?
+	pthread_mutex_lock( &sfile_mutex );
+	if ( slot->path && !strcmp( slot->path, path ) && slot->ino == sb.st_ino && slot->size == sb.st_size
+		&& slot->mtime.tv_sec == sb.st_mtim.tv_sec && slot->mtime.tv_nsec == sb.st_mtim.tv_nsec ) {
+		slot->checked = now.tv_sec;
+		*f = *slot, f->path = NULL;
+		f->fd = dup( slot->fd );
+		pthread_mutex_unlock( &sfile_mutex );
+		return f->fd > -1;
+	}
+	pthread_mutex_unlock( &sfile_mutex );
+
+	if ( ( n.fd = open( path, O_RDONLY | O_CLOEXEC ) ) == -1 ) {
+		return 0;
+	}
+
+	if ( !( mime = zmime_get_by_filename( path ) ) ) {
+		mime = zmime_get_default();
+	}
+
+	n.path = strdup( path );
+	n.size = sb.st_size, n.ino = sb.st_ino, n.mtime = sb.st_mtim;
+	n.checked = now.tv_sec, n.mimetype = mime->mimetype;
+	snprintf( n.etag, sizeof( n.etag ), "\"%lx-%lx\"", (long)sb.st_mtim.tv_sec, (long)sb.st_size );
+	strftime( n.lastmod, sizeof( n.lastmod ), datefmt, gmtime_r( &sb.st_mtim.tv_sec, &tm ) );
+
+	//Whatever was in the slot before is closed, requests still using it have their own descriptor
+	pthread_mutex_lock( &sfile_mutex );
+	if ( slot->path ) {
+		close( slot->fd ), free( slot->path );
+	}
+	*slot = n;
+	*f = n, f->path = NULL;
+	f->fd = dup( n.fd );
+	pthread_mutex_unlock( &sfile_mutex );
+	return f->fd > -1;
+}
+
+
+
+//Find the value of a request header
+static zhttpr_t * get_header ( zhttp_t *req, const char *name ) {
+	for ( zhttpr_t **h = req->headers; h && *h; h++ ) {
+		if ( (*h)->field && !strcasecmp( (*h)->field, name ) ) {
+			return *h;
+		}
+	}
+	return NULL;
+}
+
+
+
+//Check if the client already has the current version of a file
+static int not_modified ( zhttp_t *req, struct sfile_t *f ) {
+	zhttpr_t *r = NULL;
+	struct tm tm = {0};
+	char date[ STATIC_DATE_LEN ] = { 0 };
+	int elen = strlen( f->etag );
+
+	//If-None-Match wins when both are sent
+	if ( ( r = get_header( req, "If-None-Match" ) ) ) {
+		for ( unsigned char *v = r->value, *end = r->value + r->size; v < end; v++ ) {
+			if ( *v == '*' || ( end - v >= elen && !memcmp( v, f->etag, elen ) ) ) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	if ( ( r = get_header( req, "If-Modified-Since" ) ) && r->size < (int)sizeof( date ) ) {
+		memcpy( date, r->value, r->size );
+		if ( strptime( date, datefmt, &tm ) ) {
+			return timegm( &tm ) >= f->mtime.tv_sec;
+		}
+	}
+
+	return 0;
+}
+
+
+
+//Answer a request with a file from disk
+static const int send_sfile ( conn_t *conn, const char *root, const char *uri ) {
+	zhttp_t *req = conn->req, *res = conn->res;
+	struct sfile_t f = { 0 };
+	char path[ PATH_MAX ] = { 0 }, err[ 1024 ] = { 0 };
+	int len = strcspn( uri, "?#" ), head = !strcmp( req->method, "HEAD" );
+
+	//Never let a request walk out of the site's directory
+	for ( const char *u = uri; ( u = strstr( u, ".." ) ) && u < uri + len; u += 2 ) {
+		if ( ( u == uri || u[ -1 ] == '/' ) && ( u[ 2 ] == '/' || u[ 2 ] == '?' || u + 2 == uri + len ) ) {
+			snprintf( conn->err, sizeof( conn->err ), "Path '%.*s' is not allowed.", len, uri );
+			return http_set_error( res, 403, conn->err );
+		}
+	}
+
+	if ( len > 0 && uri[ len - 1 ] == '/' )
+		snprintf( path, sizeof( path ), "%s%.*s%s", root, len, uri, ( conn->config->root_default ) ? conn->config->root_default : index_def );
+	else {
+		snprintf( path, sizeof( path ), "%s%.*s", root, len, uri );
+	}
+
+	if ( !open_sfile( path, &f ) ) {
+		snprintf( conn->err, sizeof( conn->err ), "File '%.*s' not found.", len, uri );
+		return http_set_error( res, 404, conn->err );
+	}
+
+	http_set_status( res, not_modified( req, &f ) ? 304 : 200 );
+	http_set_ctype( res, f.mimetype );
+	http_copy_header( res, "ETag", f.etag );
+	http_copy_header( res, "Last-Modified", f.lastmod );
+	res->clen = f.size;
+
+	//Only a full GET needs the file itself
+	if ( res->status == 200 && !head && f.size > 0 )
+		res->atype = ZHTTP_MESSAGE_SENDFILE, res->fd = f.fd;
+	else {
+		res->atype = ZHTTP_MESSAGE_MALLOC;
+		close( f.fd );
+	}
+
+	if ( !http_finalize_response( res, err, sizeof( err ) ) ) {
+		snprintf( conn->err, sizeof( conn->err ), "Failed to finalize static response: %s", err );
+		( res->atype == ZHTTP_MESSAGE_SENDFILE ) ? close( res->fd ) : 0;
+		res->atype = ZHTTP_MESSAGE_MALLOC, res->fd = 0;
+		free( res->ctype ), res->ctype = NULL;
+		return http_set_error( res, 500, conn->err );
+	}
+
+	return 1;
+}
+
+
+
+//Serve a whole site as static files
+const int filter_static ( const server_t *p, conn_t *conn ) {
+	struct shost_t *sh = NULL;
+
+	if ( !( sh = find_shost( p, conn->config ) ) ) {
+		snprintf( conn->err, sizeof( conn->err ), "%s", "Failed to allocate static host." );
+		return http_set_error( conn->res, 500, conn->err );
+	}
+
+	return send_sfile( conn, sh->root, conn->req->path );
+}
+
+
+
+//Answer requests for a site's static paths before its filter is run, returns 0 if the request is not static
+const int filter_static_prefix ( const server_t *p, conn_t *conn ) {
+	struct shost_t *sh = NULL;
+	const char *uri = conn->req->path;
+
+	if ( !uri || !conn->req->method || !conn->config->dir ) {
+		return 0;
+	}
+
+	//Only Lua sites have a config.lua to list static paths in
+	if ( !conn->config->filter || strcmp( conn->config->filter, "lua" ) ) {
+		return 0;
+	}
+
+	if ( strcmp( conn->req->method, "GET" ) && strcmp( conn->req->method, "HEAD" ) ) {
+		return 0;
+	}
+
+	if ( !( sh = find_shost( p, conn->config ) ) || !match_shost( sh, uri, strcspn( uri, "?#" ) ) ) {
+		return 0;
+	}
+
+	FPRINTF( "Serving static path '%s' for '%s'\n", uri, conn->config->name );
+	(void)send_sfile( conn, sh->root, uri );
+	return 1;
+}
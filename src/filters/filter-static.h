@@ -0,0 +1,67 @@
+/* ------------------------------------------- *
+ * filter-static.h
+ * ===========
+ *
+ * Summary
+ * -------
+ * Header file for functions comprising the static filter, which serves
+ * files straight from disk.
+ *
+ * Usage
+ * -----
+ * filter-static.c serves a whole site as static files, and also answers
+ * requests for a site's 'static' paths before any other filter is run.
+ *
+ * LICENSE
+ * -------
+ * Copyright 2020-2021 Tubular Modular Inc. dba Collins Design
+ *
+ * See LICENSE in the top-level directory for more information.
+ *
+ * CHANGELOG
+ * ---------
+ *
+ * ------------------------------------------- */
+#include <zhttp.h>
+#include <zmime.h>
+#include <pthread.h>
+#include "../lua.h"
+#include "../util.h"
+#include "../server/server.h"
+#include "filter-lua.h"
+
+#ifndef FILTER_STATIC_H
+#define FILTER_STATIC_H
+
+#define STATIC_ETAG_LEN 64
+
+#define STATIC_DATE_LEN 64
+
+//An open file and what it looked like when it was opened
+struct sfile_t {
+	char *path;
+	int fd;
+	off_t size;
+	ino_t ino;
+	struct timespec mtime;
+	time_t checked;
+	const char *mimetype;
+	char etag[ STATIC_ETAG_LEN ];
+	char lastmod[ STATIC_DATE_LEN ];
+};
+
+
+//The static paths of a site, as of the last time its config.lua was compiled
+struct shost_t {
+	const struct lconfig *host;
+	char root[ PATH_MAX ];
+	char **prefixes;
+	int generation;
+	struct shost_t *next;
+};
+
+const int filter_static ( const server_t *, conn_t * );
+
+const int filter_static_prefix ( const server_t *, conn_t * );
+
+#endif
@@ -22,6 +22,10 @@
  * ------------------------------------------- */
 #include "lua.h"
 
+#ifdef __SSE2__
+ #include <emmintrin.h>
+#endif
+
 //Dump a stack
 void lua_istack ( lua_State *L ) {
 	fprintf( stderr, "\n" );
@@ -501,6 +505,600 @@ int lua_to_ztable ( lua_State *L, int index, ztable_t *t ) {
 
 
 
+//Make room for at least n more bytes of JSON
+static int json_reserve ( struct xbuf *out, int n ) {
+	unsigned char *b = NULL;
+	int size = ( out->size ) ? out->size : 1024;
+
+	if ( out->len + n <= out->size ) {
+		return 1;
+	}
+
+	while ( size < out->len + n ) {
+		size *= 2;
+	}
+
+	if ( !( b = realloc( out->ptr, size ) ) ) {
+		return 0;
+	}
+
+	out->ptr = b, out->size = size;
+	return 1;
+}
+
+
+
+//Add a block of JSON
+static int json_append ( struct xbuf *out, const void *src, int srclen ) {
+	if ( !json_reserve( out, srclen ) ) {
+		return 0;
+	}
+	memcpy( &out->ptr[ out->len ], src, srclen );
+	out->len += srclen;
+	return 1;
+}
+
+
+
+//Add a quoted string, escaping anything JSON won't take as-is
+static int json_append_string ( struct xbuf *out, const char *s, size_t len ) {
+	const unsigned char *p = (const unsigned char *)s, *run = p, *end = p + len;
+	char esc[ 8 ] = { '\\' };
+
+	if ( len > INT_MAX || !json_append( out, "\"", 1 ) ) {
+		return 0;
+	}
+
+	//Copy runs of plain text in one go, stopping only for what needs escaping
+	for ( int elen = 0; p < end; p++ ) {
+		if ( *p == '"' || *p == '\\' )
+			esc[ 1 ] = *p, elen = 2;
+		else if ( *p >= 0x20 )
+			continue;
+		else if ( *p == '\n' )
+			esc[ 1 ] = 'n', elen = 2;
+		else if ( *p == '\r' )
+			esc[ 1 ] = 'r', elen = 2;
+		else if ( *p == '\t' )
+			esc[ 1 ] = 't', elen = 2;
+		else if ( *p == '\b' )
+			esc[ 1 ] = 'b', elen = 2;
+		else if ( *p == '\f' )
+			esc[ 1 ] = 'f', elen = 2;
+		else {
+			elen = snprintf( esc, sizeof( esc ), "\\u%04x", *p );
+		}
+
+		if ( !json_append( out, run, p - run ) || !json_append( out, esc, elen ) ) {
+			return 0;
+		}
+		run = p + 1;
+	}
+
+	return json_append( out, run, end - run ) && json_append( out, "\"", 1 );
+}
+
+
+
+//Return n if a table's keys are exactly 1 through n, 0 if it's empty or -1 otherwise
+static int json_sequence ( lua_State *L, int index ) {
+	lua_Integer count = 0, max = 0;
+
+	lua_pushnil( L );
+	while ( lua_next( L, index ) != 0 ) {
+		lua_Integer k = 0;
+		lua_pop( L, 1 );
+		if ( !lua_isinteger( L, -1 ) || ( k = lua_tointeger( L, -1 ) ) < 1 || k > INT_MAX ) {
+			lua_pop( L, 1 );
+			return -1;
+		}
+		max = ( k > max ) ? k : max, count++;
+	}
+
+	return ( max == count ) ? (int)count : -1;
+}
+
+
+
+//Add an object key, numbers included, since JSON only allows strings here
+static int json_key ( lua_State *L, int index, struct xbuf *out, char *err, int errlen ) {
+	char nb[ 64 ] = { 0 };
+	int len = 0;
+
+	if ( lua_type( L, index ) == LUA_TSTRING ) {
+		size_t slen = 0;
+		const char *s = lua_tolstring( L, index, &slen );
+		return json_append_string( out, s, slen );
+	}
+	else if ( lua_isinteger( L, index ) ) {
+		//lua_tostring() would change the key underneath lua_next(), so format it here
+		len = snprintf( nb, sizeof( nb ), LUA_INTEGER_FMT, (LUAI_UACINT)lua_tointeger( L, index ) );
+		return json_append_string( out, nb, len );
+	}
+	else if ( lua_type( L, index ) == LUA_TNUMBER ) {
+		len = snprintf( nb, sizeof( nb ), LUA_NUMBER_FMT, (LUAI_UACNUMBER)lua_tonumber( L, index ) );
+		return json_append_string( out, nb, len );
+	}
+
+	snprintf( err, errlen, "Can't use a %s as a JSON key.", luaL_typename( L, index ) );
+	return 0;
+}
+
+
+
+static int json_value ( lua_State *, int, struct xbuf *, int, char *, int );
+
+//Add a table as either an array or an object
+static int json_table ( lua_State *L, int index, struct xbuf *out, int depth, char *err, int errlen ) {
+	int n = 0;
+
+	if ( depth > LUA_JSON_MAX_DEPTH ) {
+		snprintf( err, errlen, "Tables nested deeper than %d levels (is one inside itself?)", LUA_JSON_MAX_DEPTH );
+		return 0;
+	}
+
+	if ( !lua_checkstack( L, 3 ) ) {
+		snprintf( err, errlen, "Lua stack out of space." );
+		return 0;
+	}
+
+	//Empty tables have always come out as objects
+	if ( !( n = json_sequence( L, index ) ) ) {
+		return json_append( out, "{}", 2 );
+	}
+
+	if ( n > 0 ) {
+		if ( !json_append( out, "[", 1 ) ) {
+			return 0;
+		}
+		for ( int i = 1; i <= n; i++ ) {
+			lua_rawgeti( L, index, i );
+			if ( ( i > 1 && !json_append( out, ",", 1 ) ) || !json_value( L, lua_gettop( L ), out, depth, err, errlen ) ) {
+				lua_pop( L, 1 );
+				return 0;
+			}
+			lua_pop( L, 1 );
+		}
+		return json_append( out, "]", 1 );
+	}
+
+	if ( !json_append( out, "{", 1 ) ) {
+		return 0;
+	}
+
+	lua_pushnil( L );
+	for ( int i = 0; lua_next( L, index ) != 0; i++ ) {
+		if ( ( i && !json_append( out, ",", 1 ) ) 
+			|| !json_key( L, -2, out, err, errlen ) 
+			|| !json_append( out, ":", 1 ) 
+			|| !json_value( L, lua_gettop( L ), out, depth, err, errlen ) ) {
+			lua_pop( L, 2 );
+			return 0;
+		}
+		lua_pop( L, 1 );
+	}
+
+	return json_append( out, "}", 1 );
+}
+
+
+
+//Add any single value
+static int json_value ( lua_State *L, int index, struct xbuf *out, int depth, char *err, int errlen ) {
+	char nb[ 64 ] = { 0 };
+	int len = 0;
+
+	switch ( lua_type( L, index ) ) {
+		case LUA_TSTRING: {
+			size_t slen = 0;
+			const char *s = lua_tolstring( L, index, &slen );
+			return json_append_string( out, s, slen );
+		}
+		case LUA_TNUMBER:
+			if ( lua_isinteger( L, index ) )
+				len = snprintf( nb, sizeof( nb ), LUA_INTEGER_FMT, (LUAI_UACINT)lua_tointeger( L, index ) );
+			else if ( isfinite( lua_tonumber( L, index ) ) ) {
+				//Use Lua's own format unless it loses precision
+				double d = (double)lua_tonumber( L, index );
+				if ( ( len = snprintf( nb, sizeof( nb ), "%.14g", d ) ) && strtod( nb, NULL ) != d ) {
+					len = snprintf( nb, sizeof( nb ), "%.17g", d );
+				}
+			}
+			else {
+				//JSON has no way to write NaN or infinity
+				return json_append( out, "null", 4 );
+			}
+			return json_append( out, nb, len );
+		case LUA_TBOOLEAN:
+			return lua_toboolean( L, index ) ? json_append( out, "true", 4 ) : json_append( out, "false", 5 );
+		case LUA_TTABLE:
+			return json_table( L, index, out, depth + 1, err, errlen );
+		default:
+			//Functions, userdata and threads have nothing to say in JSON (json.null is a userdata too)
+			return json_append( out, "null", 4 );
+	}
+}
+
+
+
+//Write the Lua value at index as JSON onto the end of out
+int lua_to_json ( lua_State *L, int index, struct xbuf *out, char *err, int errlen ) {
+	*err = '\0';
+	if ( !json_value( L, lua_absindex( L, index ), out, 0, err, errlen ) ) {
+		( !*err ) ? snprintf( err, errlen, "Out of memory writing JSON." ) : 0;
+		return 0;
+	}
+	return 1;
+}
+
+
+
+//Where a JSON decode is up to
+struct jdec {
+	lua_State *L;
+	const unsigned char *start, *p, *end;
+	char *err;
+	int errlen;
+};
+
+
+
+//Note where decoding stopped and why
+static int jdec_error ( struct jdec *d, const char *msg ) {
+	snprintf( d->err, d->errlen, "%s at byte %ld.", msg, (long)( d->p - d->start ) );
+	return 0;
+}
+
+
+
+//Skip whitespace between tokens
+static void jdec_space ( struct jdec *d ) {
+	while ( d->p < d->end && ( *d->p == ' ' || *d->p == '\n' || *d->p == '\r' || *d->p == '\t' ) ) {
+		d->p++;
+	}
+}
+
+
+
+//Find the next byte in a string that needs a closer look ('"', '\' or a control byte)
+static const unsigned char * jdec_scan ( const unsigned char *p, const unsigned char *end ) {
+#ifdef __SSE2__
+	const __m128i q = _mm_set1_epi8( '"' ), bs = _mm_set1_epi8( '\\' ), ctl = _mm_set1_epi8( 0x1f );
+	for ( ; end - p >= 16; p += 16 ) {
+		__m128i v = _mm_loadu_si128( (const __m128i *)p );
+		__m128i m = _mm_or_si128( _mm_cmpeq_epi8( v, q ), _mm_cmpeq_epi8( v, bs ) );
+		int bits = _mm_movemask_epi8( _mm_or_si128( m, _mm_cmpeq_epi8( _mm_min_epu8( v, ctl ), v ) ) );
+		if ( bits ) {
+			return p + __builtin_ctz( bits );
+		}
+	}
+#endif
+	for ( ; p < end && *p != '"' && *p != '\\' && *p >= 0x20; p++ ) ;
+	return p;
+}
+
+
+
+//Read four hex digits from a \u escape
+static int jdec_hex ( const unsigned char *p, const unsigned char *end, unsigned long *c ) {
+	*c = 0;
+	if ( end - p < 4 ) {
+		return 0;
+	}
+	for ( int i = 0; i < 4; i++, p++ ) {
+		if ( *p >= '0' && *p <= '9' )
+			*c = ( *c << 4 ) | ( *p - '0' );
+		else if ( ( *p | 0x20 ) >= 'a' && ( *p | 0x20 ) <= 'f' )
+			*c = ( *c << 4 ) | ( ( *p | 0x20 ) - 'a' + 10 );
+		else {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+
+//Add a code point to a string as UTF-8
+static void jdec_utf8 ( luaL_Buffer *b, unsigned long c ) {
+	char u[ 4 ];
+	int n = 0;
+
+	if ( c < 0x80 )
+		u[ 0 ] = c, n = 1;
+	else if ( c < 0x800 )
+		u[ 0 ] = 0xc0 | ( c >> 6 ), u[ 1 ] = 0x80 | ( c & 0x3f ), n = 2;
+	else if ( c < 0x10000 )
+		u[ 0 ] = 0xe0 | ( c >> 12 ), u[ 1 ] = 0x80 | ( ( c >> 6 ) & 0x3f ), u[ 2 ] = 0x80 | ( c & 0x3f ), n = 3;
+	else {
+		u[ 0 ] = 0xf0 | ( c >> 18 ), u[ 1 ] = 0x80 | ( ( c >> 12 ) & 0x3f );
+		u[ 2 ] = 0x80 | ( ( c >> 6 ) & 0x3f ), u[ 3 ] = 0x80 | ( c & 0x3f ), n = 4;
+	}
+
+	luaL_addlstring( b, u, n );
+}
+
+
+
+//Push a string, unescaping it only if it needs it
+static int jdec_string ( struct jdec *d ) {
+	const unsigned char *s = ++d->p, *e = jdec_scan( s, d->end );
+	luaL_Buffer b;
+
+	//Most strings have no escapes and go straight to Lua
+	if ( e < d->end && *e == '"' ) {
+		lua_pushlstring( d->L, (const char *)s, e - s ), d->p = e + 1;
+		return 1;
+	}
+
+	luaL_buffinit( d->L, &b );
+	for ( unsigned long c = 0, lo = 0; ; s = e + 1, e = jdec_scan( s, d->end ) ) {
+		luaL_addlstring( &b, (const char *)s, e - s ), d->p = e;
+
+		if ( e == d->end )
+			return jdec_error( d, "Unterminated string" );
+		else if ( *e == '"' )
+			break;
+		else if ( *e < 0x20 ) {
+			return jdec_error( d, "Control character in string" );
+		}
+
+		if ( ++e == d->end ) {
+			return jdec_error( d, "Unterminated string" );
+		}
+
+		switch ( *e ) {
+			case '"':
+			case '\\':
+			case '/':
+				luaL_addchar( &b, *e );
+				break;
+			case 'b':
+				luaL_addchar( &b, '\b' );
+				break;
+			case 'f':
+				luaL_addchar( &b, '\f' );
+				break;
+			case 'n':
+				luaL_addchar( &b, '\n' );
+				break;
+			case 'r':
+				luaL_addchar( &b, '\r' );
+				break;
+			case 't':
+				luaL_addchar( &b, '\t' );
+				break;
+			case 'u':
+				if ( !jdec_hex( e + 1, d->end, &c ) ) {
+					return jdec_error( d, "Invalid \\u escape" );
+				}
+				e += 4;
+				//Characters outside the BMP come as a pair of escapes
+				if ( c >= 0xd800 && c <= 0xdbff ) {
+					if ( d->end - e < 7 || e[ 1 ] != '\\' || e[ 2 ] != 'u' 
+						|| !jdec_hex( e + 3, d->end, &lo ) || lo < 0xdc00 || lo > 0xdfff ) {
+						return jdec_error( d, "Invalid surrogate pair" );
+					}
+					c = 0x10000 + ( ( c - 0xd800 ) << 10 ) + ( lo - 0xdc00 ), e += 6;
+				}
+				else if ( c >= 0xdc00 && c <= 0xdfff ) {
+					return jdec_error( d, "Invalid surrogate pair" );
+				}
+				jdec_utf8( &b, c );
+				break;
+			default:
+				return jdec_error( d, "Invalid escape" );
+		}
+	}
+
+	luaL_pushresult( &b ), d->p = e + 1;
+	return 1;
+}
+
+
+
+//Push a number, as an integer if it was written as one and fits
+static int jdec_number ( struct jdec *d ) {
+	const unsigned char *s = d->p, *p = d->p, *end = d->end;
+	char nb[ 64 ];
+	size_t len = 0;
+
+	( *p == '-' ) ? p++ : 0;
+	if ( p < end && *p == '0' )
+		p++;
+	else if ( p < end && *p >= '1' && *p <= '9' )
+		while ( p < end && *p >= '0' && *p <= '9' ) p++;
+	else {
+		return jdec_error( d, "Invalid number" );
+	}
+
+	if ( p < end && *p == '.' ) {
+		if ( ++p == end || *p < '0' || *p > '9' ) {
+			return d->p = p, jdec_error( d, "Invalid number" );
+		}
+		while ( p < end && *p >= '0' && *p <= '9' ) p++;
+	}
+
+	if ( p < end && ( *p | 0x20 ) == 'e' ) {
+		( ++p < end && ( *p == '+' || *p == '-' ) ) ? p++ : 0;
+		if ( p == end || *p < '0' || *p > '9' ) {
+			return d->p = p, jdec_error( d, "Invalid number" );
+		}
+		while ( p < end && *p >= '0' && *p <= '9' ) p++;
+	}
+
+	//The text is known good now, so Lua's own conversion picks integer or float
+	if ( ( len = p - s ) < sizeof( nb ) ) {
+		memcpy( nb, s, len ), nb[ len ] = '\0';
+		if ( !lua_stringtonumber( d->L, nb ) ) {
+			return jdec_error( d, "Invalid number" );
+		}
+	}
+	else {
+		lua_pushlstring( d->L, (const char *)s, len );
+		if ( !lua_stringtonumber( d->L, lua_tostring( d->L, -1 ) ) ) {
+			return jdec_error( d, "Invalid number" );
+		}
+		lua_remove( d->L, -2 );
+	}
+
+	d->p = p;
+	return 1;
+}
+
+
+
+//Check for true, false or null
+static int jdec_literal ( struct jdec *d, const char *word, int len ) {
+	if ( d->end - d->p < len || memcmp( d->p, word, len ) ) {
+		return jdec_error( d, "Unexpected character" );
+	}
+	d->p += len;
+	return 1;
+}
+
+
+
+static int jdec_value ( struct jdec *, int );
+
+//Push an object as a table
+static int jdec_object ( struct jdec *d, int depth ) {
+	d->p++, lua_newtable( d->L ), jdec_space( d );
+	if ( d->p < d->end && *d->p == '}' ) {
+		d->p++;
+		return 1;
+	}
+
+	for ( ;; ) {
+		jdec_space( d );
+		if ( d->p == d->end || *d->p != '"' ) {
+			return jdec_error( d, "Expected a string key" );
+		}
+
+		if ( !jdec_string( d ) ) {
+			return 0;
+		}
+
+		jdec_space( d );
+		if ( d->p == d->end || *d->p != ':' ) {
+			return jdec_error( d, "Expected ':'" );
+		}
+
+		//A null value leaves the key out, same as assigning nil in Lua
+		d->p++;
+		if ( !jdec_value( d, depth ) ) {
+			return 0;
+		}
+		lua_rawset( d->L, -3 );
+
+		jdec_space( d );
+		if ( d->p < d->end && *d->p == ',' )
+			d->p++;
+		else if ( d->p < d->end && *d->p == '}' ) {
+			d->p++;
+			return 1;
+		}
+		else {
+			return jdec_error( d, "Expected ',' or '}'" );
+		}
+	}
+}
+
+
+
+//Push an array as a table starting at 1
+static int jdec_array ( struct jdec *d, int depth ) {
+	d->p++, lua_newtable( d->L ), jdec_space( d );
+	if ( d->p < d->end && *d->p == ']' ) {
+		d->p++;
+		return 1;
+	}
+
+	for ( lua_Integer n = 1; ; n++ ) {
+		if ( !jdec_value( d, depth ) ) {
+			return 0;
+		}
+
+		//A nil would leave a hole and turn the array into an object, so null becomes json.null
+		if ( lua_isnil( d->L, -1 ) ) {
+			lua_pop( d->L, 1 ), lua_pushlightuserdata( d->L, NULL );
+		}
+		lua_rawseti( d->L, -2, n );
+
+		jdec_space( d );
+		if ( d->p < d->end && *d->p == ',' )
+			d->p++;
+		else if ( d->p < d->end && *d->p == ']' ) {
+			d->p++;
+			return 1;
+		}
+		else {
+			return jdec_error( d, "Expected ',' or ']'" );
+		}
+	}
+}
+
+
+
+//Push any single value
+static int jdec_value ( struct jdec *d, int depth ) {
+	if ( depth > LUA_JSON_MAX_DEPTH ) {
+		return jdec_error( d, "JSON nested too deeply" );
+	}
+
+	if ( !lua_checkstack( d->L, 4 ) ) {
+		return jdec_error( d, "Lua stack out of space" );
+	}
+
+	jdec_space( d );
+	if ( d->p == d->end ) {
+		return jdec_error( d, "Unexpected end of JSON" );
+	}
+
+	switch ( *d->p ) {
+		case '{':
+			return jdec_object( d, depth + 1 );
+		case '[':
+			return jdec_array( d, depth + 1 );
+		case '"':
+			return jdec_string( d );
+		case 't':
+			return jdec_literal( d, "true", 4 ) ? ( lua_pushboolean( d->L, 1 ), 1 ) : 0;
+		case 'f':
+			return jdec_literal( d, "false", 5 ) ? ( lua_pushboolean( d->L, 0 ), 1 ) : 0;
+		case 'n':
+			return jdec_literal( d, "null", 4 ) ? ( lua_pushnil( d->L ), 1 ) : 0;
+		case '-':
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			return jdec_number( d );
+		default:
+			return jdec_error( d, "Unexpected character" );
+	}
+}
+
+
+
+//Decode len bytes of JSON at src and push the result onto the stack
+int json_to_lua ( lua_State *L, const char *src, size_t len, char *err, int errlen ) {
+	struct jdec d = { L, (const unsigned char *)src, (const unsigned char *)src, (const unsigned char *)src + len, err, errlen };
+	int top = lua_gettop( L );
+
+	*err = '\0';
+	if ( jdec_value( &d, 0 ) ) {
+		jdec_space( &d );
+		if ( d.p == d.end ) {
+			return 1;
+		}
+		jdec_error( &d, "Unexpected data after JSON" );
+	}
+
+	lua_settop( L, top );
+	return 0;
+}
+
+
+
 //Retrieve a value from a table (and return the index it was found at or -1)
 const char * lua_getv ( lua_State *L, const char *key, int index ) {
 	lua_pushnil( L );
@@ -26,6 +26,8 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <math.h>
 #include <router.h>
 #include "util.h"
 #include "config.h"
@@ -89,6 +91,8 @@ enum zlua_error {
 void lua_dumpstack ( lua_State * );
 int ztable_to_lua ( lua_State *, zTable * ) ;
 int lua_to_ztable ( lua_State *, int, zTable * ) ;
+int lua_to_json ( lua_State *, int, struct xbuf *, char *, int );
+int json_to_lua ( lua_State *, const char *, size_t, char *, int );
 int lua_exec_file( lua_State *, const char *, char *, int );
 int lua_merge ( lua_State * );
 int lua_count ( lua_State *, int );
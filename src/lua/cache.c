@@ -0,0 +1,421 @@
+/* -------------------------------------------- *
+cache
+=====
+
+A cache shared across requests and threads.
+
+Usage
+-----
+Strings, numbers, booleans and tables of them can be cached.  Tables
+are copied in and out, so changing one after it's been cached (or
+fetched) doesn't change the cached value.
+
+### set ###
+
+cache.set( key, value, [ttl] ) caches value for ttl seconds, or until
+it's pushed out if there's no ttl.  Setting nil removes a key.  Returns
+false if the value was too large to cache.
+
+### get ###
+
+cache.get( key ) returns a copy of a cached value, or nil.
+
+### delete ###
+
+cache.delete( key ) removes a key, returning true if it was there.
+
+
+LICENSE
+-------
+Copyright 2020-2021 Tubular Modular Inc. dba Collins Design
+See LICENSE in the top-level directory for more information.
+ * -------------------------------------------- */
+#include "cache.h"
+
+//A slice of the cache with its own lock
+struct cshard_t {
+	pthread_mutex_t lock;
+	struct centry_t **buckets;
+	struct centry_t *newest, *oldest;
+	unsigned int mask;
+	unsigned int count;
+	long bytes;
+};
+
+static struct cshard_t shards[ CACHE_SHARDS ];
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+
+
+//Set up every shard
+static void cache_init ( void ) {
+	for ( int i = 0; i < CACHE_SHARDS; i++ ) {
+		pthread_mutex_init( &shards[ i ].lock, NULL );
+		if ( ( shards[ i ].buckets = malloc( sizeof( struct centry_t * ) * 64 ) ) ) {
+			memset( shards[ i ].buckets, 0, sizeof( struct centry_t * ) * 64 );
+			shards[ i ].mask = 63;
+		}
+	}
+}
+
+
+
+//Hash a key, starting from the site it belongs to
+static unsigned int cache_hash ( unsigned int h, const char *s, int len ) {
+	for ( int i = 0; i < len; i++ ) {
+		h = ( h ^ (unsigned char)s[ i ] ) * 16777619u;
+	}
+	return h;
+}
+
+
+
+//Get the site the current request belongs to
+static unsigned int cache_site ( lua_State *L ) {
+	unsigned int site = 2166136261u;
+	if ( lua_getglobal( L, "shadow" ) == LUA_TSTRING ) {
+		size_t len = 0;
+		const char *s = lua_tolstring( L, -1, &len );
+		site = cache_hash( site, s, len );
+	}
+	lua_pop( L, 1 );
+	return site;
+}
+
+
+
+static struct centry_t ** cache_bucket ( struct cshard_t *s, unsigned int hash ) {
+	return &s->buckets[ ( hash / CACHE_SHARDS ) & s->mask ];
+}
+
+
+
+//Let go of an entry, freeing it once nobody is reading it anymore
+static void cache_release ( struct centry_t *e ) {
+	if ( __atomic_sub_fetch( &e->refs, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+		free( e );
+	}
+}
+
+
+
+//Take an entry out of its shard (which must be locked)
+static void cache_unlink ( struct cshard_t *s, struct centry_t *e ) {
+	struct centry_t **b = cache_bucket( s, e->hash );
+	for ( ; *b && *b != e; b = &(*b)->next ) ;
+	( *b ) ? *b = e->next : 0;
+
+	( e->lprev ) ? e->lprev->lnext = e->lnext : ( s->newest = e->lnext );
+	( e->lnext ) ? e->lnext->lprev = e->lprev : ( s->oldest = e->lprev );
+
+	s->bytes -= e->size, s->count--;
+	cache_release( e );
+}
+
+
+
+//Move an entry to the front of the line
+static void cache_use ( struct cshard_t *s, struct centry_t *e ) {
+	if ( s->newest != e ) {
+		e->lprev->lnext = e->lnext;
+		( e->lnext ) ? e->lnext->lprev = e->lprev : ( s->oldest = e->lprev );
+		e->lprev = NULL, e->lnext = s->newest;
+		s->newest->lprev = e, s->newest = e;
+	}
+}
+
+
+
+//Find a live entry (the shard must be locked), dropping anything expired along the way
+static struct centry_t * cache_find ( struct cshard_t *s, unsigned int hash, unsigned int site, const char *key, int klen, time_t now ) {
+	for ( struct centry_t *e = *cache_bucket( s, hash ), *n = NULL; e; e = n ) {
+		n = e->next;
+		if ( e->expires && e->expires <= now )
+			cache_unlink( s, e );
+		else if ( e->hash == hash && e->site == site && e->klen == klen && !memcmp( e->data, key, klen ) ) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+
+//Double a shard's buckets once it holds more entries than it has buckets
+static void cache_grow ( struct cshard_t *s ) {
+	unsigned int size = ( s->mask + 1 ) * 2;
+	struct centry_t **buckets = NULL, **old = s->buckets;
+
+	//A shard that can't grow just gets longer chains
+	if ( !( buckets = malloc( sizeof( struct centry_t * ) * size ) ) ) {
+		return;
+	}
+
+	memset( buckets, 0, sizeof( struct centry_t * ) * size );
+	s->buckets = buckets, s->mask = size - 1;
+	for ( unsigned int i = 0; i < size / 2; i++ ) {
+		for ( struct centry_t *e = old[ i ], *n = NULL; e; e = n ) {
+			struct centry_t **b = cache_bucket( s, e->hash );
+			n = e->next, e->next = *b, *b = e;
+		}
+	}
+	free( old );
+}
+
+
+
+static int cache_reserve ( struct xbuf *out, int n ) {
+	unsigned char *b = NULL;
+	int size = ( out->size ) ? out->size : 256;
+
+	if ( out->len + n <= out->size ) {
+		return 1;
+	}
+
+	for ( ; size < out->len + n; size *= 2 ) ;
+
+	if ( !( b = realloc( out->ptr, size ) ) ) {
+		return 0;
+	}
+
+	out->ptr = b, out->size = size;
+	return 1;
+}
+
+
+
+static int cache_append ( struct xbuf *out, int tag, const void *src, int len ) {
+	if ( !cache_reserve( out, len + 1 ) ) {
+		return 0;
+	}
+	out->ptr[ out->len++ ] = tag;
+	if ( len > 0 ) {
+		memcpy( &out->ptr[ out->len ], src, len ), out->len += len;
+	}
+	return 1;
+}
+
+
+
+//Pack the value at index into out
+static int cache_pack ( lua_State *L, int index, struct xbuf *out, int depth, char *err, int errlen ) {
+	int type = lua_type( L, index );
+
+	if ( type == LUA_TBOOLEAN )
+		return cache_append( out, lua_toboolean( L, index ) ? 'T' : 'F', NULL, 0 );
+	else if ( type == LUA_TNUMBER && lua_isinteger( L, index ) ) {
+		lua_Integer i = lua_tointeger( L, index );
+		return cache_append( out, 'i', &i, sizeof( i ) );
+	}
+	else if ( type == LUA_TNUMBER ) {
+		lua_Number n = lua_tonumber( L, index );
+		return cache_append( out, 'd', &n, sizeof( n ) );
+	}
+	else if ( type == LUA_TSTRING ) {
+		size_t len = 0;
+		const char *s = lua_tolstring( L, index, &len );
+		unsigned int l = len;
+		if ( len > INT_MAX / 2 ) {
+			snprintf( err, errlen, "String too large to cache." );
+			return 0;
+		}
+		return cache_append( out, 's', &l, sizeof( l ) ) && cache_reserve( out, l ) &&
+			memcpy( &out->ptr[ out->len ], s, l ) && ( out->len += l );
+	}
+	else if ( type == LUA_TTABLE ) {
+		if ( depth >= CACHE_MAX_DEPTH || !lua_checkstack( L, 3 ) ) {
+			snprintf( err, errlen, "Table nests too deeply to cache." );
+			return 0;
+		}
+
+		index = lua_absindex( L, index );
+		if ( !cache_append( out, 't', NULL, 0 ) ) {
+			return 0;
+		}
+
+		for ( lua_pushnil( L ); lua_next( L, index ); lua_pop( L, 1 ) ) {
+			if ( !cache_pack( L, -2, out, depth + 1, err, errlen ) || !cache_pack( L, -1, out, depth + 1, err, errlen ) ) {
+				lua_pop( L, 2 );
+				return 0;
+			}
+		}
+		return cache_append( out, 'e', NULL, 0 );
+	}
+
+	snprintf( err, errlen, "Can't cache a %s.", lua_typename( L, type ) );
+	return 0;
+}
+
+
+
+//Push the value packed at p, returning where the next one starts
+static const unsigned char * cache_unpack ( lua_State *L, const unsigned char *p ) {
+	if ( *p == 'T' || *p == 'F' )
+		lua_pushboolean( L, *p == 'T' ), p++;
+	else if ( *p == 'i' ) {
+		lua_Integer i = 0;
+		memcpy( &i, p + 1, sizeof( i ) ), p += 1 + sizeof( i );
+		lua_pushinteger( L, i );
+	}
+	else if ( *p == 'd' ) {
+		lua_Number n = 0;
+		memcpy( &n, p + 1, sizeof( n ) ), p += 1 + sizeof( n );
+		lua_pushnumber( L, n );
+	}
+	else if ( *p == 's' ) {
+		unsigned int l = 0;
+		memcpy( &l, p + 1, sizeof( l ) ), p += 1 + sizeof( l );
+		lua_pushlstring( L, (const char *)p, l ), p += l;
+	}
+	else {
+		luaL_checkstack( L, 3, "Table nests too deeply." );
+		lua_newtable( L );
+		for ( p++; *p != 'e'; ) {
+			p = cache_unpack( L, p );
+			p = cache_unpack( L, p );
+			lua_rawset( L, -3 );
+		}
+		p++;
+	}
+	return p;
+}
+
+
+
+//Push the value of the entry at index 1 (run protected, so the entry is let go of even if Lua raises)
+static int cache_unpack_entry ( lua_State *L ) {
+	struct centry_t *e = lua_touserdata( L, 1 );
+	cache_unpack( L, e->data + e->klen );
+	return 1;
+}
+
+
+
+//Return a copy of the value cached at key
+int cache_get ( lua_State *L ) {
+	size_t klen = 0;
+	const char *key = luaL_checklstring( L, 1, &klen );
+	unsigned int site = cache_site( L ), hash = cache_hash( site, key, klen );
+	struct cshard_t *s = &shards[ hash % CACHE_SHARDS ];
+	struct centry_t *e = NULL;
+	int status = LUA_OK;
+
+	pthread_once( &cache_once, cache_init );
+
+	//Readers hold a reference, so the value can be unpacked without the lock
+	pthread_mutex_lock( &s->lock );
+	if ( ( e = cache_find( s, hash, site, key, klen, time( NULL ) ) ) ) {
+		cache_use( s, e );
+		__atomic_add_fetch( &e->refs, 1, __ATOMIC_RELAXED );
+	}
+	pthread_mutex_unlock( &s->lock );
+
+	if ( !e ) {
+		lua_pushnil( L );
+		return 1;
+	}
+
+	lua_pushcfunction( L, cache_unpack_entry );
+	lua_pushlightuserdata( L, e );
+	status = lua_pcall( L, 1, 1, 0 );
+	cache_release( e );
+	return ( status == LUA_OK ) ? 1 : lua_error( L );
+}
+
+
+
+//Cache a value at key for ttl seconds (or until it's pushed out)
+int cache_store ( lua_State *L ) {
+	size_t klen = 0;
+	const char *key = luaL_checklstring( L, 1, &klen );
+	lua_Integer ttl = luaL_optinteger( L, 3, 0 );
+	unsigned int site = cache_site( L ), hash = cache_hash( site, key, klen );
+	struct cshard_t *s = &shards[ hash % CACHE_SHARDS ];
+	struct centry_t *e = NULL, *old = NULL;
+	struct xbuf out = { 0 };
+	char err[ 128 ] = { 0 };
+	time_t now = time( NULL );
+
+	if ( lua_isnoneornil( L, 2 ) ) {
+		return cache_delete( L );
+	}
+
+	pthread_once( &cache_once, cache_init );
+
+	//The entry is packed in place, so its header and key go first
+	if ( klen > INT_MAX / 2 || !cache_reserve( &out, sizeof( struct centry_t ) + klen ) ) {
+		return luaL_error( L, "cache - out of memory." );
+	}
+	memcpy( out.ptr + sizeof( struct centry_t ), key, klen );
+	out.len = sizeof( struct centry_t ) + klen;
+
+	if ( !cache_pack( L, 2, &out, 0, err, sizeof( err ) ) ) {
+		free( out.ptr );
+		return luaL_error( L, "cache - %s", ( *err ) ? err : "out of memory." );
+	}
+
+	//Values that would push out a whole shard aren't worth keeping
+	if ( out.len > CACHE_MAX_BYTES / CACHE_SHARDS ) {
+		free( out.ptr );
+		lua_pushboolean( L, 0 );
+		return 1;
+	}
+
+	e = (struct centry_t *)out.ptr;
+	e->next = e->lprev = e->lnext = NULL;
+	e->hash = hash, e->site = site, e->refs = 1;
+	e->klen = klen, e->size = out.len;
+	e->expires = ( ttl > 0 ) ? now + ttl : 0;
+
+	pthread_mutex_lock( &s->lock );
+	if ( ( old = cache_find( s, hash, site, key, klen, now ) ) ) {
+		cache_unlink( s, old );
+	}
+
+	if ( s->count >= s->mask + 1 ) {
+		cache_grow( s );
+	}
+
+	e->next = *cache_bucket( s, hash ), *cache_bucket( s, hash ) = e;
+	e->lnext = s->newest, s->newest = e;
+	( e->lnext ) ? e->lnext->lprev = e : ( s->oldest = e );
+	s->bytes += e->size, s->count++;
+
+	//Make room by dropping whatever was used longest ago
+	while ( s->bytes > CACHE_MAX_BYTES / CACHE_SHARDS && s->oldest != e ) {
+		cache_unlink( s, s->oldest );
+	}
+	pthread_mutex_unlock( &s->lock );
+
+	lua_pushboolean( L, 1 );
+	return 1;
+}
+
+
+
+//Remove key from the cache
+int cache_delete ( lua_State *L ) {
+	size_t klen = 0;
+	const char *key = luaL_checklstring( L, 1, &klen );
+	unsigned int site = cache_site( L ), hash = cache_hash( site, key, klen );
+	struct cshard_t *s = &shards[ hash % CACHE_SHARDS ];
+	struct centry_t *e = NULL;
+
+	pthread_once( &cache_once, cache_init );
+	pthread_mutex_lock( &s->lock );
+	( ( e = cache_find( s, hash, site, key, klen, time( NULL ) ) ) ) ? cache_unlink( s, e ) : 0;
+	pthread_mutex_unlock( &s->lock );
+
+	lua_pushboolean( L, e != NULL );
+	return 1;
+}
+
+
+struct luaL_Reg cache_set[] = {
+ { "get", cache_get }
+,{ "set", cache_store }
+,{ "delete", cache_delete }
+,{ NULL }
+};
+
@@ -0,0 +1,62 @@
+/* ------------------------------------------- *
+ * cache.h
+ * =======
+ *
+ * Summary
+ * -------
+ * A cache shared by every request and thread.
+ *
+ * Usage
+ * -----
+ * Values are packed into a single allocation along with their key and
+ * kept in CACHE_SHARDS separately locked hash tables.  Each shard drops
+ * its least recently used values once it holds more than its share of
+ * CACHE_MAX_BYTES.  Keys are scoped to the site that set them.
+ *
+ * LICENSE
+ * -------
+ * Copyright 2020-2021 Tubular Modular Inc. dba Collins Design
+ *
+ * See LICENSE in the top-level directory for more information.
+ *
+ * CHANGELOG
+ * ---------
+ * -
+ * ------------------------------------------- */
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <zrender.h>
+#include "../lua.h"
+#include "../config.h"
+
+#ifndef LCACHE_H
+#define LCACHE_H
+
+//How deeply a table can nest before it won't be cached
+#define CACHE_MAX_DEPTH 64
+
+//A cached value, with its key and packed value laid out after it
+struct centry_t {
+	struct centry_t *next;
+	struct centry_t *lprev, *lnext;
+	unsigned int hash;
+	unsigned int site;
+	int refs;
+	int klen;
+	int size;
+	time_t expires;
+	unsigned char data[];
+};
+
+int cache_get ( lua_State * );
+
+int cache_store ( lua_State * );
+
+int cache_delete ( lua_State * );
+
+extern struct luaL_Reg cache_set[];
+#endif
@@ -26,6 +26,25 @@ A bunch of notes on how to use this thing.
 ```
 Yeah
 ```
+
+
+### rows ###
+
+Takes the same arguments as db.exec, but hands back one row at a time 
+so that large result sets don't have to fit in memory.
+
+```
+for row in db.rows{ conn = "sqlite3://db.sqlite", string = "SELECT * FROM t" } do
+	...
+end
+```
+
+Values in either case come back as integers, numbers or strings, and 
+NULL columns are left out of the row.
+
+Handles and their prepared statements stay open between requests and 
+are shared by every thread in the process, though only one thread uses 
+a handle at a time. A request gives its handles back when it finishes.
  * -------------------------------------------- */
 #include "db.h"
 
@@ -36,238 +55,559 @@ static const char *engines[] = {
 , NULL
 };
 
+//Handles are shared by the whole process, but each is only used by one thread at a time
+struct dbpool_t {
+	pthread_mutex_t lock;
+	struct dbconn_t conns[ DB_POOL_SIZE ];
+	struct dbconn_t *extra;
+	unsigned long clock;
+};
 
+static struct dbpool_t pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
-//Accepts three arguments { db, [query,file], bind_args }
-int db_exec ( lua_State *L ) {
-	//Define everything at the top
-	const char *connstr = NULL, *query = NULL;
-	char file[ 1024 ] = {0}, conn[ 1024 ] = {0}, shadow[ 1024 ] = {0};
-	int pos, len = 0, inc = 0;
-	char err[ 1024 ] = { 0 };
-	zTable tt, *t, *results;
-	zdb_t zdb = { 0 }; 
-	zdbv_t **zdbbind = NULL;
 
-	//Check for arguments...
-	luaL_checktype( L, 1, LUA_TTABLE );
+
+//Finalize every cached statement and close the handle
+static void db_conn_close ( struct dbconn_t *c ) {
+	for ( int i = 0; i < DB_STMT_CACHE_SIZE; i++ ) {
+		( c->stmts[ i ].stmt ) ? sqlite3_finalize( c->stmts[ i ].stmt ) : 0;
+		free( c->stmts[ i ].sql );
+	}
+	( c->db ) ? sqlite3_close( c->db ) : 0;
+	free( c->path );
+	memset( c, 0, sizeof( struct dbconn_t ) );
+}
 
 
-	// Doubling the count is safest...
-	int count = lua_count( L, 1 );
-	count *= 2;
 
-	//Within this table need to exist a few keys
-	//TODO: Doing this statically will save time, energy and memory
-	t = &tt;
-	lt_init( t, NULL, count ); 
+//Close a handle that didn't open, taking it out of the pool
+static void db_conn_drop ( struct dbconn_t *c ) {
+	int spare = c->spare;
 
-	//Convert to C table for slightly easier key extraction	
-	if ( !lua_to_ztable( L, 1, t ) || !lt_lock( t ) ) {
-		lt_free( t );
-		return luaL_error( L, "Failed to convert to zTable" );
+	pthread_mutex_lock( &pool.lock );
+	for ( struct dbconn_t **p = &pool.extra; *p; p = &(*p)->next ) {
+		if ( *p == c ) {
+			*p = c->next;
+			break;
+		}
 	}
+	pthread_mutex_unlock( &pool.lock );
+
+	db_conn_close( c );
+	if ( spare ) {
+		free( c );
+	}
+}
 
-	//After we're done getting the table, that should be it
-	lua_pop( L, 1 );	
 
-	//Check for needed args, starting with dbname (or conn str, whatever)
-	//Then we have to initialize the underlying lib
 
-	//Db should point to a real file
-	//Conn should be what we use
-	if ( ( pos = lt_geti( t, "conn" ) ) == -1 ) {
-		lt_free( t );
-		return luaL_error( L, "Connection unspecified." );
+static unsigned int db_hash ( const char *s, int len ) {
+	unsigned int h = 2166136261u;
+	for ( int i = 0; i < len; i++ ) {
+		h = ( h ^ (unsigned char)s[ i ] ) * 16777619u;
 	}
-	else {
-		//Check for a valid engine (since right now it's only sqlite)
-		const char *dbstr = lt_text_at( t, pos );
-		for ( const char **k = engines; *k; k++ ) {
-			int len = strlen( *k );
-			if ( strlen( dbstr ) >= len && memcmp( *k, dbstr, len ) == 0 ) {
-				connstr = dbstr += len;
-				break;
+	return h;
+}
+
+
+
+//Check out a handle to path for this thread, opening one if there isn't one free
+struct dbconn_t * db_pool_open ( const char *path, char *err, int errlen ) {
+	struct dbconn_t *c = NULL;
+	struct stat st = { 0 };
+	pthread_t self = pthread_self();
+
+	//A handle is only good as long as the file it was opened on is still there
+	int exists = ( stat( path, &st ) == 0 );
+
+	pthread_mutex_lock( &pool.lock );
+	for ( int i = 0; i < DB_POOL_SIZE; i++ ) {
+		struct dbconn_t *p = &pool.conns[ i ];
+
+		//Whatever another thread has checked out is off limits until it's given back
+		if ( p->held && !pthread_equal( p->owner, self ) ) {
+			continue;
+		}
+
+		if ( p->db && !strcmp( p->path, path ) ) {
+			//Handles with open iterators can't be swapped out from under them
+			if ( p->refs || ( exists && p->dev == st.st_dev && p->ino == st.st_ino ) ) {
+				p->held = 1, p->owner = self, p->used = ++pool.clock;
+				pthread_mutex_unlock( &pool.lock );
+				return p;
+			}
+			c = p;
+			break;
+		}
+
+		//Empty slots go first, then whichever was used longest ago
+		if ( !p->refs && ( !c || p->used < c->used ) ) {
+			c = p;
+		}
+	}
+
+	//Every slot is busy elsewhere, so this thread gets a handle of its own until it's done
+	if ( !c ) {
+		for ( c = pool.extra; c; c = c->next ) {
+			if ( pthread_equal( c->owner, self ) && !strcmp( c->path, path ) ) {
+				pthread_mutex_unlock( &pool.lock );
+				return c;
 			}
 		}
-		if ( !connstr ) {
-			char buf[64] = {0}, *i = index( dbstr, ':' );
-			memcpy( buf, dbstr, strlen( dbstr ) - ( ( i ) ? strlen( i ) : 0 ) );
-			return luaL_error( L, "Unsupported database type: '%s'.", buf );
+
+		if ( !( c = malloc( sizeof( struct dbconn_t ) ) ) ) {
+			pthread_mutex_unlock( &pool.lock );
+			snprintf( err, errlen, "Out of memory." );
+			return NULL;
+		}
+		memset( c, 0, sizeof( struct dbconn_t ) );
+		c->spare = 1, c->next = pool.extra, pool.extra = c;
+	}
+
+	//Nobody else can touch a handle once it's held, so the rest can go on unlocked
+	c->held = 1, c->owner = self, c->used = ++pool.clock;
+	pthread_mutex_unlock( &pool.lock );
+
+	if ( c->db ) {
+		int spare = c->spare;
+		struct dbconn_t *next = c->next;
+		db_conn_close( c );
+		c->held = 1, c->owner = self, c->spare = spare, c->next = next;
+	}
+
+	if ( sqlite3_open( path, &c->db ) != SQLITE_OK ) {
+		snprintf( err, errlen, "%s", ( c->db ) ? sqlite3_errmsg( c->db ) : "Out of memory." );
+		db_conn_drop( c );
+		return NULL;
+	}
+
+	if ( !( c->path = strdup( path ) ) ) {
+		snprintf( err, errlen, "Out of memory." );
+		db_conn_drop( c );
+		return NULL;
+	}
+
+	//In-memory databases can't change journal modes, so errors don't matter here
+	sqlite3_busy_timeout( c->db, DB_BUSY_TIMEOUT );
+	sqlite3_exec( c->db, "PRAGMA journal_mode=" DB_JOURNAL_MODE, NULL, NULL, NULL );
+
+	if ( stat( path, &st ) == 0 ) {
+		c->dev = st.st_dev, c->ino = st.st_ino;
+	}
+
+	return c;
+}
+
+
+
+//Give back every handle this thread checked out, save those an open iterator still needs
+void db_pool_done ( void ) {
+	struct dbconn_t *spares = NULL;
+	pthread_t self = pthread_self();
+
+	pthread_mutex_lock( &pool.lock );
+	for ( int i = 0; i < DB_POOL_SIZE; i++ ) {
+		struct dbconn_t *p = &pool.conns[ i ];
+		if ( p->held && !p->refs && pthread_equal( p->owner, self ) ) {
+			p->held = 0;
+		}
+	}
+
+	for ( struct dbconn_t **p = &pool.extra, *c = NULL; ( c = *p ); ) {
+		if ( c->refs || !pthread_equal( c->owner, self ) )
+			p = &c->next;
+		else {
+			*p = c->next, c->next = spares, spares = c;
+		}
+	}
+	pthread_mutex_unlock( &pool.lock );
+
+	//Handles opened past the size of the pool are only kept for as long as they're used
+	for ( struct dbconn_t *n = NULL; spares; spares = n ) {
+		n = spares->next;
+		db_conn_close( spares );
+		free( spares );
+	}
+}
+
+
+
+//Return a prepared statement for sql, reusing one from an earlier query if possible
+struct dbstmt_t * db_pool_prepare ( struct dbconn_t *c, const char *sql, char *err, int errlen ) {
+	struct dbstmt_t *s = NULL;
+	int len = strlen( sql );
+	unsigned int hash = db_hash( sql, len );
+
+	//Statements held by an iterator are skipped, so the same SQL can run inside its loop
+	for ( int i = 0; i < DB_STMT_CACHE_SIZE; i++ ) {
+		struct dbstmt_t *p = &c->stmts[ i ];
+		if ( p->inuse ) {
+			continue;
+		}
+		if ( p->stmt && p->hash == hash && p->len == len && !memcmp( p->sql, sql, len ) ) {
+			sqlite3_reset( p->stmt ), sqlite3_clear_bindings( p->stmt );
+			p->used = ++c->clock;
+			return p;
+		}
+		s = ( !s || p->used < s->used ) ? p : s;
+	}
+
+	if ( !s ) {
+		snprintf( err, errlen, "Too many queries open at once." );
+		return NULL;
+	}
+
+	( s->stmt ) ? sqlite3_finalize( s->stmt ) : 0;
+	free( s->sql );
+	memset( s, 0, sizeof( struct dbstmt_t ) );
+
+	if ( sqlite3_prepare_v2( c->db, sql, len + 1, &s->stmt, NULL ) != SQLITE_OK ) {
+		snprintf( err, errlen, "sqlite3 prepare error: %s", sqlite3_errmsg( c->db ) );
+		return NULL;
+	}
+
+	//Blank queries and comments prepare to nothing
+	if ( !s->stmt ) {
+		snprintf( err, errlen, "No SQL statement found." );
+		return NULL;
+	}
+
+	if ( !( s->sql = malloc( len + 1 ) ) ) {
+		sqlite3_finalize( s->stmt ), s->stmt = NULL;
+		snprintf( err, errlen, "Out of memory." );
+		return NULL;
+	}
+
+	memcpy( s->sql, sql, len + 1 );
+	s->len = len, s->hash = hash, s->used = ++c->clock;
+	return s;
+}
+
+
+
+//Open the database named by { conn, [string, file] } at index 1 and prepare its query
+static struct dbstmt_t * db_prepare ( lua_State *L, struct dbconn_t **c ) {
+	const char *connstr = NULL, *query = NULL, *shadow = NULL;
+	char path[ PATH_MAX ] = { 0 }, err[ 1024 ] = { 0 };
+	struct dbstmt_t *s = NULL;
+
+	//Check for a valid engine (since right now it's only sqlite)
+	if ( lua_getfield( L, 1, "conn" ) != LUA_TSTRING ) {
+		luaL_error( L, "Connection unspecified." );
+		return NULL;
+	}
+
+	connstr = lua_tostring( L, -1 );
+	for ( const char **k = engines; *k; k++ ) {
+		int len = strlen( *k );
+		if ( !strncmp( *k, connstr, len ) ) {
+			connstr += len;
+			break;
+		}
+		else if ( !k[ 1 ] ) {
+			const char *i = index( connstr, ':' );
+			luaL_error( L, "Unsupported database type: '%s'.",
+				lua_pushlstring( L, connstr, ( i ) ? i - connstr : strlen( connstr ) ) );
+			return NULL;
 		}
 	}
 
-	//Get the shadow path if there is one
+	//Get the shadow path if there is one and translate the connection to it
 	//TODO: Eventually, this should be replaced with lua_retglobal
-	lua_getglobal( L, "shadow" ); 
-	if ( lua_isnil( L, -1 ) )
-		lua_pop( L, 1 ); 
-	else {
-		//Translate the connection to the right path
-		snprintf( shadow, sizeof( shadow ), "%s", lua_tostring( L, -1 ) );
-		snprintf( conn, sizeof( conn ), "%s/%s", shadow, connstr );
-		lua_pop( L, 1 );
+	if ( lua_getglobal( L, "shadow" ) == LUA_TSTRING ) {
+		shadow = lua_tostring( L, -1 );
 	}
+	snprintf( path, sizeof( path ), "%s%s%s", ( shadow ) ? shadow : "", ( shadow ) ? "/" : "", connstr );
 
 	//Then get the query
-	if ( ( pos = lt_geti( t, "string" ) ) > -1 )
-		query = lt_text_at( t, pos );
-	else if ( ( pos = lt_geti( t, "file" ) ) > -1 ) {
+	if ( lua_getfield( L, 1, "string" ) == LUA_TSTRING )
+		query = lua_tostring( L, -1 );
+	else if ( lua_getfield( L, 1, "file" ) == LUA_TSTRING ) {
+		char file[ PATH_MAX ] = { 0 };
 		char *f = NULL;
-		if ( ( f = lt_text_at( t, pos ) ) )
-			snprintf( file, sizeof( file ), "%s/%s", shadow, f );
-		else {
-			return luaL_error( L, "file key was specified, but was not a string\n" );
+		int len = 0;
+		snprintf( file, sizeof( file ), "%s/%s", ( shadow ) ? shadow : ".", lua_tostring( L, -1 ) );
+		if ( !( f = (char *)read_file( file, &len, err, sizeof( err ) ) ) ) {
+			luaL_error( L, "Failed to open file %s: %s\n", file, err );
+			return NULL;
 		}
 
-		if ( !( query = (char *)read_file( file, &len, err, sizeof( err ) ) ) ) {
-			lt_free( t );
-			return luaL_error( L, "Failed to open file %s: %s\n", file, err );
-		}
+		//Keep the query on the stack so an error further down can't leak it
+		query = lua_pushlstring( L, f, len );
+		free( f );
 	}
 	else {
-		lt_free( t );
-		return luaL_error( L, "Neither 'string' nor 'file' were present in call to %s", "db_exec" );
+		luaL_error( L, "Neither 'string' nor 'file' were present in call to %s", "db_exec" );
+		return NULL;
+	}
+
+	if ( !( *c = db_pool_open( path, err, sizeof( err ) ) ) ) {
+		luaL_error( L, "Connection error: %s", err );
+		return NULL;
+	}
+
+	if ( !( s = db_pool_prepare( *c, query, err, sizeof( err ) ) ) ) {
+		luaL_error( L, "SQL execution error: %s", err );
+		return NULL;
+	}
+
+	return s;
+}
+
+
+
+//Bind the values of the bindargs table at index 1 to their :named parameters
+static void db_bind ( lua_State *L, sqlite3_stmt *stmt, sqlite3_destructor_type d ) {
+	if ( lua_getfield( L, 1, "bindargs" ) != LUA_TTABLE ) {
+		lua_pop( L, 1 );
+		return;
 	}
 
-	#if 0
-	//Extract a type as well... 
-	if ( ( pos = lt_geti( t, "memory" ) ) > -1 ) {
-		char *type = lt_text_at( t, pos );
-		if ( !type ) {
-			return luaL_error( L, "type key was specified, but was not a string\n" );
+	for ( lua_pushnil( L ); lua_next( L, -2 ); lua_pop( L, 1 ) ) {
+		char key[ 128 ] = { 0 };
+		int i = 0, status = SQLITE_OK, type = lua_type( L, -1 );
+
+		if ( lua_type( L, -2 ) != LUA_TSTRING ) {
+			continue;
 		}
 
-		if ( strcmp( type, "true" ) == 0 ) {
-			//This is incredibly difficult to do with just memory...	
-		}	
-		else if ( strcmp( type, "false" ) == 0 ) {
+		snprintf( key, sizeof( key ), ":%s", lua_tostring( L, -2 ) );
+		if ( ( i = sqlite3_bind_parameter_index( stmt, key ) ) < 1 ) {
+			sqlite3_clear_bindings( stmt );
+			luaL_error( L, "SQL execution error: Could not locate bind parameter '%s'", key );
+			return;
 		}
+
+		if ( type == LUA_TSTRING ) {
+			size_t len = 0;
+			const char *v = lua_tolstring( L, -1, &len );
+			status = sqlite3_bind_text( stmt, i, v, len, d );
+		}
+		else if ( type == LUA_TNUMBER && lua_isinteger( L, -1 ) )
+			status = sqlite3_bind_int64( stmt, i, lua_tointeger( L, -1 ) );
+		else if ( type == LUA_TNUMBER )
+			status = sqlite3_bind_double( stmt, i, lua_tonumber( L, -1 ) );
+		else if ( type == LUA_TBOOLEAN )
+			status = sqlite3_bind_int( stmt, i, lua_toboolean( L, -1 ) );
 		else {
-			return luaL_error( L, "Got invalid value for 'type' key.\n" );
+			sqlite3_clear_bindings( stmt );
+			luaL_error( L, "Invalid type of bindarg at key '%s'", key );
+			return;
 		}
-		lt_dump( t );
-		exit( 0 );
-	}	 
-	#endif
-
-	//Finally, handle bind args if there are any
-	if ( ( pos = lt_geti( t, "bindargs" ) ) > -1 ) {
-		int zlen = 0;
-		ztable_t *tt = lt_copy_by_index( t, pos );
-		zKeyval *kv = NULL;
-
-		//TODO: This is way more complicated than it should be...
-		lt_lock( tt );
-		lt_reset( tt );
-		lt_next( tt );
-
-		//Loop through everything
-		for ( zdbv_t *tv = NULL; ( kv = lt_next( tt ) ) && kv->key.type != ZTABLE_TRM; ) {
-			char key[ 128 ] = { 0 };
-			//if the key is text, do something, if not do something
-			if ( !( tv = malloc( sizeof( zdbv_t ) ) ) ) {
-				lt_free( t ), lt_free( tt );
-				return luaL_error( L, "Allocation failure." );
-			}
-		
-			tv->field = NULL, tv->value = NULL;	
-			//if the key is text, do something, if not do something
-			if ( kv->key.type == ZTABLE_TXT ) {
-				snprintf( key, sizeof(key) - 1, ":%s", kv->key.v.vchar );	
-				tv->field = zhttp_dupstr( key );
-			}
-		#if 0
-			else if ( kv->key.type == ZTABLE_INT ) {
-				snprintf( key, sizeof(key) - 1, ":%d", kv->key.v.vint );
-				tv->field = zhttp_dupstr( key );
-			}
-		#endif
 
-			if ( kv->value.type == ZTABLE_TBL ) {
-				fprintf( stderr, "you are a table...\n" );	
-			}
+		if ( status != SQLITE_OK ) {
+			sqlite3_clear_bindings( stmt );
+			luaL_error( L, "Could not bind SQL parameter '%s'", key );
+			return;
+		}
+	}
 
-			if ( kv->value.type == ZTABLE_TXT ) {
-				if ( !kv->value.v.vchar ) {
-					tv->value = zhttp_dupstr( "" ); 
-					tv->len = 0;
-				}
-				else {
-					tv->value = zhttp_dupstr( kv->value.v.vchar ); 
-					tv->len = strlen( kv->value.v.vchar );
-				}
-			}
-			else if ( kv->value.type == ZTABLE_INT ) {
-				char buf[ 64 ] = { 0 };
-				int len = snprintf( buf, 63, "%d", kv->value.v.vint );
-				tv->value = zhttp_dupstr( buf );
-				tv->len = len;
-			}
-			else {
-				//This should result in failure
-				lt_free( t ), lt_free( tt );
-				return luaL_error( L, "Invalid type of bindarg at key '%s'", key ); 
-			}
-			add_item( &zdbbind, tv, zdbv_t *, &zlen );
+	lua_pop( L, 1 );
+}
+
+
+
+//Push the current row of stmt as a table, keyed by the n column names starting at names
+static void db_push_row ( lua_State *L, sqlite3_stmt *stmt, int names, int n, int upvalues ) {
+	lua_createtable( L, 0, n );
+	for ( int i = 0, type; i < n; i++ ) {
+		//NULL columns are left out, same as nil in any other table
+		if ( ( type = sqlite3_column_type( stmt, i ) ) == SQLITE_NULL ) {
+			continue;
 		}
 
-		lt_free( tt ), free( tt );
+		lua_pushvalue( L, ( upvalues ) ? lua_upvalueindex( names + i ) : names + i );
+		if ( type == SQLITE_INTEGER )
+			lua_pushinteger( L, sqlite3_column_int64( stmt, i ) );
+		else if ( type == SQLITE_FLOAT )
+			lua_pushnumber( L, sqlite3_column_double( stmt, i ) );
+		else {
+			//Text and blobs are copied straight out of SQLite's own buffers
+			const void *v = ( type == SQLITE_TEXT ) ? (const void *)sqlite3_column_text( stmt, i ) : sqlite3_column_blob( stmt, i );
+			int len = sqlite3_column_bytes( stmt, i );
+			lua_pushlstring( L, ( len ) ? (const char *)v : "", len );
+		}
+		lua_rawset( L, -3 );
 	}
+}
+
 
-	//Open or connect to database, run the query and close the connection 
-	if ( !zdb_open( &zdb, conn, ZDB_SQLITE ) ) { 
-		( len ) ? free( (void *)query ) : 0;
-		return luaL_error( L, "Connection error." );
-	}
 
-	if ( !zdb_exec( &zdb, query, zdbbind ) ) {
-		( len ) ? free( (void *)query ) : 0;
-		return luaL_error( L, "SQL execution error: %s", zdb.err );
+//Accepts three arguments { conn, [string, file], bindargs }
+int db_exec ( lua_State *L ) {
+	struct dbconn_t *c = NULL;
+	struct dbstmt_t *s = NULL;
+	sqlite3_stmt *stmt = NULL;
+	int n = 0, rows = 0, status = 0;
+
+	//Check for arguments...
+	luaL_checktype( L, 1, LUA_TTABLE );
+	lua_settop( L, 1 );
+
+	//The argument table stays put, so bound strings don't need to be copied
+	s = db_prepare( L, &c ), stmt = s->stmt;
+	db_bind( L, stmt, SQLITE_STATIC );
+	lua_settop( L, 1 );
+
+	//Column names are made once and shared by every row
+	if ( ( n = sqlite3_column_count( stmt ) ) > ZDB_MAX_COLUMNS || !lua_checkstack( L, n + 4 ) ) {
+		sqlite3_clear_bindings( stmt );
+		return luaL_error( L, "RESULT SET COLUMN COUNT TOO LARGE ( >%d )", ZDB_MAX_COLUMNS );
 	}
 
-	//TODO: freeing query in this manner may cause issues when using a string as the argument
-	if ( len ) {
-		free( (void *)query );
+	lua_createtable( L, 0, 4 );
+	for ( int i = 0; i < n; i++ ) {
+		lua_pushstring( L, sqlite3_column_name( stmt, i ) );
 	}
 
-	if ( !( results = zdb_to_ztable( &zdb, "results" ) ) ) {
-		( len ) ? free( (void *)query ) : 0;
-		return luaL_error( L, "conversion error: %s", zdb.err );
+	lua_newtable( L );
+	while ( ( status = sqlite3_step( stmt ) ) == SQLITE_ROW ) {
+		db_push_row( L, stmt, 3, n, 0 );
+		lua_rawseti( L, -2, ++rows );
 	}
 
-	//It's infinitely easier to write this first...
-	if ( !ztable_to_lua( L, results ) ) {
-		zdb_close( &zdb ), lt_free( results ), free( results ), lt_free( t );
-		return luaL_error( L, "ztable to Lua failed...\n" );
+	if ( status != SQLITE_DONE ) {
+		lua_pushfstring( L, "SQL execution error: %s", sqlite3_errmsg( c->db ) );
+		sqlite3_reset( stmt ), sqlite3_clear_bindings( stmt );
+		return lua_error( L );
 	}
 
-	//Add a status code
-	lua_pushstring( L, "status" );
+	sqlite3_reset( stmt ), sqlite3_clear_bindings( stmt );
+	lua_setfield( L, 2, "results" );
+	lua_settop( L, 2 );
+
+	//Add a status code, a count of rows received and a count of rows affected (if any)
 	lua_pushboolean( L, 1 );
-	lua_settable( L, 1 );
-
-	//Add a count of rows received (if any)
-	lua_pushstring( L, "count" );
-	lua_pushnumber( L, zdb.rows );
-	lua_settable( L, 1 );
-
-	//Add a count of rows affected (if any)
-	lua_pushstring( L, "affected" );
-	lua_pushnumber( L, zdb.affected );
-	lua_settable( L, 1 );
-
-	//Close the connection and whatnot (seems like a lot...)
-	//zdb_dump( &zdb );	
-	zdbv_free( zdbbind );
-	zdb_free( &zdb );	
-	zdb_close( &zdb );	
-	lt_free( results );
-	free( results );
-	lt_free( t );
+	lua_setfield( L, 2, "status" );
+	lua_pushinteger( L, rows );
+	lua_setfield( L, 2, "count" );
+	lua_pushinteger( L, sqlite3_changes( c->db ) );
+	lua_setfield( L, 2, "affected" );
 	return 1;
 }
 
+
+
+//Hand an iterator's statement and handle back to the pool
+static void db_rows_release ( struct dbrows_t *r ) {
+	if ( r->slot ) {
+		sqlite3_reset( r->slot->stmt ), sqlite3_clear_bindings( r->slot->stmt );
+		r->slot->inuse = 0, r->slot = NULL;
+	}
+	if ( r->conn ) {
+		r->conn->refs--, r->conn = NULL;
+	}
+}
+
+
+
+//Release an iterator and forget about it
+static int db_rows_close ( lua_State *L ) {
+	struct dbrows_t *r = luaL_checkudata( L, 1, DB_ROWS_META );
+	db_rows_release( r );
+	if ( lua_getfield( L, LUA_REGISTRYINDEX, DB_ROWS_OPEN ) == LUA_TTABLE ) {
+		lua_pushvalue( L, 1 ), lua_pushnil( L ), lua_rawset( L, -3 );
+	}
+	lua_pop( L, 1 );
+	return 0;
+}
+
+
+
+//Step an iterator's statement, returning nil (and letting go) once it's done
+static int db_rows_next ( lua_State *L ) {
+	struct dbrows_t *r = lua_touserdata( L, lua_upvalueindex( 1 ) );
+	int status = 0;
+
+	if ( !r->slot ) {
+		return 0;
+	}
+
+	if ( ( status = sqlite3_step( r->slot->stmt ) ) == SQLITE_ROW ) {
+		db_push_row( L, r->slot->stmt, 2, r->columns, 1 );
+		return 1;
+	}
+
+	if ( status != SQLITE_DONE ) {
+		lua_pushfstring( L, "SQL execution error: %s", sqlite3_errmsg( r->conn->db ) );
+	}
+
+	lua_pushcfunction( L, db_rows_close );
+	lua_pushvalue( L, lua_upvalueindex( 1 ) );
+	lua_call( L, 1, 0 );
+	return ( status != SQLITE_DONE ) ? lua_error( L ) : 0;
+}
+
+
+
+//Accepts the same arguments as db.exec, but returns rows one at a time
+int db_rows ( lua_State *L ) {
+	struct dbrows_t *r = NULL;
+	struct dbconn_t *c = NULL;
+	struct dbstmt_t *s = NULL;
+	int n = 0;
+
+	luaL_checktype( L, 1, LUA_TTABLE );
+	lua_settop( L, 1 );
+
+	//The iterator exists before anything is checked out, so errors clean up too
+	r = lua_newuserdatauv( L, sizeof( struct dbrows_t ), 0 );
+	memset( r, 0, sizeof( struct dbrows_t ) );
+	if ( luaL_newmetatable( L, DB_ROWS_META ) ) {
+		lua_pushcfunction( L, db_rows_close );
+		lua_setfield( L, -2, "__close" );
+		lua_pushcfunction( L, db_rows_close );
+		lua_setfield( L, -2, "__gc" );
+	}
+	lua_setmetatable( L, 2 );
+
+	//Keep track of open iterators, so they can all be let go when a request ends
+	if ( lua_getfield( L, LUA_REGISTRYINDEX, DB_ROWS_OPEN ) != LUA_TTABLE ) {
+		lua_pop( L, 1 ), lua_newtable( L );
+		lua_pushvalue( L, -1 ), lua_setfield( L, LUA_REGISTRYINDEX, DB_ROWS_OPEN );
+	}
+	lua_pushvalue( L, 2 ), lua_pushboolean( L, 1 ), lua_rawset( L, -3 );
+	lua_settop( L, 2 );
+
+	s = db_prepare( L, &c );
+	r->conn = c, r->slot = s, c->refs++, s->inuse = 1;
+
+	//The loop can outlive the argument table, so bound strings are copied
+	db_bind( L, s->stmt, SQLITE_TRANSIENT );
+	lua_settop( L, 2 );
+
+	if ( ( n = sqlite3_column_count( s->stmt ) ) > ZDB_MAX_COLUMNS || !lua_checkstack( L, n + 4 ) ) {
+		return luaL_error( L, "RESULT SET COLUMN COUNT TOO LARGE ( >%d )", ZDB_MAX_COLUMNS );
+	}
+
+	//The iterator carries the column names as upvalues
+	r->columns = n;
+	lua_pushvalue( L, 2 );
+	for ( int i = 0; i < n; i++ ) {
+		lua_pushstring( L, sqlite3_column_name( s->stmt, i ) );
+	}
+	lua_pushcclosure( L, db_rows_next, n + 1 );
+
+	//Returning the iterator as a closing value lets a generic for clean up on break
+	lua_pushnil( L ), lua_pushnil( L ), lua_pushvalue( L, 2 );
+	return 4;
+}
+
+
+
+//Let go of any iterators a request left open, and of the handles it used
+void db_release ( lua_State *L ) {
+	if ( lua_getfield( L, LUA_REGISTRYINDEX, DB_ROWS_OPEN ) == LUA_TTABLE ) {
+		for ( lua_pushnil( L ); lua_next( L, -2 ); lua_pop( L, 1 ) ) {
+			db_rows_release( lua_touserdata( L, -2 ) );
+		}
+		lua_pushnil( L );
+		lua_setfield( L, LUA_REGISTRYINDEX, DB_ROWS_OPEN );
+	}
+	lua_pop( L, 1 );
+	db_pool_done();
+}
+
 #if 0
 //Checks for the existence of a table
 int db_check ( lua_State *L ) {
@@ -278,6 +618,7 @@ int db_check ( lua_State *L ) {
 
 struct luaL_Reg db_set[] = {
  	{ "exec", db_exec }
+,	{ "rows", db_rows }
 #if 0
 ,	{ "check", db_check }
 #endif
@@ -19,6 +19,7 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#include <pthread.h>
 #include <zdb.h>
 #include <zhttp.h>
 #include <ztable.h>
@@ -28,8 +29,55 @@
 #ifndef LDB_H
 #define LDB_H
 
+#define DB_ROWS_META "hypno.db.rows"
+
+#define DB_ROWS_OPEN "hypno.db.open"
+
+//A statement kept ready for the next time its SQL comes around
+struct dbstmt_t {
+	sqlite3_stmt *stmt;
+	char *sql;
+	int len;
+	unsigned int hash;
+	int inuse;
+	unsigned long used;
+};
+
+//An open database handle kept by the process between requests
+struct dbconn_t {
+	sqlite3 *db;
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	int refs;
+	int held;
+	int spare;
+	pthread_t owner;
+	unsigned long used;
+	unsigned long clock;
+	struct dbstmt_t stmts[ DB_STMT_CACHE_SIZE ];
+	struct dbconn_t *next;
+};
+
+//A db.rows loop in progress
+struct dbrows_t {
+	struct dbconn_t *conn;
+	struct dbstmt_t *slot;
+	int columns;
+};
+
+struct dbconn_t * db_pool_open ( const char *, char *, int );
+
+struct dbstmt_t * db_pool_prepare ( struct dbconn_t *, const char *, char *, int );
+
+void db_pool_done ( void );
+
+void db_release ( lua_State * );
+
 int db_exec ( lua_State * );
 
+int db_rows ( lua_State * );
+
 extern struct luaL_Reg db_set[];
 
 #ifdef ZTABLE_H
@@ -26,6 +26,7 @@
 #include "enc.h"
 #include "dec.h"
 #include "session.h"
+#include "cache.h"
 #ifndef DISABLE_TLS
  #include "hash.h"
 #endif
@@ -39,9 +40,8 @@ struct lua_fset functions[] = {
 , { "json", json_set }
 , { "enc", enc_set }
 , { "dec", dec_set }
-#if 0
 , { "session", session_set }
-#endif
+, { "cache", cache_set }
 #ifndef DISABLE_TLS
 , { "hash", hash_set }
 #endif
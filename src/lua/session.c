@@ -1,23 +1,53 @@
-/* -------------------------------------------- * 
+/* -------------------------------------------- *
 session
 =======
 
 Session primitives.
- 
+
 Usage
 -----
-Session...
+Sessions are kept in memory and saved to SESSION_DB_PATH in the
+background, so checking one costs about as much as a table lookup.
+
+With --workers, each worker keeps its own table in front of
+SESSION_DB_PATH.  New sessions are written out as soon as they start,
+and a worker reads a session from disk when it hasn't seen it, or when
+its copy is older than SESSION_FLUSH_INTERVAL, so a change made by one
+worker reaches the others within about two intervals.
+
+Every function besides start takes an optional session ID as its last
+argument.  Without one, the ID is read from the request's cookie (named
+by the global `sid`, or "sid" if there isn't one).
 
 ### start ###
 
+session.start{ token = "user", expiry = 3600, path = "/" }
+
+Creates a session tied to token, sets its cookie on the response and
+returns the new ID.  Sessions without an expiry last SESSION_EXPIRY
+seconds, but their cookie goes away with the browser.
+
 ### check ###
 
+session.check() returns the token a session was started with, or nil
+if there is no live session.
+
 ### stop ###
 
+session.stop() ends a session and expires its cookie.
+
 ### set ###
 
+session.set( key, value ) saves a string, number or boolean.
+
 ### get ###
 
+session.get( key ) returns a value saved with set, or nil.
+
+### unset ###
+
+session.unset( key ) removes a value.
+
 
 LICENSE
 -------
@@ -28,308 +58,1052 @@ See LICENSE for licensing information.
  * -------------------------------------------- */
 #include "session.h"
 
-static const char sdbpath[] = 
+static const char sdbpath[] =
 	SESSION_DB_PATH;
 
-static const char check_for_session_table[] = 
-	"SELECT name FROM sqlite_master WHERE type='table' AND name='session'";
-
-static const char create_session_table[] = 
-"CREATE TABLE session ("
-"		id INTEGER PRIMARY KEY AUTOINCREMENT"
-",	sid TEXT"
+static const char create_session_table[] =
+"CREATE TABLE IF NOT EXISTS session ("
+"		sid TEXT PRIMARY KEY"
+",	site INTEGER"
 ",	matchid TEXT"
 ",	sstart INTEGER"
 ",	send INTEGER	)"
 ;
 
-static const char create_session_values_table[] = 
-"CREATE TABLE session_values ("
-"		id INTEGER PRIMARY KEY AUTOINCREMENT"
-",	sid INTEGER"
+static const char create_session_values_table[] =
+"CREATE TABLE IF NOT EXISTS session_values ("
+"		sid TEXT"
 ",	key TEXT"
-",	value TEXT )"
+",	type INTEGER"
+",	value BLOB"
+",	PRIMARY KEY ( sid, key ) )"
 ;
 
-const char insert_session_values[] = 
-"INSERT INTO session"
-"		(id, sid, matchid, sstart, send)" 
+static const char delete_expired_sessions[] =
+"DELETE FROM session WHERE send <= ?1"
+;
+
+static const char delete_orphaned_values[] =
+"DELETE FROM session_values WHERE sid NOT IN ( SELECT sid FROM session )"
+;
+
+static const char select_sessions[] =
+"SELECT sid, site, matchid, sstart, send FROM session"
+;
+
+static const char select_session_values[] =
+"SELECT sid, key, type, value FROM session_values"
+;
+
+static const char select_session[] =
+"SELECT site, matchid, sstart, send FROM session WHERE sid = ?1"
+;
+
+static const char select_values_of_session[] =
+"SELECT key, type, value FROM session_values WHERE sid = ?1"
+;
+
+static const char insert_session_values[] =
+"INSERT OR REPLACE INTO session"
+"		(sid, site, matchid, sstart, send)"
+"VALUES"
+"		(?1, ?2, ?3, ?4, ?5)"
+;
+
+static const char insert_session_value[] =
+"INSERT INTO session_values"
+"		(sid, key, type, value)"
 "VALUES"
-"		(NULL, :sid, :mid, :start, :end)"
+"		(?1, ?2, ?3, ?4)"
 ;
 
+static const char delete_session[] =
+"DELETE FROM session WHERE sid = ?1"
+;
 
-int init( const char *f ) {
-	//Open the in-memory connection if there is one
-	//Create the session table
-	//Create the session values table
-	return 0;
+static const char delete_session_values[] =
+"DELETE FROM session_values WHERE sid = ?1"
+;
+
+static const char b64url[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	"abcdefghijklmnopqrstuvwxyz"
+	"0123456789-_"
+;
+
+//How values are tagged, in memory and on disk
+enum {
+	SESSION_STRING = 1
+,	SESSION_INTEGER
+,	SESSION_FLOAT
+,	SESSION_BOOLEAN
+};
+
+//A slice of the session table with its own lock
+struct sessshard_t {
+	pthread_mutex_t lock;
+	struct sess_t **buckets;
+	unsigned int mask;
+	unsigned int count;
+	time_t tick;
+	struct sess_t *dirty;
+	struct sess_t *gone;
+	struct sess_t *wheel[ SESSION_WHEEL_SLOTS ];
+};
+
+static struct sessshard_t shards[ SESSION_SHARDS ];
+
+static pthread_once_t session_once = PTHREAD_ONCE_INIT;
+
+static int session_persist = 0;
+
+int session_shared = 0;
+
+
+
+//Hash a session ID
+static unsigned int sess_hash ( const char *id ) {
+	unsigned int h = 2166136261u;
+	for ( ; *id; id++ ) {
+		h = ( h ^ (unsigned char)*id ) * 16777619u;
+	}
+	return h;
+}
+
+
+
+//Sessions are spread out over the shards by hash
+static struct sessshard_t * sess_shard ( unsigned int hash ) {
+	return &shards[ hash % SESSION_SHARDS ];
+}
+
+
+
+static struct sess_t ** sess_bucket ( struct sessshard_t *s, unsigned int hash ) {
+	return &s->buckets[ ( hash / SESSION_SHARDS ) & s->mask ];
+}
+
+
+
+//Free a session and everything saved with it
+static void sess_free ( struct sess_t *e ) {
+	for ( struct sessval_t *v = e->values, *n = NULL; v; v = n ) {
+		n = v->next;
+		free( v );
+	}
+	free( e->match );
+	free( e );
+}
+
+
+
+//Queue a session to be written on the next flush
+static void sess_touch ( struct sessshard_t *s, struct sess_t *e ) {
+	if ( !e->dirty ) {
+		e->dirty = 1, e->dprev = NULL, e->dnext = s->dirty;
+		( s->dirty ) ? s->dirty->dprev = e : 0;
+		s->dirty = e;
+	}
+}
+
+
+
+//Add a session to the wheel slot for the second it expires
+static void sess_wheel_add ( struct sessshard_t *s, struct sess_t *e ) {
+	struct sess_t **slot = &s->wheel[ e->expires % SESSION_WHEEL_SLOTS ];
+	e->wprev = NULL, e->wnext = *slot;
+	( *slot ) ? (*slot)->wprev = e : 0;
+	*slot = e;
+}
+
+
+
+//Take a session out of its shard
+static void sess_unlink ( struct sessshard_t *s, struct sess_t *e ) {
+	struct sess_t **b = sess_bucket( s, e->hash );
+	for ( ; *b && *b != e; b = &(*b)->next ) ;
+	( *b ) ? *b = e->next : 0;
+
+	( e->wprev ) ? e->wprev->wnext = e->wnext : ( s->wheel[ e->expires % SESSION_WHEEL_SLOTS ] = e->wnext );
+	( e->wnext ) ? e->wnext->wprev = e->wprev : 0;
+
+	if ( e->dirty ) {
+		( e->dprev ) ? e->dprev->dnext = e->dnext : ( s->dirty = e->dnext );
+		( e->dnext ) ? e->dnext->dprev = e->dprev : 0;
+	}
+
+	s->count--;
+}
+
+
+
+//Take a session out of its shard, leaving it to the next flush to delete from disk
+static void sess_remove ( struct sessshard_t *s, struct sess_t *e ) {
+	sess_unlink( s, e );
+	e->next = s->gone, s->gone = e;
+}
+
+
+
+//Expire everything on the wheel between the last tick and now
+static void sess_advance ( struct sessshard_t *s, time_t now ) {
+	time_t t = ( now - s->tick >= SESSION_WHEEL_SLOTS ) ? now - SESSION_WHEEL_SLOTS + 1 : s->tick + 1;
+
+	//Slots hold every session expiring on the same second of any turn of the wheel
+	for ( ; s->tick && t <= now; t++ ) {
+		for ( struct sess_t *e = s->wheel[ t % SESSION_WHEEL_SLOTS ], *n = NULL; e; e = n ) {
+			n = e->wnext;
+			( e->expires <= now ) ? sess_remove( s, e ) : 0;
+		}
+	}
+
+	s->tick = now;
+}
+
+
+
+//Double a shard's buckets once it holds more sessions than it has buckets
+static int sess_grow ( struct sessshard_t *s ) {
+	unsigned int size = ( s->mask + 1 ) * 2;
+	struct sess_t **buckets = NULL, **old = s->buckets;
+
+	if ( !( buckets = malloc( sizeof( struct sess_t * ) * size ) ) ) {
+		return 0;
+	}
+
+	memset( buckets, 0, sizeof( struct sess_t * ) * size );
+	s->buckets = buckets, s->mask = size - 1;
+	for ( unsigned int i = 0; i < size / 2; i++ ) {
+		for ( struct sess_t *e = old[ i ], *n = NULL; e; e = n ) {
+			struct sess_t **b = sess_bucket( s, e->hash );
+			n = e->next, e->next = *b, *b = e;
+		}
+	}
+
+	free( old );
+	return 1;
 }
 
 
-int check ( lua_State *L ) {
-	//Check the scope for a key (can be configured)
-	//
+
+//Add a new session to its shard (which must be locked)
+static int sess_insert ( struct sessshard_t *s, struct sess_t *e ) {
+	struct sess_t **b = NULL;
+	if ( s->count >= s->mask + 1 && !sess_grow( s ) ) {
+		return 0;
+	}
+
+	b = sess_bucket( s, e->hash );
+	e->next = *b, *b = e;
+	sess_wheel_add( s, e );
+	s->count++;
+	return 1;
+}
+
+
+
+//Find a live session in its shard (which must be locked)
+static struct sess_t * sess_find ( struct sessshard_t *s, const char *id, unsigned int hash, unsigned int site, time_t now ) {
+	sess_advance( s, now );
+	for ( struct sess_t *e = *sess_bucket( s, hash ); e; e = e->next ) {
+		if ( e->hash == hash && e->site == site && !strcmp( e->id, id ) ) {
+			return ( e->expires > now ) ? e : NULL;
+		}
+	}
+	return NULL;
+}
+
+
+
+//Check if a session was ended here, but hasn't been deleted from disk yet
+static int sess_gone ( struct sessshard_t *s, const char *id ) {
+	for ( struct sess_t *e = s->gone; e; e = e->next ) {
+		if ( !strcmp( e->id, id ) ) {
+			return 1;
+		}
+	}
 	return 0;
 }
 
 
-int start ( lua_State *L ) {
-	zTable tt, *t, *results;
-	zdb_t zdb = { 0 }; 
-	int zdb_arglen = 0, pos = -1;
-	zdbv_t **zdbbind = NULL;
-	char *token = NULL;
-	char *path = NULL;
-	char err[ 1024 ] = { 0 };
-	char conn[ PATH_MAX ] = {0}; 
-	char randid[32] = {0};
-	char start[ 128 ] = {0}, end[ 128 ] = {0};
-	int expiry = 0; // Hardcoded for 5 min for now...
-	struct timespec tm = { 0 };
-	const unsigned char word[] = 
-		"ABCDEFGHIJKLMNOPQRSTUVWXYZ" 
-		"abcdefghijklmnopqrstuvwxyz"
-		"0123456789"
-	;
-
-	//Initialize a table for arguments
-	luaL_checktype( L, 1, LUA_TTABLE );
-	t = &tt;
-	lt_init( t, NULL, 32 ); 
 
-	//Convert to C table for slightly easier key extraction	
-	if ( !lua_to_ztable( L, 1, t ) || !lt_lock( t ) ) {
-		lt_free( t );
-		return luaL_error( L, "Failed to convert to zTable" );
+//Make an empty session
+static struct sess_t * sess_make ( const char *id, unsigned int site, const char *match, time_t start, time_t expires ) {
+	struct sess_t *e = NULL;
+	if ( !( e = malloc( sizeof( struct sess_t ) ) ) ) {
+		return NULL;
+	}
+
+	memset( e, 0, sizeof( struct sess_t ) );
+	if ( !( e->match = strdup( match ) ) ) {
+		free( e );
+		return NULL;
 	}
 
-	//Get rid of the table on the stack
-	lua_pop( L, 1 ); 
+	snprintf( e->id, sizeof( e->id ), "%s", id );
+	e->hash = sess_hash( e->id ), e->site = site;
+	e->start = start, e->expires = expires, e->synced = time( NULL );
+	return e;
+}
+
 
-	//Check for expiry and token
-	if ( ( pos = lt_geti( t, "expiry" ) ) > -1 ) {
-		expiry = lt_int_at( t, pos );
+
+//Replace (or add) a value in a session
+static int sess_put ( struct sess_t *e, const char *key, int klen, int type, const void *value, int vlen ) {
+	struct sessval_t *v = NULL, **p = &e->values;
+	if ( !( v = malloc( sizeof( struct sessval_t ) + klen + vlen ) ) ) {
+		return 0;
 	}
 
-	//Check for a path variable
-	if ( ( pos = lt_geti( t, "path" ) ) > -1 ) {
-		path = lt_text_at( t, pos );
+	v->type = type, v->klen = klen, v->vlen = vlen;
+	memcpy( v->data, key, klen );
+	memcpy( v->data + klen, value, vlen );
+
+	for ( ; *p; p = &(*p)->next ) {
+		if ( (*p)->klen == klen && !memcmp( (*p)->data, key, klen ) ) {
+			struct sessval_t *old = *p;
+			v->next = old->next, *p = v;
+			free( old );
+			return 1;
+		}
 	}
 
-	if ( ( pos = lt_geti( t, "token" ) ) > -1 )
-		token = lt_text_at( t, pos );
-	else {
-		lt_free( t );
-		return luaL_error( L, "session - no token specified." );
+	v->next = NULL, *p = v;
+	return 1;
+}
+
+
+
+//Copy a session, so it can be written out without holding its shard's lock
+static struct sess_t * sess_copy ( struct sess_t *e ) {
+	struct sess_t *c = NULL;
+	struct sessval_t **p = NULL;
+
+	if ( !( c = sess_make( e->id, e->site, e->match, e->start, e->expires ) ) ) {
+		return NULL;
 	}
 
-	//Get the sid name (if the user has specified one)
-	lua_getglobal( L, "sid" ); 
-	const char *sid = ( lua_isnil( L, -1 ) ) ? "sid" : lua_tostring( L, -1 );
-	lua_pop( L, 1 ); 
+	p = &c->values;
+	for ( struct sessval_t *v = e->values; v; v = v->next, p = &(*p)->next ) {
+		int size = sizeof( struct sessval_t ) + v->klen + v->vlen;
+		if ( !( *p = malloc( size ) ) ) {
+			sess_free( c );
+			return NULL;
+		}
+		memcpy( *p, v, size ), (*p)->next = NULL;
+	}
 
-	//Get the shadow path if there is one & create a database connection string
-	lua_getglobal( L, "shadow" ); 
-	if ( lua_isnil( L, -1 ) )
-		lua_pop( L, 1 ); 
-	else {
-		//Translate the connection to the right path
-		char shadow[ 2048 ] = {0};
-		snprintf( shadow, sizeof( shadow ), "%s", lua_tostring( L, -1 ) );
-		snprintf( conn, sizeof( conn ), "%s/db/%s", shadow, ".session.db" );
-		lua_pop( L, 1 );
+	return c;
+}
+
+
+
+//Make a new session ID from the kernel's CSPRNG
+static int sess_id ( char *id ) {
+	unsigned char b[ SESSION_ID_BYTES ] = { 0 };
+	for ( int n = 0, r = 0; n < sizeof( b ); n += r ) {
+		if ( ( r = getrandom( b + n, sizeof( b ) - n, 0 ) ) == -1 ) {
+			if ( errno != EINTR ) {
+				return 0;
+			}
+			r = 0;
+		}
 	}
 
-	//Generate an unique ID
-	if ( clock_gettime( CLOCK_REALTIME, &tm ) == -1 ) {
-		return luaL_error( L, "Get time failure." );
+	//Every 3 bytes become 4 URL and cookie safe characters
+	for ( int i = 0, j = 0; i < sizeof( b ); i += 3 ) {
+		unsigned int v = ( b[ i ] << 16 ) | ( b[ i + 1 ] << 8 ) | b[ i + 2 ];
+		id[ j++ ] = b64url[ ( v >> 18 ) & 63 ];
+		id[ j++ ] = b64url[ ( v >> 12 ) & 63 ];
+		id[ j++ ] = b64url[ ( v >> 6 ) & 63 ];
+		id[ j++ ] = b64url[ v & 63 ];
 	}
 
-	srand( tm.tv_nsec );
-	for ( int i = 0; i < sizeof( randid ) - 1; i++ ) {
-		randid[ i ] = word[ rand() % ( sizeof( word ) - 1 ) ]; 
+	id[ SESSION_ID_LEN ] = '\0';
+	return 1;
+}
+
+
+
+//Bring back whatever sessions were saved before the last shutdown
+static int session_load ( char *err, int errlen ) {
+	struct dbconn_t *c = NULL;
+	struct dbstmt_t *s = NULL;
+	time_t now = time( NULL );
+
+	if ( !( c = db_pool_open( sdbpath, err, errlen ) ) ) {
+		return 0;
 	}
 
-	//Open a database handle
-	if ( !zdb_open( &zdb, conn, ZDB_SQLITE ) ) { 
-		return luaL_error( L, "Connection error." );
+	if ( sqlite3_exec( c->db, create_session_table, NULL, NULL, NULL ) != SQLITE_OK ||
+		sqlite3_exec( c->db, create_session_values_table, NULL, NULL, NULL ) != SQLITE_OK ) {
+		snprintf( err, errlen, "%s", sqlite3_errmsg( c->db ) );
+		return 0;
 	}
 
-	//Check if the session table exists.
-	if ( !zdb_exec( &zdb, check_for_session_table, NULL ) ) {
-		return luaL_error( L, "SQL session table check failed - error: %s", zdb.err );
+	//Anything that expired while the server was down can go
+	if ( !( s = db_pool_prepare( c, delete_expired_sessions, err, errlen ) ) ) {
+		return 0;
 	}
+	sqlite3_bind_int64( s->stmt, 1, now );
+	sqlite3_step( s->stmt ), sqlite3_reset( s->stmt );
+	sqlite3_exec( c->db, delete_orphaned_values, NULL, NULL, NULL );
 
-	//Create one if it doesn't
-	if ( zdb.rows == 0 ) {
-		if ( !zdb_exec( &zdb, create_session_table, NULL ) ) {
-			return luaL_error( L, "Session table creation failed - error: %s", zdb.err );
+	if ( !( s = db_pool_prepare( c, select_sessions, err, errlen ) ) ) {
+		return 0;
+	}
+
+	while ( sqlite3_step( s->stmt ) == SQLITE_ROW ) {
+		const char *id = (const char *)sqlite3_column_text( s->stmt, 0 );
+		const char *match = (const char *)sqlite3_column_text( s->stmt, 2 );
+		struct sess_t *e = NULL;
+
+		if ( !id || strlen( id ) != SESSION_ID_LEN ) {
+			continue;
 		}
 
-		if ( !zdb_exec( &zdb, create_session_values_table, NULL ) ) {
-			return luaL_error( L, "Session values table creation failed - error: %s", zdb.err );
+		e = sess_make( id, sqlite3_column_int64( s->stmt, 1 ), ( match ) ? match : "",
+			sqlite3_column_int64( s->stmt, 3 ), sqlite3_column_int64( s->stmt, 4 ) );
+		if ( !e || !sess_insert( sess_shard( e->hash ), e ) ) {
+			( e ) ? sess_free( e ) : 0;
+			break;
 		}
 	}
+	sqlite3_reset( s->stmt );
 
-	//Generate start and end dates
-	if ( clock_gettime( CLOCK_REALTIME, &tm ) == -1 ) {
-		return luaL_error( L, "Get time failure." );
+	if ( !( s = db_pool_prepare( c, select_session_values, err, errlen ) ) ) {
+		return 0;
 	}
 
-	//Add a new ID
-	zdbv_t * sid_v = malloc( sizeof( zdbv_t ) );
-	memset( sid_v, 0, sizeof( zdbv_t ) );
-	sid_v->field = zhttp_dupstr( ":sid" );
-	sid_v->value = zhttp_dupstr( randid );
-	sid_v->len = strlen( randid );
-	add_item( &zdbbind, sid_v, zdbv_t *, &zdb_arglen );
+	while ( sqlite3_step( s->stmt ) == SQLITE_ROW ) {
+		const char *id = (const char *)sqlite3_column_text( s->stmt, 0 );
+		unsigned int hash = ( id ) ? sess_hash( id ) : 0;
+		struct sessshard_t *sh = sess_shard( hash );
 
-	//Bind the start date
-	zdbv_t * sv = malloc( sizeof( zdbv_t ) );
-	memset( sv, 0, sizeof( zdbv_t ) );
-	snprintf( start, sizeof( start ), "%ld", tm.tv_sec );
-	sv->field = zhttp_dupstr( ":start" );
-	sv->value = zhttp_dupstr( start );
-	sv->len = strlen( start );
-	add_item( &zdbbind, sv, zdbv_t *, &zdb_arglen );
+		for ( struct sess_t *e = ( id ) ? *sess_bucket( sh, hash ) : NULL; e; e = e->next ) {
+			if ( e->hash == hash && !strcmp( e->id, id ) ) {
+				sess_put( e, (const char *)sqlite3_column_text( s->stmt, 1 ), sqlite3_column_bytes( s->stmt, 1 ),
+					sqlite3_column_int( s->stmt, 2 ), sqlite3_column_blob( s->stmt, 3 ), sqlite3_column_bytes( s->stmt, 3 ) );
+				break;
+			}
+		}
+	}
+	sqlite3_reset( s->stmt );
+	return 1;
+}
 
-	//Bind the end date
-	zdbv_t * ev = malloc( sizeof( zdbv_t ) );
-	memset( ev, 0, sizeof( zdbv_t ) );
-	snprintf( end, sizeof( end ), "%ld", tm.tv_sec + expiry );
-	ev->field = zhttp_dupstr( ":end" ); 
-	ev->value = zhttp_dupstr( end );  
-	ev->len = strlen( end );
-	add_item( &zdbbind, ev, zdbv_t *, &zdb_arglen );
 
-	//Bind the match ID (typically a username, but anything 
-	//to associate the session value with something) 
-	zdbv_t * id_v = malloc( sizeof( zdbv_t ) );
-	memset( id_v, 0, sizeof( zdbv_t ) );
-	id_v->field = zhttp_dupstr( ":mid" );
-	id_v->value = zhttp_dupstr( (char *)token );
-	id_v->len = strlen( token );
-	add_item( &zdbbind, id_v, zdbv_t *, &zdb_arglen );
 
-	//Add them to the table
-	if ( !zdb_exec( &zdb, insert_session_values, zdbbind ) ) {
-		return luaL_error( L, "Session value creation failed - error: %s", zdb.err );
+//Run a cached statement with a session ID as its only argument
+static int session_exec_id ( struct dbconn_t *c, const char *sql, const char *id, char *err, int errlen ) {
+	struct dbstmt_t *s = NULL;
+	int status = 0;
+	if ( !( s = db_pool_prepare( c, sql, err, errlen ) ) ) {
+		return 0;
 	}
+	sqlite3_bind_text( s->stmt, 1, id, -1, SQLITE_STATIC );
+	status = sqlite3_step( s->stmt );
+	sqlite3_reset( s->stmt ), sqlite3_clear_bindings( s->stmt );
+	return ( status == SQLITE_DONE );
+}
+
 
-	//Always make a token string
-	char sidvalue[2048] = {0}, *sidv = sidvalue;
-	int svlen = sizeof( sidvalue );
-	svlen -= snprintf( sidv, svlen, "%s=%s;", sid, randid );
 
-	if ( expiry ) {
-		svlen -= snprintf( &sidv[ svlen ], svlen, "max-age=%d;", expiry );
+//Write one session and its values
+static int session_write ( struct dbconn_t *c, struct sess_t *e, char *err, int errlen ) {
+	struct dbstmt_t *s = NULL;
+	int status = 0;
+
+	if ( !( s = db_pool_prepare( c, insert_session_values, err, errlen ) ) ) {
+		return 0;
 	}
 
-	if ( path ) {
-		svlen -= snprintf( &sidv[ svlen ], svlen, "path=%s;", path );
+	sqlite3_bind_text( s->stmt, 1, e->id, -1, SQLITE_STATIC );
+	sqlite3_bind_int64( s->stmt, 2, e->site );
+	sqlite3_bind_text( s->stmt, 3, e->match, -1, SQLITE_STATIC );
+	sqlite3_bind_int64( s->stmt, 4, e->start );
+	sqlite3_bind_int64( s->stmt, 5, e->expires );
+	status = sqlite3_step( s->stmt );
+	sqlite3_reset( s->stmt ), sqlite3_clear_bindings( s->stmt );
+
+	if ( status != SQLITE_DONE || !session_exec_id( c, delete_session_values, e->id, err, errlen ) ) {
+		return 0;
 	}
 
-	//Use set cookie to send a session identifier (name can be changed from config)
-	lua_getglobal( L, "response" ); 
-	if ( lua_isnil( L, -1 ) ) {
-		lua_pop( L, 1 ); 
-		lua_newtable( L );
-		lua_setstrbool( L, "delay", 1, 1 );
-		lua_pushstring( L, "headers" ), lua_newtable( L );
-		lua_setstrstr( L, "Set-Cookie", sidv, 3 );
-		lua_settable( L, 1 );
-		lua_setglobal( L, "response" );
+	if ( e->values && !( s = db_pool_prepare( c, insert_session_value, err, errlen ) ) ) {
+		return 0;
 	}
-	else {
-		//Converting with Lua takes more memory, but is so much easier to do
-		zTable tx, *ttx;
-		ttx = &tx;
-		lt_init( ttx, NULL, 32 ); 
-
-		if ( !lua_to_ztable( L, 1, ttx ) || !lt_lock( ttx ) ) {
-			lt_free( ttx );
-			return luaL_error( L, "Failed to convert to zTable" );
+
+	for ( struct sessval_t *v = e->values; v; v = v->next ) {
+		sqlite3_bind_text( s->stmt, 1, e->id, -1, SQLITE_STATIC );
+		sqlite3_bind_text( s->stmt, 2, v->data, v->klen, SQLITE_STATIC );
+		sqlite3_bind_int( s->stmt, 3, v->type );
+		sqlite3_bind_blob( s->stmt, 4, v->data + v->klen, v->vlen, SQLITE_STATIC );
+		status = sqlite3_step( s->stmt );
+		sqlite3_reset( s->stmt ), sqlite3_clear_bindings( s->stmt );
+		if ( status != SQLITE_DONE ) {
+			return 0;
 		}
+	}
+
+	return 1;
+}
+
+
+
+//Read a live session as another worker saved it, returning -1 if the disk couldn't be read
+static int session_read ( const char *id, unsigned int site, time_t now, struct sess_t **d ) {
+	char err[ 1024 ] = { 0 };
+	struct dbconn_t *c = NULL;
+	struct dbstmt_t *s = NULL;
+	struct sess_t *e = NULL;
+	int status = 0;
 
-		if ( lt_geti( ttx, "headers" ) == -1 ) {
-			lua_pushstring( L, "headers" ), lua_newtable( L );
-			lua_setstrstr( L, "Set-Cookie", sidvalue, 3 );
+	if ( !( c = db_pool_open( sdbpath, err, sizeof( err ) ) ) || !( s = db_pool_prepare( c, select_session, err, sizeof( err ) ) ) ) {
+		fprintf( stderr, "Session read from %s failed: %s\n", sdbpath, err );
+		return -1;
+	}
+
+	sqlite3_bind_text( s->stmt, 1, id, -1, SQLITE_STATIC );
+	if ( ( status = sqlite3_step( s->stmt ) ) == SQLITE_ROW && sqlite3_column_int64( s->stmt, 0 ) == site && sqlite3_column_int64( s->stmt, 3 ) > now ) {
+		const char *match = (const char *)sqlite3_column_text( s->stmt, 1 );
+		e = sess_make( id, site, ( match ) ? match : "", sqlite3_column_int64( s->stmt, 2 ), sqlite3_column_int64( s->stmt, 3 ) );
+		status = ( e ) ? SQLITE_DONE : SQLITE_NOMEM;
+	}
+	sqlite3_reset( s->stmt ), sqlite3_clear_bindings( s->stmt );
+
+	if ( !e || status != SQLITE_DONE ) {
+		return ( status == SQLITE_DONE || status == SQLITE_ROW ) ? 0 : -1;
+	}
+
+	if ( !( s = db_pool_prepare( c, select_values_of_session, err, sizeof( err ) ) ) ) {
+		sess_free( e );
+		return -1;
+	}
+
+	sqlite3_bind_text( s->stmt, 1, id, -1, SQLITE_STATIC );
+	while ( ( status = sqlite3_step( s->stmt ) ) == SQLITE_ROW ) {
+		if ( !sess_put( e, (const char *)sqlite3_column_text( s->stmt, 0 ), sqlite3_column_bytes( s->stmt, 0 ),
+			sqlite3_column_int( s->stmt, 1 ), sqlite3_column_blob( s->stmt, 2 ), sqlite3_column_bytes( s->stmt, 2 ) ) ) {
+			status = SQLITE_NOMEM;
+			break;
+		}
+	}
+	sqlite3_reset( s->stmt ), sqlite3_clear_bindings( s->stmt );
+
+	if ( status != SQLITE_DONE ) {
+		sess_free( e );
+		return -1;
+	}
+
+	*d = e;
+	return 1;
+}
+
+
+
+//Find a live session and lock its shard, going to disk for any another worker may have changed
+static struct sess_t * session_find ( struct sessshard_t *s, const char *id, unsigned int hash, unsigned int site ) {
+	struct sess_t *e = NULL, *d = NULL;
+	time_t now = time( NULL );
+	int status = 0;
+
+	//Unsaved changes win, and copies newer than the last flush can be trusted
+	pthread_mutex_lock( &s->lock );
+	e = sess_find( s, id, hash, site, now );
+	if ( !session_shared || !session_persist || sess_gone( s, id ) || ( e && ( e->dirty || now - e->synced < SESSION_FLUSH_INTERVAL ) ) ) {
+		return e;
+	}
+
+	//Nobody waits on the shard while the disk is read, so look again after
+	pthread_mutex_unlock( &s->lock );
+	status = session_read( id, site, now, &d );
+	db_pool_done();
+	pthread_mutex_lock( &s->lock );
+	e = sess_find( s, id, hash, site, now );
+	if ( status == -1 || sess_gone( s, id ) || ( e && e->dirty ) ) {
+		( d ) ? sess_free( d ) : 0;
+		return e;
+	}
+
+	if ( e ) {
+		sess_unlink( s, e );
+		sess_free( e );
+	}
+
+	if ( d && !sess_insert( s, d ) ) {
+		sess_free( d ), d = NULL;
+	}
+	return d;
+}
+
+
+
+//Write every changed session to disk in one transaction
+int session_flush ( void ) {
+	struct sess_t *saved = NULL, *gone = NULL;
+	struct dbconn_t *c = NULL;
+	char err[ 1024 ] = { 0 };
+	time_t now = time( NULL );
+	int status = 1;
+
+	//Only copies are written, so requests never wait on the disk
+	for ( int i = 0; i < SESSION_SHARDS; i++ ) {
+		struct sessshard_t *s = &shards[ i ];
+		pthread_mutex_lock( &s->lock );
+		sess_advance( s, now );
+		for ( struct sess_t *e = s->dirty, *cp = NULL; e; e = e->dnext ) {
+			( ( cp = sess_copy( e ) ) ) ? cp->next = saved, saved = cp : 0;
+			e->dirty = 0, e->synced = now;
+		}
+		s->dirty = NULL;
+
+		//Ended sessions are already out of the table, so they can be taken whole
+		for ( struct sess_t *e = s->gone, *n = NULL; e; e = n ) {
+			n = e->next, e->next = gone, gone = e;
+		}
+		s->gone = NULL;
+		pthread_mutex_unlock( &s->lock );
+	}
+
+	if ( session_persist && ( saved || gone ) ) {
+		if ( !( c = db_pool_open( sdbpath, err, sizeof( err ) ) ) )
+			status = 0;
+		else if ( sqlite3_exec( c->db, "BEGIN", NULL, NULL, NULL ) != SQLITE_OK ) {
+			snprintf( err, sizeof( err ), "%s", sqlite3_errmsg( c->db ) );
+			status = 0;
 		}
 		else {
-			zTable *t1p = lt_copy_by_index( ttx, lt_geti( ttx, "headers" ) );
-			lua_pushstring( L, "headers" );
-			lua_newtable( L ); // index 3
-			lua_setstrstr( L, "Set-Cookie", sidvalue, 3 );
-			lt_reset( t1p );
-			zKeyval *x = lt_next( t1p );  // Skip the first one
-			for ( ; ( x = lt_next( t1p ) ) && x->key.type != ZTABLE_TRM ;  ) {	
-				zhValue k = x->key, v = x->value;
-				if ( k.type == ZTABLE_TXT ) 
-					lua_pushstring( L, k.v.vchar );
-				else if ( k.type == ZTABLE_INT )
-					lua_pushnumber( L, k.v.vint );
-				else {
-					FPRINTF( "Got useless key in response.headers\n" );
-					continue;
-				}
-
-				if ( v.type == ZTABLE_INT )
-					lua_pushnumber( L, v.v.vint );				
-				else if ( v.type == ZTABLE_FLT )
-					lua_pushnumber( L, v.v.vfloat );				
-				else if ( v.type == ZTABLE_TXT )
-					lua_pushstring( L, v.v.vchar );
-				else /* ZTABLE_TRM || ZTABLE_NON || ZTABLE_USR */ {
-					// I don't care about any of these...
-					FPRINTF( "Got useless value in response.headers\n" );
-					continue;
-				}
-				lua_settable( L, 3 );
+			for ( struct sess_t *e = gone; status && e; e = e->next ) {
+				status = session_exec_id( c, delete_session, e->id, err, sizeof( err ) ) &&
+					session_exec_id( c, delete_session_values, e->id, err, sizeof( err ) );
+			}
+
+			for ( struct sess_t *e = saved; status && e; e = e->next ) {
+				status = session_write( c, e, err, sizeof( err ) );
+			}
+
+			if ( !status || sqlite3_exec( c->db, "COMMIT", NULL, NULL, NULL ) != SQLITE_OK ) {
+				( status ) ? snprintf( err, sizeof( err ), "%s", sqlite3_errmsg( c->db ) ) : 0;
+				sqlite3_exec( c->db, "ROLLBACK", NULL, NULL, NULL );
+				status = 0;
+			}
+		}
+
+		if ( !status ) {
+			fprintf( stderr, "Session write to %s failed: %s\n", sdbpath, err );
+		}
+		db_pool_done();
+	}
+
+	for ( struct sess_t *n = NULL; saved; saved = n ) {
+		n = saved->next;
+		sess_free( saved );
+	}
+
+	for ( struct sess_t *n = NULL; gone; gone = n ) {
+		n = gone->next;
+		sess_free( gone );
+	}
+
+	return status;
+}
+
+
+
+//Write sessions behind requests for as long as the server runs
+static void * session_writer ( void *arg ) {
+	for ( struct timespec t = { SESSION_FLUSH_INTERVAL, 0 }; ; ) {
+		nanosleep( &t, NULL );
+		session_flush();
+	}
+	return NULL;
+}
+
+
+
+//Set up the shards, load saved sessions and start writing new ones
+static void session_init ( void ) {
+	char err[ 1024 ] = { 0 };
+	pthread_t id;
+
+	for ( int i = 0; i < SESSION_SHARDS; i++ ) {
+		struct sessshard_t *s = &shards[ i ];
+		pthread_mutex_init( &s->lock, NULL );
+		if ( ( s->buckets = malloc( sizeof( struct sess_t * ) * 16 ) ) ) {
+			memset( s->buckets, 0, sizeof( struct sess_t * ) * 16 );
+			s->mask = 15;
+		}
+	}
+
+	//Sessions still work without a database, they just won't survive a restart
+	if ( !( session_persist = session_load( err, sizeof( err ) ) ) ) {
+		fprintf( stderr, "Sessions will not be saved to %s: %s\n", sdbpath, err );
+	}
+	db_pool_done();
+
+	if ( pthread_create( &id, NULL, session_writer, NULL ) == 0 ) {
+		pthread_detach( id );
+	}
+}
+
+
+
+//Get the site the current request belongs to
+static unsigned int session_site ( lua_State *L ) {
+	unsigned int site = 0;
+	if ( lua_getglobal( L, "shadow" ) == LUA_TSTRING ) {
+		site = sess_hash( lua_tostring( L, -1 ) );
+	}
+	lua_pop( L, 1 );
+	return site;
+}
+
+
+
+//Get the name of the session cookie
+static const char * session_name ( lua_State *L ) {
+	const char *name = ( lua_getglobal( L, "sid" ) == LUA_TSTRING ) ? lua_tostring( L, -1 ) : "sid";
+	lua_pop( L, 1 );
+	return name;
+}
+
+
+
+//Find the session ID at arg, or in the request's cookie if there isn't one there
+static int session_from ( lua_State *L, int arg, char *id ) {
+	const char *name = session_name( L ), *v = NULL, *cookie = NULL;
+	size_t len = 0, nlen = strlen( name );
+
+	if ( lua_type( L, arg ) == LUA_TSTRING ) {
+		v = lua_tolstring( L, arg, &len );
+	}
+	else if ( lua_getglobal( L, "request" ) == LUA_TTABLE && lua_getfield( L, -1, "headers" ) == LUA_TTABLE ) {
+		//Header names are only lower cased on the first letter
+		for ( lua_pushnil( L ); lua_next( L, -2 ); lua_pop( L, 1 ) ) {
+			if ( lua_type( L, -2 ) == LUA_TSTRING && !strcasecmp( lua_tostring( L, -2 ), "cookie" ) ) {
+				( lua_getfield( L, -1, "value" ) == LUA_TSTRING ) ? cookie = lua_tostring( L, -1 ) : 0;
+				lua_pop( L, 3 );
+				break;
 			}
-			lt_free( t1p );
 		}
-		lua_settable( L, 1 );
 	}
 
+	//Look for name=value among the cookies
+	for ( const char *p = cookie; p && *p; p += strcspn( p, ";" ), p += ( *p == ';' ) ) {
+		p += strspn( p, " \t" );
+		if ( !strncmp( p, name, nlen ) && p[ nlen ] == '=' ) {
+			v = p + nlen + 1, len = strcspn( v, "; \t" );
+			break;
+		}
+	}
+
+	//Anything that isn't the right shape can't be a session
+	if ( len != SESSION_ID_LEN || strspn( v, b64url ) < SESSION_ID_LEN ) {
+		lua_settop( L, arg );
+		return 0;
+	}
+
+	memcpy( id, v, SESSION_ID_LEN ), id[ SESSION_ID_LEN ] = '\0';
+	lua_settop( L, arg );
+	return 1;
+}
+
+
+
+//Add a Set-Cookie header to the response, making one if there isn't one yet
+static void session_cookie ( lua_State *L, const char *cookie ) {
+	if ( lua_getglobal( L, "response" ) != LUA_TTABLE ) {
+		lua_pop( L, 1 ), lua_newtable( L );
+		lua_pushboolean( L, 1 ), lua_setfield( L, -2, "delay" );
+		lua_pushvalue( L, -1 ), lua_setglobal( L, "response" );
+	}
+
+	if ( lua_getfield( L, -1, "headers" ) != LUA_TTABLE ) {
+		lua_pop( L, 1 ), lua_newtable( L );
+		lua_pushvalue( L, -1 ), lua_setfield( L, -3, "headers" );
+	}
+
+	lua_pushstring( L, cookie ), lua_setfield( L, -2, "Set-Cookie" );
+	lua_pop( L, 2 );
+}
+
+
+
+//Start a new session for { token, expiry, path }
+int session_start ( lua_State *L ) {
+	char id[ SESSION_ID_LEN + 1 ] = { 0 }, cookie[ 2048 ] = { 0 }, err[ 1024 ] = { 0 };
+	const char *token = NULL, *path = NULL;
+	struct sessshard_t *s = NULL;
+	struct sess_t *e = NULL;
+	struct dbconn_t *c = NULL;
+	time_t now = time( NULL );
+	int expiry = 0, len = 0, ok = 0, written = 0;
+
+	luaL_checktype( L, 1, LUA_TTABLE );
+	pthread_once( &session_once, session_init );
+
+	if ( lua_getfield( L, 1, "token" ) != LUA_TSTRING ) {
+		return luaL_error( L, "session - no token specified." );
+	}
+	token = lua_tostring( L, -1 );
+
+	if ( lua_getfield( L, 1, "expiry" ) == LUA_TNUMBER ) {
+		expiry = lua_tointeger( L, -1 );
+	}
+
+	if ( lua_getfield( L, 1, "path" ) == LUA_TSTRING ) {
+		path = lua_tostring( L, -1 );
+	}
+
+	//Generate an unique ID
+	if ( !sess_id( id ) ) {
+		return luaL_error( L, "session - could not generate an ID: %s", strerror( errno ) );
+	}
+
+	if ( !( e = sess_make( id, session_site( L ), token, now, now + ( ( expiry > 0 ) ? expiry : SESSION_EXPIRY ) ) ) ) {
+		return luaL_error( L, "session - out of memory." );
+	}
+
+	//Other workers look for new sessions on disk, so they can't wait for the next flush
+	if ( session_shared && session_persist && ( c = db_pool_open( sdbpath, err, sizeof( err ) ) ) ) {
+		written = session_write( c, e, err, sizeof( err ) );
+	}
+	db_pool_done();
+
+	s = sess_shard( e->hash );
+	pthread_mutex_lock( &s->lock );
+	sess_advance( s, now );
+	if ( ( ok = sess_insert( s, e ) ) && !written ) {
+		sess_touch( s, e );
+	}
+	pthread_mutex_unlock( &s->lock );
+
+	if ( !ok ) {
+		sess_free( e );
+		return luaL_error( L, "session - out of memory." );
+	}
+
+	//Use set cookie to send a session identifier (name can be changed from config)
+	len = snprintf( cookie, sizeof( cookie ), "%s=%s; HttpOnly", session_name( L ), id );
+	if ( expiry > 0 ) {
+		len += snprintf( &cookie[ len ], sizeof( cookie ) - len, "; Max-Age=%d", expiry );
+	}
+
+	if ( path && len < sizeof( cookie ) ) {
+		snprintf( &cookie[ len ], sizeof( cookie ) - len, "; Path=%s", path );
+	}
+
+	session_cookie( L, cookie );
+
 	//We also return the key
-	lua_pushstring( L, randid );
+	lua_pushstring( L, id );
+	return 1;
+}
+
+
+
+//Return the token of the current session, or nil if it's gone
+int session_check ( lua_State *L ) {
+	char id[ SESSION_ID_LEN + 1 ] = { 0 }, small[ 256 ], *buf = small;
+	unsigned int site = session_site( L ), hash = 0;
+	struct sessshard_t *s = NULL;
+	struct sess_t *e = NULL;
+	size_t len = 0, size = sizeof( small );
+
+	pthread_once( &session_once, session_init );
+	if ( !session_from( L, 1, id ) ) {
+		lua_pushnil( L );
+		return 1;
+	}
 
-	//Close the connection
-	zdbv_free( zdbbind );
-	zdb_free( &zdb );	
-	zdb_close( &zdb );	
-	lt_free( t );
+	//Lua may raise out of any call, so the token is copied out before anything is pushed
+	s = sess_shard( hash = sess_hash( id ) );
+	for ( ;; ) {
+		if ( ( e = session_find( s, id, hash, site ) ) && ( len = strlen( e->match ) ) <= size ) {
+			memcpy( buf, e->match, len );
+		}
+		pthread_mutex_unlock( &s->lock );
+		if ( !e || len <= size ) {
+			break;
+		}
+		buf = lua_newuserdatauv( L, size = len, 0 );
+	}
+
+	( e ) ? lua_pushlstring( L, buf, len ) : lua_pushnil( L );
 	return 1;
 }
 
-int stop ( lua_State *L ) {
-	//Find the right key (using the sid that we chose)
-	return 0;
+
+
+//End the current session and expire its cookie
+int session_stop ( lua_State *L ) {
+	char id[ SESSION_ID_LEN + 1 ] = { 0 }, cookie[ 512 ] = { 0 };
+	unsigned int site = session_site( L ), hash = 0;
+	struct sessshard_t *s = NULL;
+	struct sess_t *e = NULL;
+
+	pthread_once( &session_once, session_init );
+	if ( !session_from( L, 1, id ) ) {
+		lua_pushboolean( L, 0 );
+		return 1;
+	}
+
+	s = sess_shard( hash = sess_hash( id ) );
+	( ( e = session_find( s, id, hash, site ) ) ) ? sess_remove( s, e ) : 0;
+	pthread_mutex_unlock( &s->lock );
+
+	snprintf( cookie, sizeof( cookie ), "%s=; HttpOnly; Max-Age=0", session_name( L ) );
+	session_cookie( L, cookie );
+	lua_pushboolean( L, e != NULL );
+	return 1;
 }
 
-int get ( lua_State *L ) {
-	//Get any data associated with the key
-	return 0;
+
+
+//Return a value saved in the current session
+int session_get ( lua_State *L ) {
+	char id[ SESSION_ID_LEN + 1 ] = { 0 }, small[ 256 ], *buf = small;
+	unsigned int site = session_site( L ), hash = 0;
+	struct sessshard_t *s = NULL;
+	struct sess_t *e = NULL;
+	struct sessval_t *v = NULL;
+	size_t klen = 0, len = 0, size = sizeof( small );
+	const char *key = luaL_checklstring( L, 1, &klen );
+	int type = 0;
+
+	pthread_once( &session_once, session_init );
+	if ( !session_from( L, 2, id ) ) {
+		lua_pushnil( L );
+		return 1;
+	}
+
+	//Copy the value out first, growing the buffer in Lua's memory if it's too big
+	s = sess_shard( hash = sess_hash( id ) );
+	for ( ;; ) {
+		if ( ( e = session_find( s, id, hash, site ) ) ) {
+			for ( v = e->values; v && ( v->klen != klen || memcmp( v->data, key, klen ) ); v = v->next ) ;
+		}
+		if ( v && ( len = v->vlen ) <= size ) {
+			memcpy( buf, v->data + v->klen, len ), type = v->type;
+		}
+		pthread_mutex_unlock( &s->lock );
+		if ( !v || len <= size ) {
+			break;
+		}
+		buf = lua_newuserdatauv( L, size = len, 0 ), v = NULL;
+	}
+
+	if ( !v )
+		lua_pushnil( L );
+	else if ( type == SESSION_BOOLEAN )
+		lua_pushboolean( L, *buf );
+	else if ( type == SESSION_INTEGER ) {
+		lua_Integer i = 0;
+		memcpy( &i, buf, sizeof( i ) );
+		lua_pushinteger( L, i );
+	}
+	else if ( type == SESSION_FLOAT ) {
+		lua_Number n = 0;
+		memcpy( &n, buf, sizeof( n ) );
+		lua_pushnumber( L, n );
+	}
+	else {
+		lua_pushlstring( L, buf, len );
+	}
+	return 1;
 }
 
-int set ( lua_State *L ) {
-	//Set any data with key
-	return 0;
+
+
+//Save a value in the current session
+int session_store ( lua_State *L ) {
+	char id[ SESSION_ID_LEN + 1 ] = { 0 }, b = 0;
+	unsigned int site = session_site( L ), hash = 0;
+	struct sessshard_t *s = NULL;
+	struct sess_t *e = NULL;
+	size_t klen = 0, vlen = 0;
+	const char *key = luaL_checklstring( L, 1, &klen );
+	const void *value = NULL;
+	lua_Integer i = 0;
+	lua_Number n = 0;
+	int type = 0, ok = 0;
+
+	//Numbers keep their subtype, so integers come back as integers
+	if ( lua_type( L, 2 ) == LUA_TSTRING )
+		value = lua_tolstring( L, 2, &vlen ), type = SESSION_STRING;
+	else if ( lua_type( L, 2 ) == LUA_TBOOLEAN )
+		b = lua_toboolean( L, 2 ), value = &b, vlen = 1, type = SESSION_BOOLEAN;
+	else if ( lua_isinteger( L, 2 ) )
+		i = lua_tointeger( L, 2 ), value = &i, vlen = sizeof( i ), type = SESSION_INTEGER;
+	else if ( lua_type( L, 2 ) == LUA_TNUMBER )
+		n = lua_tonumber( L, 2 ), value = &n, vlen = sizeof( n ), type = SESSION_FLOAT;
+	else {
+		return luaL_error( L, "session - can't save a %s at key '%s'.", luaL_typename( L, 2 ), key );
+	}
+
+	pthread_once( &session_once, session_init );
+	if ( !session_from( L, 3, id ) ) {
+		return luaL_error( L, "session - no session to save '%s' to.", key );
+	}
+
+	s = sess_shard( hash = sess_hash( id ) );
+	if ( ( e = session_find( s, id, hash, site ) ) && ( ok = sess_put( e, key, klen, type, value, vlen ) ) ) {
+		sess_touch( s, e );
+	}
+	pthread_mutex_unlock( &s->lock );
+
+	if ( !ok ) {
+		return luaL_error( L, "session - %s", ( e ) ? "out of memory." : "no session to save to." );
+	}
+
+	lua_pushboolean( L, 1 );
+	return 1;
 }
 
-int unset ( lua_State *L ) {
-	return 0;
+
+
+//Remove a value from the current session
+int session_unset ( lua_State *L ) {
+	char id[ SESSION_ID_LEN + 1 ] = { 0 };
+	unsigned int site = session_site( L ), hash = 0;
+	struct sessshard_t *s = NULL;
+	struct sess_t *e = NULL;
+	int found = 0;
+	size_t klen = 0;
+	const char *key = luaL_checklstring( L, 1, &klen );
+
+	pthread_once( &session_once, session_init );
+	if ( !session_from( L, 2, id ) ) {
+		lua_pushboolean( L, 0 );
+		return 1;
+	}
+
+	s = sess_shard( hash = sess_hash( id ) );
+	if ( ( e = session_find( s, id, hash, site ) ) ) {
+		for ( struct sessval_t **p = &e->values, *v = NULL; ( v = *p ); p = &v->next ) {
+			if ( v->klen == klen && !memcmp( v->data, key, klen ) ) {
+				*p = v->next, found = 1;
+				free( v );
+				sess_touch( s, e );
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock( &s->lock );
+
+	lua_pushboolean( L, found );
+	return 1;
 }
 
+
 struct luaL_Reg session_set[] = {
- { "start", start }
-#if 0
-,{ "check", generate_sha1 }
-,{ "stop", generate_sha256 }
-,{ "set", generate_sha384 }
-#endif
+ { "start", session_start }
+,{ "check", session_check }
+,{ "stop", session_stop }
+,{ "get", session_get }
+,{ "set", session_store }
+,{ "unset", session_unset }
 ,{ NULL }
 };
 
-
@@ -1,10 +1,17 @@
-/* ------------------------------------------- * 
+/* ------------------------------------------- *
  * session.h
  * =========
- * 
- * Summary 
+ *
+ * Summary
  * -------
- * -
+ * Sessions kept in memory and written behind to SQLite.
+ *
+ * Usage
+ * -----
+ * Session records live in SESSION_SHARDS separately locked hash tables
+ * and expire off a timer wheel.  A background thread writes changed
+ * records to SESSION_DB_PATH every SESSION_FLUSH_INTERVAL seconds, and
+ * the records still on disk are loaded again at startup.
  *
  * LICENSE
  * -------
@@ -12,18 +19,69 @@
  *
  * See LICENSE in the top-level directory for more information.
  *
- * CHANGELOG 
+ * CHANGELOG
  * ---------
  * -
  * ------------------------------------------- */
 #include <zdb.h>
 #include <zhttp.h>
 #include <ztable.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/random.h>
 #include "../lua.h"
 #include "../config.h"
 #include "rand.h"
+#include "db.h"
 
 #ifndef LSESSION_H
  #define LSESSION_H
+
+//Random bytes in a session ID, and how long they are once encoded
+#define SESSION_ID_BYTES 24
+
+#define SESSION_ID_LEN 32
+
+//One value stored in a session, key and value laid out back to back
+struct sessval_t {
+	struct sessval_t *next;
+	int type;
+	int klen;
+	int vlen;
+	char data[];
+};
+
+//A session
+struct sess_t {
+	struct sess_t *next;
+	struct sess_t *wnext, *wprev;
+	struct sess_t *dnext, *dprev;
+	unsigned int hash;
+	unsigned int site;
+	int dirty;
+	time_t synced;
+	time_t start;
+	time_t expires;
+	char *match;
+	struct sessval_t *values;
+	char id[ SESSION_ID_LEN + 1 ];
+};
+
+int session_start ( lua_State * );
+
+int session_check ( lua_State * );
+
+int session_stop ( lua_State * );
+
+int session_get ( lua_State * );
+
+int session_store ( lua_State * );
+
+int session_unset ( lua_State * );
+
+int session_flush ( void );
+
+extern int session_shared;
+
 extern struct luaL_Reg session_set[];
 #endif
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include "event.h"
+
+// How many events to pull from epoll at once
+#define EVENT_BATCH 256
+
+// How often (in ms) the loop wakes up to look for stalled connections
+#define EVENT_TICK 1000
+
+// A connection as tracked by the event loop
+typedef struct evconn_t {
+
+	// The connection itself (must stay first)
+	conn_t conn;
+
+	// Next connection in either the work queue or the free list
+	struct evconn_t *next;
+
+	// When the connection was last handed back to epoll
+	struct timespec last;
+
+	// Is the connection sitting in epoll waiting for the socket?
+	int parked;
+
+	// Set only on the slots that stand in for listening sockets
+	server_t *listener;
+
+} evconn_t;
+
+
+
+// Everything shared between the event loop and its workers
+static struct evloop_t {
+	int efd;
+	int maxfd;
+	evconn_t **conns;
+	evconn_t *queue, *tail, *freelist;
+	pthread_mutex_t qlock;
+	pthread_cond_t qcond;
+	pthread_mutex_t plock;
+} ev = {
+	.efd = -1
+,	.qlock = PTHREAD_MUTEX_INITIALIZER
+,	.qcond = PTHREAD_COND_INITIALIZER
+,	.plock = PTHREAD_MUTEX_INITIALIZER
+};
+
+
+
+static void write_to_access_log ( server_t *p, conn_t *conn ) {
+	char timebuf[ 64 ] = {0};
+	time_format( &conn->start, timebuf, sizeof( timebuf ) );
+	fprintf( p->access_fd, "%s\t%s\n", conn->ipv4, timebuf );
+}
+
+
+
+// Hand a connection to the worker pool
+static void event_queue ( evconn_t *c ) {
+	pthread_mutex_lock( &ev.qlock );
+	c->next = NULL;
+	if ( ev.tail )
+		ev.tail->next = c, ev.tail = c;
+	else {
+		ev.queue = ev.tail = c;
+	}
+	pthread_cond_signal( &ev.qcond );
+	pthread_mutex_unlock( &ev.qlock );
+}
+
+
+
+// Give a connection back to epoll until its socket is ready again
+static int event_park ( evconn_t *c, unsigned int events, int op ) {
+	struct epoll_event e = { .events = events | EPOLLONESHOT, .data.ptr = c };
+	int status = 1;
+
+	pthread_mutex_lock( &ev.plock );
+	clock_gettime( CLOCK_REALTIME, &c->last );
+	c->parked = 1;
+	if ( epoll_ctl( ev.efd, op, c->conn.fd, &e ) == -1 ) {
+		snprintf( c->conn.err, sizeof( c->conn.err ), 
+			"epoll_ctl() failed: %s", strerror( errno ) );
+		c->parked = 0, status = 0;
+	}
+	pthread_mutex_unlock( &ev.plock );
+	return status;
+}
+
+
+
+// Close a connection and put its slot back on the free list
+static void event_close ( evconn_t *c ) {
+	FPRINTF( "Closing connection on fd %d\n", c->conn.fd );
+	pthread_mutex_lock( &ev.plock );
+	ev.conns[ c->conn.fd ] = NULL;
+	if ( close( c->conn.fd ) == -1 ) {
+		FPRINTF( "Error closing TCP socket connection: %s\n", strerror( errno ) );
+	}
+	c->next = ev.freelist, ev.freelist = c;
+	pthread_mutex_unlock( &ev.plock );
+}
+
+
+
+// Run a connection's stages until it finishes or has to wait on the socket
+static void event_run ( evconn_t *c ) {
+	conn_t *conn = &c->conn;
+
+	for ( connstage_t s; conn->stage != CONN_DESTROY; ) {
+		s = conn->stage;
+		if ( !srv_step( conn->server, conn ) ) {
+			break;
+		}
+
+		// The socket is not ready yet, so stop and wait for epoll
+		if ( conn->wait || ( conn->stage == s && ( s == CONN_READ || s == CONN_WRITE ) ) ) {
+			unsigned int events = ( conn->wait ) ? ( ( conn->wait & POLLOUT ) ? EPOLLOUT : EPOLLIN ) : ( s == CONN_READ ) ? EPOLLIN : EPOLLOUT;
+			if ( event_park( c, events, EPOLL_CTL_MOD ) ) {
+				return;
+			}
+			FPRINTF( "%s\n", conn->err );
+			conn->stage = CONN_POST;
+		}
+	}
+
+	event_close( c );
+}
+
+
+
+// Workers pull ready connections off of the queue
+static void * event_worker ( void *t ) {
+	for ( evconn_t *c = NULL; ; ) {
+		pthread_mutex_lock( &ev.qlock );
+		while ( !( c = ev.queue ) ) {
+			pthread_cond_wait( &ev.qcond, &ev.qlock );
+		}
+		if ( !( ev.queue = c->next ) ) {
+			ev.tail = NULL;
+		}
+		pthread_mutex_unlock( &ev.qlock );
+		event_run( c );
+	}
+	return NULL;
+}
+
+
+
+// Drop connections that have been waiting on their socket for too long
+static void event_reap ( server_t *p ) {
+	struct timespec now = {0};
+	evconn_t *expired = NULL;
+	clock_gettime( CLOCK_REALTIME, &now );
+
+	pthread_mutex_lock( &ev.plock );
+	for ( int fd = 0; fd < ev.maxfd; fd++ ) {
+		evconn_t *c = ev.conns[ fd ];
+		int timeout = 0;
+		if ( !c || !c->parked ) {
+			continue;
+		}
+
+		if ( c->conn.stage == CONN_WRITE )
+			timeout = p->wtimeout;
+		else {
+			timeout = ( c->conn.count && !c->conn.pipelen ) ? p->ktimeout : p->rtimeout;
+		}
+		if ( time_diff_sec( &c->last, &now ) < timeout ) {
+			continue;
+		}
+
+		// Nothing is allocated until pre runs, so those can just be closed
+		FPRINTF( "Connection on fd %d timed out\n", fd );
+		epoll_ctl( ev.efd, EPOLL_CTL_DEL, fd, NULL );
+		c->parked = 0;
+		c->conn.stage = ( c->conn.stage == CONN_INIT ) ? CONN_DESTROY : CONN_POST;
+
+		// Whatever was half written can't be followed by another response
+		( c->conn.res ) ? c->conn.res->keepalive = 0 : 0;
+		c->next = expired, expired = c;
+	}
+	pthread_mutex_unlock( &ev.plock );
+
+	for ( evconn_t *c = expired, *n = NULL; c; c = n ) {
+		n = c->next;
+		event_queue( c );
+	}
+}
+
+
+
+// Accept every pending connection on the listening socket
+static int event_accept ( server_t *p ) {
+	for ( ;; ) {
+		struct sockaddr_storage addrinfo = { 0 };
+		socklen_t addrlen = sizeof( addrinfo );
+		evconn_t *c = NULL;
+		int fd = -1;
+
+		if ( ( fd = accept4( p->fd, (struct sockaddr *)&addrinfo, &addrlen, SOCK_NONBLOCK ) ) == -1 ) {
+			if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED )
+				return 1;
+			else if ( errno == EMFILE || errno == ENFILE ) { 
+				//These both refer to open file limits
+				snprintf( p->err, sizeof( p->err ), "Too many open files, try closing some requests.\n" );
+				fprintf( p->log_fd, "%s\n", p->err );
+				return 1;
+			}
+			else if ( errno == EINTR ) { 
+				//In this situation we'll handle signals
+				snprintf( p->err, sizeof( p->err ), "Signal received: %s\n", strerror( errno ) );
+				fprintf( p->log_fd, "%s", p->err );
+				return 0;
+			}
+			else {
+				//All other codes really should just stop. 
+				snprintf( p->err, sizeof( p->err ), "accept() failed: %s\n", strerror( errno ) );
+				fprintf( p->log_fd, "%s", p->err );
+				return 0;
+			}
+		}
+
+		if ( fd >= ev.maxfd ) {
+			snprintf( p->err, sizeof( p->err ), "Descriptor %d exceeds connection table.\n", fd );
+			fprintf( p->log_fd, "%s", p->err );
+			close( fd );
+			continue;
+		}
+
+		// Reuse a free slot if there is one
+		pthread_mutex_lock( &ev.plock );
+		if ( ( c = ev.freelist ) ) {
+			ev.freelist = c->next;
+		}
+		pthread_mutex_unlock( &ev.plock );
+
+		if ( !c && !( c = malloc( sizeof( evconn_t ) ) ) ) {
+			snprintf( p->err, sizeof( p->err ), "Connection allocation failed: %s\n", strerror( errno ) );
+			fprintf( p->log_fd, "%s", p->err );
+			close( fd );
+			continue;
+		}
+
+		//Set as much connection information as you can
+		memset( c, 0, sizeof( evconn_t ) );
+		c->conn.fd = fd;
+		c->conn.server = p;
+		c->conn.running = CONNSTAT_ACTIVE;
+		c->conn.stage = CONN_INIT;
+		clock_gettime( CLOCK_REALTIME, &c->conn.start );
+
+		//Log an access message including the IP in either ipv6 or v4
+		if ( addrinfo.ss_family == AF_INET )
+			inet_ntop( AF_INET, &((struct sockaddr_in *)&addrinfo)->sin_addr, c->conn.ipv4, sizeof( c->conn.ipv4 ) ); 
+		else {
+			memcpy( c->conn.ipv6, &((struct sockaddr_in6 *)&addrinfo)->sin6_addr, sizeof( c->conn.ipv6 ) );
+		}
+
+		pthread_mutex_lock( &ev.plock );
+		ev.conns[ fd ] = c;
+		pthread_mutex_unlock( &ev.plock );
+
+		//Nothing happens until the client actually sends something
+		if ( !event_park( c, EPOLLIN, EPOLL_CTL_ADD ) ) {
+			fprintf( p->log_fd, "%s\n", c->conn.err );
+			c->conn.stage = CONN_DESTROY;
+			event_close( c );
+			continue;
+		}
+
+		FPRINTF( "Got new connection: %d\n", fd );
+		write_to_access_log( p, &c->conn );
+	}
+	return 1;
+}
+
+
+
+// An event driven server with a fixed pool of workers
+int srv_event ( server_t *p ) {
+
+	// Define
+	struct epoll_event events[ EVENT_BATCH ];
+	struct rlimit rl = { 0 };
+	evconn_t *listeners = NULL;
+	server_t *s = p;
+	int threads = p->threads;
+	int flags = 0;
+
+	// The connection table is indexed by file descriptor
+	if ( getrlimit( RLIMIT_NOFILE, &rl ) == -1 || rl.rlim_cur == RLIM_INFINITY ) {
+		rl.rlim_cur = MAX_THREADS;
+	}
+
+	ev.maxfd = rl.rlim_cur;
+	if ( !( ev.conns = malloc( sizeof( evconn_t * ) * ev.maxfd ) ) ) {
+		snprintf( p->err, sizeof( p->err ), "Failed to allocate connection table: %s\n", strerror( errno ) );
+		fprintf( p->log_fd, "%s", p->err );
+		return 0;
+	}
+	memset( ev.conns, 0, sizeof( evconn_t * ) * ev.maxfd );
+
+	if ( ( ev.efd = epoll_create1( 0 ) ) == -1 ) {
+		snprintf( p->err, sizeof( p->err ), "epoll_create1() failed: %s\n", strerror( errno ) );
+		fprintf( p->log_fd, "%s", p->err );
+		free( ev.conns );
+		return 0;
+	}
+
+	if ( !( listeners = calloc( SERVER_MAX_LISTENERS, sizeof( evconn_t ) ) ) ) {
+		snprintf( p->err, sizeof( p->err ), "Failed to allocate listeners: %s\n", strerror( errno ) );
+		fprintf( p->log_fd, "%s", p->err );
+		close( ev.efd ), free( ev.conns );
+		return 0;
+	}
+
+	// Every listener goes into the same epoll set
+	for ( int i = 0; s && i < SERVER_MAX_LISTENERS; s = s->next, i++ ) {
+		struct epoll_event le = { .events = EPOLLIN, .data.ptr = &listeners[ i ] };
+		listeners[ i ].listener = s;
+
+		// Connections belong to the listener that took them, so every one has to hand waits back to the loop
+		s->yield = 1;
+
+		// The listener must never block the loop
+		if ( ( flags = fcntl( s->fd, F_GETFL ) ) == -1 || fcntl( s->fd, F_SETFL, flags | O_NONBLOCK ) == -1 ) {
+			snprintf( p->err, sizeof( p->err ), "fcntl error: %s\n", strerror( errno ) );
+			fprintf( p->log_fd, "%s", p->err );
+			close( ev.efd ), free( ev.conns ), free( listeners );
+			return 0;
+		}
+
+		if ( epoll_ctl( ev.efd, EPOLL_CTL_ADD, s->fd, &le ) == -1 ) {
+			snprintf( p->err, sizeof( p->err ), "epoll_ctl() failed: %s\n", strerror( errno ) );
+			fprintf( p->log_fd, "%s", p->err );
+			close( ev.efd ), free( ev.conns ), free( listeners );
+			return 0;
+		}
+	}
+
+	// Start the worker pool
+	if ( threads < 1 && ( threads = sysconf( _SC_NPROCESSORS_ONLN ) ) < 1 ) {
+		threads = 1;
+	}
+
+	for ( int i = 0; i < threads; i++ ) {
+		pthread_t id;
+		if ( pthread_create( &id, NULL, event_worker, NULL ) != 0 ) {
+			snprintf( p->err, sizeof( p->err ), 
+				"pthread_create unsuccessful: %s\n", strerror( errno ) );
+			fprintf( p->log_fd, "%s", p->err );
+			return 0;
+		}
+		pthread_detach( id );
+	}
+
+	FPRINTF( "Event loop started with %d workers\n", threads );
+
+	// Wait for connections
+	for ( struct timespec tick = {0}, now = {0}; !p->interrupt; ) {
+		int n = epoll_wait( ev.efd, events, EVENT_BATCH, EVENT_TICK );
+
+		if ( n == -1 && errno != EINTR ) {
+			snprintf( p->err, sizeof( p->err ), "epoll_wait() failed: %s\n", strerror( errno ) );
+			fprintf( p->log_fd, "%s", p->err );
+			return 0;
+		}
+
+		for ( int i = 0; i < n; i++ ) {
+			evconn_t *c = (evconn_t *)events[ i ].data.ptr;
+
+			// New connections are waiting on one of the listeners
+			if ( c->listener ) {
+				if ( !event_accept( c->listener ) ) {
+					return 0;
+				}
+				continue;
+			}
+
+			pthread_mutex_lock( &ev.plock );
+			c->parked = 0;
+			pthread_mutex_unlock( &ev.plock );
+			event_queue( c );
+		}
+
+		// Look for connections that have stalled
+		clock_gettime( CLOCK_REALTIME, &now );
+		if ( time_diff_sec( &tick, &now ) >= 1 ) {
+			event_reap( p );
+			tick = now;
+		}
+	}
+
+	return 1;
+}
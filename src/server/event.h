@@ -0,0 +1,17 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "server.h"
+#include "../config.h"
+#include "../logging/log.h"
+
+#ifndef SRCSRV_EVENT_H
+#define SRCSRV_EVENT_H
+
+int srv_event ( server_t * );
+
+#endif
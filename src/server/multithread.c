@@ -15,6 +15,7 @@ static void init_conn_after_accept( server_t *p, conn_t *conn ) {
 	conn->data = NULL;
 	conn->stage = CONN_DORMANT;
 	conn->retry = 0;
+	conn->pipelen = 0;
 }
 
 
@@ -170,6 +171,7 @@ int srv_multithread( server_t *p ) {
 		struct sockaddr_storage addrinfo = { 0 };
 		//struct threadinfo_t *f = NULL; 
 		conn_t *f = NULL;
+		server_t *l = NULL;
 		socklen_t addrlen = sizeof( addrinfo );
 
 		//FPRINTF( "CONNSTATECTION COUNT SO FAR: %d out of %d\n", count, MAX_THREADS );
@@ -248,12 +250,15 @@ int srv_multithread( server_t *p ) {
 		// Accept a new connection	
 		if ( f ) {
 			FPRINTF( "Waiting to accept...\n" );
-			if ( ( f->fd = accept( p->fd, (struct sockaddr *)&addrinfo, &addrlen ) ) == -1 ) {
-				//TODO: Need to check if the socket was non-blocking or not...
-				if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
-					//This should just try to read again
-					snprintf( p->err, sizeof( p->err ), "Try accept again: %s\n", strerror( errno ) );
-					fprintf( p->log_fd, "%s\n", p->err );
+			if ( !( l = srv_listener( p ) ) ) {
+				snprintf( p->err, sizeof( p->err ), "poll() failed: %s\n", strerror( errno ) );
+				fprintf( p->log_fd, "%s", p->err );
+				return 0;
+			}
+
+			if ( ( f->fd = accept( l->fd, (struct sockaddr *)&addrinfo, &addrlen ) ) == -1 ) {
+				if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED ) {
+					//Another thread or worker got there first, so just wait again
 					continue;
 				}
 				else if ( errno == EMFILE || errno == ENFILE ) { 
@@ -280,14 +285,14 @@ int srv_multithread( server_t *p ) {
 			// Only go here if we successfully accepted
 			if ( f->fd > -1 ) {
 				//We have a valid connection, so start here
-				init_conn_after_accept( p, f );		
+				init_conn_after_accept( l, f );		
 				start_timer_per_thread( f ); 
 
 				//Log an access message including the IP in either ipv6 or v4
 				if ( addrinfo.ss_family == AF_INET )
 					inet_ntop( AF_INET, &((struct sockaddr_in *)&addrinfo)->sin_addr, f->ipv4, sizeof( f->ipv4 ) ); 
 				else {
-					//inet_ntop( AF_INET6, &((struct sockaddr_in6 *)&addrinfo)->sin6_addr, ip, sizeof( ip ) ); 
+					memcpy( f->ipv6, &((struct sockaddr_in6 *)&addrinfo)->sin6_addr, sizeof( f->ipv6 ) );
 				}
 
 				//Increment both the index and the conncount here
@@ -29,6 +29,8 @@
  * - 
  * -------------------------------------------------------- */
 #include "server.h"
+#include "../filters/filter-static.h"
+#include "../filters/filter-cache.h"
 
 
 
@@ -91,7 +93,8 @@ static const int srv_proc( const server_t *p, conn_t *conn ) {
 	// Define
 	zTable *t = NULL;
 	filter_t *filter = NULL;
-	int count = conn->count;	
+	struct cfill_t cf;
+	int count = conn->count, ok = 0;
 
 	// Make it ready for write
 	conn->stage = CONN_WRITE;
@@ -103,12 +106,29 @@ static const int srv_proc( const server_t *p, conn_t *conn ) {
 		return http_set_error( conn->res, 400, conn->err );
 	}
 
-	if ( !( conn->config = find_host( p->config->hosts, conn->req->host ) ) ) {
+	if ( !( conn->config = find_host( p->config, conn->req->host ) ) ) {
 		snprintf( conn->err, sizeof( conn->err ), 
 			"Could not find host '%s'.", conn->req->host );
 		return http_set_error( conn->res, 404, conn->err ); 
 	}
 
+	// Relative directories are resolved here, before anything reads from them
+	if ( conn->config->dir && !srv_check_dir( p, conn ) ) {
+		return http_set_error( conn->res, 500, conn->err ); 
+	}
+
+	// Responses that are already cached never reach the filter
+	if ( filter_cache_serve( p, conn, &cf ) ) {
+		conn->count = count;
+		return 1;
+	}
+
+	// Static paths are answered from disk without running the filter
+	if ( filter_static_prefix( p, conn ) ) {
+		conn->count = count;
+		return 1;
+	}
+
 	// TODO: Move this to pre or even better yet to server checks
 	if ( !conn->config->filter ) {
 		snprintf( conn->err, sizeof( conn->err ), 
@@ -123,12 +143,10 @@ static const int srv_proc( const server_t *p, conn_t *conn ) {
 		return http_set_error( conn->res, 500, conn->err ); 
 	}
 
-	if ( conn->config->dir && !srv_check_dir( p, conn ) ) {
-		return http_set_error( conn->res, 500, conn->err ); 
-	}
- 
 	//Finally, now we can evalute the filter and the route.
-	if ( !filter->filter( p, conn ) ) {
+	ok = filter->filter( p, conn );
+	filter_cache_store( conn, &cf );
+	if ( !ok ) {
 		// What kinds of fatal errors could happen here?
 		return 0;
 	}
@@ -166,60 +184,206 @@ static const int srv_log( const server_t *p, conn_t *conn ) {
 
 
 
-// Generate a response
-int srv_response ( server_t *p, conn_t *conn ) {
-	FPRINTF( "Server connection started...\n" );
+// Reset a persistent connection so that it can read the next request
+static int srv_keepalive ( server_t *p, conn_t *conn ) {
 
-	//Define
-	const protocol_t *sr = p->ctx;
-	conn->stage = CONN_INIT;
+	// Define
+	unsigned char pipe[ ZHTTP_PREAMBLE_SIZE ];
+	int pipelen = conn->pipelen;
 
-#if 0
-	zhttp_t rq = {0}, rs = {0};
-	conn->req = &rq;
-	conn->res = &rs;
+	if ( !conn->req || !conn->res || !conn->res->keepalive || p->interrupt ) {
+		return 0;
+	}
+
+	// Save whatever the client pipelined before the bodies are cleared
+	if ( pipelen > 0 ) {
+		memcpy( pipe, conn->req->preamble + conn->pipepos, pipelen );
+	}
+
+	// Reuse the same structures for the next request
+	http_free_body( conn->req ), http_free_body( conn->res );
+	memset( conn->req, 0, sizeof( zhttp_t ) );
+	memset( conn->res, 0, sizeof( zhttp_t ) );
 	conn->req->type = ZHTTP_IS_CLIENT;
 	conn->res->type = ZHTTP_IS_SERVER;
-#endif
 
-	FPRINTF( "Setting pre data for protocol %s.\n", p->ctx->name );
-	if ( !sr->pre( p, conn ) ) {
-		FPRINTF( "(%s)->pre failure: %s\n", p->ctx->name, conn->err );
-		return 0;
+	if ( pipelen > 0 ) {
+		memcpy( conn->req->preamble, pipe, pipelen );
 	}
 
-	FPRINTF( "Got pre data: %p...\n", p->data );
-	FPRINTF( "Running conn->ctx->read()\n" );
-	if ( !sr->read( p, conn ) ) {
-		FPRINTF( "(%s)->read failure: %s\n", p->ctx->name, conn->err );
-		//Log what happened
-		//sr->post( p, conn );	
+	conn->count++;
+	conn->stage = CONN_READ;
+	FPRINTF( "Keeping connection on fd %d open (%d requests so far)\n", conn->fd, conn->count );
+	return 1;
+}
+
+
+
+// Block until a socket is ready, returns 0 once the time is up and -1 on error
+int srv_wait ( int fd, short events, const struct timespec *start, int timeout ) {
+
+	// Define
+	struct pollfd pfd = { .fd = fd, .events = events };
+	struct timespec now = {0};
+	long long left = 0;
+
+	for ( ;; ) {
+		clock_gettime( CLOCK_REALTIME, &now );
+		left = ( start->tv_sec + timeout - now.tv_sec ) * 1000LL 
+			+ ( start->tv_nsec - now.tv_nsec ) / 1000000;
+		if ( left <= 0 ) {
+			return 0;
+		}
+
+		// Hangups and errors count as ready, the next read or write will report them
+		switch ( poll( &pfd, 1, left ) ) {
+			case -1:
+				if ( errno == EINTR ) {
+					continue;
+				}
+				return -1;
+			case 0:
+				return 0;
+			default:
+				return 1;
+		}
 	}
+}
+
 
-	FPRINTF( "Running srv_proc()\n" );
-	if ( conn->stage == CONN_PROC && !srv_proc( p, conn ) ) {
-		FPRINTF( "(%s)->proc failure: %s\n", p->ctx->name, conn->err );
-		//Log what happened, but don't stop
+
+// Block until one of a server's listeners has a connection waiting
+server_t * srv_listener ( server_t *p ) {
+
+	// Define
+	static int turn = 0;
+	struct pollfd pfd[ SERVER_MAX_LISTENERS ];
+	server_t *set[ SERVER_MAX_LISTENERS ];
+	int n = 0;
+
+	// Listeners don't block, so even a lone one has to be waited on here
+	for ( server_t *s = p; s && n < SERVER_MAX_LISTENERS; s = s->next, n++ ) {
+		pfd[ n ].fd = s->fd, pfd[ n ].events = POLLIN, pfd[ n ].revents = 0;
+		set[ n ] = s;
 	}
 
-	FPRINTF( "Running conn->ctx->write()\n" );
-	if ( conn->stage == CONN_WRITE && !sr->write( p, conn ) ) {
-		FPRINTF( "(%s)->write failure: %s\n", p->ctx->name, conn->err );
-		//Log what happened, but don't stop
+	if ( poll( pfd, n, -1 ) == -1 ) {
+		return NULL;
 	}
 
-	FPRINTF( "Running srv_log\n" );
-	if ( !srv_log( p, conn ) ) {
-		//Log what happened, but don't stop
-		FPRINTF( "(%s)->log failure: %s\n", p->ctx->name, conn->err );
+	// Take turns so that a busy listener can't starve the others
+	turn = ( turn + 1 ) % n;
+	for ( int i = 0, j = turn; i < n; i++, j = ( j + 1 ) % n ) {
+		if ( pfd[ j ].revents ) {
+			return set[ j ];
+		}
 	}
 
-	// Logging from here makes the most sense.
-	FPRINTF( "Running conn->ctx->post()\n" );
-	sr->post( p, conn );
+	return NULL;
+}
+
+
+
+// Run the current stage of a connection and move it to the next one
+int srv_step ( server_t *p, conn_t *conn ) {
+
+	//Define
+	const protocol_t *sr = p->ctx;
+	short wait = conn->wait;
+
+	// Whatever a stage stopped for has happened by now
+	conn->wait = 0;
+
+	switch ( conn->stage ) {
+		case CONN_DORMANT:
+		case CONN_INIT:
+		case CONN_PRE:
+			// Only a pre that stopped to wait on the socket can be picked back up
+			if ( conn->stage == CONN_PRE && !wait ) {
+				conn->stage = CONN_DESTROY;
+				return 0;
+			}
+			FPRINTF( "Setting pre data for protocol %s.\n", p->ctx->name );
+			conn->stage = CONN_PRE;
+			if ( !sr->pre( p, conn ) ) {
+				FPRINTF( "(%s)->pre failure: %s\n", p->ctx->name, conn->err );
+				conn->stage = CONN_DESTROY;
+				return 0;
+			}
+			FPRINTF( "Got pre data: %p...\n", p->data );
+			if ( conn->stage == CONN_PRE && !conn->wait ) {
+				conn->stage = CONN_READ;
+			}
+			break;
+
+		case CONN_READ:
+			FPRINTF( "Running conn->ctx->read()\n" );
+			if ( !sr->read( p, conn ) ) {
+				FPRINTF( "(%s)->read failure: %s\n", p->ctx->name, conn->err );
+			}
+			break;
+
+		case CONN_PROC:
+			// Decide now, since the response headers are finalized by the filter
+			conn->res->keepalive = conn->req->keepalive && !p->interrupt 
+				&& ( conn->count + 1 ) < p->max_requests;
+			FPRINTF( "Running srv_proc()\n" );
+			if ( !srv_proc( p, conn ) ) {
+				FPRINTF( "(%s)->proc failure: %s\n", p->ctx->name, conn->err );
+				//Log what happened, but don't stop
+			}
+			break;
+
+		case CONN_WRITE:
+			FPRINTF( "Running conn->ctx->write()\n" );
+			if ( !sr->write( p, conn ) ) {
+				FPRINTF( "(%s)->write failure: %s\n", p->ctx->name, conn->err );
+				conn->res->keepalive = 0;
+				//Log what happened, but don't stop
+			}
+			break;
+
+		case CONN_POST:
+			FPRINTF( "Running srv_log\n" );
+			if ( !srv_log( p, conn ) ) {
+				//Log what happened, but don't stop
+				FPRINTF( "(%s)->log failure: %s\n", p->ctx->name, conn->err );
+			}
+
+			// Go back to reading if the client asked to stay connected
+			if ( srv_keepalive( p, conn ) ) {
+				break;
+			}
+
+			// Logging from here makes the most sense.
+			FPRINTF( "Running conn->ctx->post()\n" );
+			sr->post( p, conn );
+			conn->stage = CONN_DESTROY;
+			break;
+
+		case CONN_DESTROY:
+			break;
+	}
 
-	FPRINTF( "Server connection done...\n" );
 	return 1;
 }
 
 
+
+// Generate a response
+int srv_response ( server_t *p, conn_t *conn ) {
+	FPRINTF( "Server connection started...\n" );
+
+	//Define
+	conn->stage = CONN_INIT;
+
+	// Blocking models simply run each stage back to back
+	while ( conn->stage != CONN_DESTROY ) {
+		if ( !srv_step( p, conn ) ) {
+			return 0;
+		}
+	}
+
+	FPRINTF( "Server connection done...\n" );
+	return 1;
+}
\ No newline at end of file
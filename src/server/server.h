@@ -21,6 +21,7 @@
 #include <ztable.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #include "../lua.h"
 #include "../util.h"
 #include "../configs.h"
@@ -33,6 +34,8 @@
 #define SERVER_EBUFLEN 128 
 #define CONNECTION_EBUFLEN 128 
 
+#define SERVER_MAX_LISTENERS 8
+
 #if 0
 struct cdata;
 //filter_t;
@@ -125,6 +128,9 @@ typedef struct server_t {
 	// This does make sense to be here...
 	struct protocol_t *ctx;
 
+	// The next listener served by this process, which shares this one's config
+	struct server_t *next;
+
 	// Catch an interrupt
 	unsigned short int interrupt;
 
@@ -140,9 +146,21 @@ typedef struct server_t {
 	// Handshake timeout
 	unsigned short int tls_handshake_timeout;
 
+	// Idle timeout between requests on a persistent connection
+	unsigned short int ktimeout;
+
+	// Requests allowed per persistent connection (0 disables keep-alive)
+	unsigned short int max_requests;
+
 	// Total conncount
 	int conncount;
 
+	// Number of worker threads (event model)
+	unsigned short int threads;
+
+	// Can a read between requests hand the connection back to an event loop?
+	unsigned short int yield;
+
 	// 
 	char err[ 128 ];
 
@@ -166,11 +184,24 @@ typedef struct conn_t {
 	// Keep track of retries (128 is more than enough)
 	int retry;
 
+	// Bytes pipelined behind the current request and where they start
+	int pipelen;
+	int pipepos;
+
 	// The status of the actual connection 
 	connstatus_t running;
 
 	// The stage of processing of said connection
 	connstage_t stage;
+
+	// Which way the socket must be ready before a stage that stopped can go on
+	short wait;
+
+	// How far a stage that stopped to wait had gotten (bytes moved, or a streamed body's header length)
+	int progress;
+
+	// A streamed body that stopped to wait
+	void *stream;
 #else
 	// None of these will exceed 128, so we're safe to use 
 	// chars or even bitfields
@@ -249,5 +280,15 @@ typedef struct protocol_t {
 } protocol_t;
 
 
+// A read or write stage that returns with conn->stage unchanged is
+// waiting on the socket, and can be resumed by calling srv_step again
+int srv_step ( server_t *, conn_t * );
+
 int srv_response ( server_t *, conn_t * );
+
+// Wait for a socket to become ready, for at most timeout seconds past start
+int srv_wait ( int, short, const struct timespec *, int );
+
+// Block until one of a server's listeners has a connection waiting, and return that listener
+server_t * srv_listener ( server_t * );
 #endif 
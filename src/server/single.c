@@ -6,6 +6,7 @@ int srv_single ( server_t *p ) {
 		char ip[ 128 ] = { 0 };
 		struct sockaddr_storage addrinfo = { 0 };
 		socklen_t addrlen = sizeof( addrinfo );
+		server_t *l = NULL;
 
 
 		// Create a structure for connection info 
@@ -18,13 +19,18 @@ int srv_single ( server_t *p ) {
 		//conn.end = 0;
 
 
+		//Wait on whichever listener gets a connection first
+		if ( !( l = srv_listener( p ) ) ) {
+			snprintf( p->err, sizeof( p->err ), "poll() failed: %s\n", strerror( errno ) );
+			fprintf( p->log_fd, "%s", p->err );
+			return 0;
+		}
+
 		//Accept a new connection	
-		if ( ( conn.fd = accept( p->fd, (struct sockaddr *)&addrinfo, &addrlen ) ) == -1 ) {
-			//TODO: Need to check if the socket was non-blocking or not...
-			if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
-				//This should just try to read again
-				snprintf( p->err, sizeof( p->err ), "Try accept again: %s\n", strerror( errno ) );
-				continue;	
+		if ( ( conn.fd = accept( l->fd, (struct sockaddr *)&addrinfo, &addrlen ) ) == -1 ) {
+			if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED ) {
+				//The connection went away before it could be taken, so just wait again
+				continue;
 			}
 			else if ( errno == EMFILE || errno == ENFILE ) { 
 				//These both refer to open file limits
@@ -55,7 +61,7 @@ int srv_single ( server_t *p ) {
 		}
 
 		// Go ahead and service it
-		if ( !srv_response( p, &conn ) ) {
+		if ( !srv_response( l, &conn ) ) {
 			FPRINTF( "I'm so lost... \n" );
 		}
 
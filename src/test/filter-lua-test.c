@@ -0,0 +1,58 @@
+#include "../filters/filter-lua.c"
+
+#define TESTDIR "tests/filter-lua/"
+
+#define TPRINTF(...) \
+	fprintf( stderr, __VA_ARGS__ )
+
+//Each run bumps a global, library fields at a few depths and the string metatable
+const char request[] =
+	"counter = ( counter or 0 ) + 1\n"
+	"string.evil = ( string.evil or 0 ) + 1\n"
+	"table.deep = table.deep or { n = 0 }\n"
+	"table.deep.n = table.deep.n + 1\n"
+	"getmetatable( '' ).__evil = ( getmetatable( '' ).__evil or 0 ) + 1\n"
+	"package.loaded.evil = ( package.loaded.evil or 0 ) + 1\n"
+	"math.pi = 3\n"
+	"return counter + string.evil + table.deep.n + getmetatable( '' ).__evil + package.loaded.evil\n"
+;
+
+//A state that was reset should look like one that was never used
+const char check[] =
+	"return counter == nil and string.evil == nil and table.deep == nil and "
+	"getmetatable( '' ).__evil == nil and package.loaded.evil == nil and math.pi > 3\n"
+;
+
+
+int main ( int argc, char *argv[] ) {
+	struct luadata_t l = { 0 };
+	struct lstate_t *ls = NULL;
+	int status = 0;
+
+	snprintf( (char *)l.root, sizeof( l.root ), "%s", TESTDIR "pool" );
+	if ( !( ls = lstate_create( &l ) ) ) {
+		TPRINTF( "Failed to create Lua state: %s\n", l.err );
+		return 1;
+	}
+
+	for ( int i = 1; i <= 3; i++ ) {
+		int count = 0, clean = 0;
+		if ( luaL_dostring( ls->state, request ) != LUA_OK ) {
+			TPRINTF( "Request %d failed: %s\n", i, lua_tostring( ls->state, -1 ) );
+			status = 1;
+			break;
+		}
+		count = lua_tointeger( ls->state, -1 );
+		lstate_reset( ls );
+
+		luaL_dostring( ls->state, check );
+		clean = lua_toboolean( ls->state, -1 );
+		lua_settop( ls->state, 0 );
+
+		TPRINTF( "[ Test: request %d ]: %s (%d)\n", i, ( count == 5 && clean ) ? "SUCCEEDED" : "FAILED", count );
+		status |= ( count != 5 || !clean );
+	}
+
+	lstate_free( ls );
+	return status;
+}
@@ -0,0 +1,77 @@
+//Compile me with:
+//gcc -Iinclude -Ivendor -o json-test src/test/json-test.c src/lua.o src/util.o vendor/*.o lib/liblua.a -ldl -lpthread -lm -lsqlite3 -lgnutls && ./json-test
+#include <time.h>
+#include "../lua.h"
+#include "../util.h"
+
+#define TESTDIR "tests/json/"
+
+#define ROUNDS 100
+
+//Each of these should decode, then encode back to exactly the same text
+const char *roundtrips[] = {
+	"[1,2.5,\"x\xc3\xa9\",true,null,{\"b\":{}}]",
+	"[null]",
+	"[null,null,3]",
+	"{\"a\":[1,null]}",
+	NULL
+};
+
+//Files to time decoding on
+const char *files[] = {
+	TESTDIR "lil.json",
+	TESTDIR "singles.json",
+	TESTDIR "twitter.json",
+	NULL
+};
+
+
+int main ( int argc, char *argv[] ) {
+	char err[ 2048 ] = { 0 };
+	lua_State *L = luaL_newstate();
+	int failed = 0;
+
+	for ( const char **r = roundtrips; *r; r++ ) {
+		struct xbuf out = { 0 };
+		if ( !json_to_lua( L, *r, strlen( *r ), err, sizeof( err ) ) || !lua_to_json( L, -1, &out, err, sizeof( err ) ) ) {
+			fprintf( stderr, "FAIL %s: %s\n", *r, err );
+			failed++;
+		}
+		else if ( out.len != strlen( *r ) || memcmp( out.ptr, *r, out.len ) ) {
+			fprintf( stderr, "FAIL %s: got %.*s\n", *r, out.len, (char *)out.ptr );
+			failed++;
+		}
+		free( out.ptr );
+		lua_settop( L, 0 );
+	}
+
+	for ( const char **f = files; *f; f++ ) {
+		struct timespec start = { 0 }, end = { 0 };
+		unsigned char *src = NULL;
+		int len = 0;
+
+		if ( !( src = read_file( *f, &len, err, sizeof( err ) ) ) ) {
+			fprintf( stderr, "FAIL %s: %s\n", *f, err );
+			failed++;
+			continue;
+		}
+
+		clock_gettime( CLOCK_MONOTONIC, &start );
+		for ( int i = 0; i < ROUNDS; i++ ) {
+			if ( !json_to_lua( L, (char *)src, len, err, sizeof( err ) ) ) {
+				fprintf( stderr, "FAIL %s: %s\n", *f, err );
+				failed++;
+				break;
+			}
+			lua_settop( L, 0 );
+		}
+		clock_gettime( CLOCK_MONOTONIC, &end );
+
+		fprintf( stderr, "%s (%d bytes): %.1fus per decode\n", *f, len,
+			( ( end.tv_sec - start.tv_sec ) * 1e9 + ( end.tv_nsec - start.tv_nsec ) ) / 1e3 / ROUNDS );
+		free( src );
+	}
+
+	lua_close( L );
+	return failed > 0;
+}
@@ -0,0 +1,7 @@
+return {
+	db = "none",
+	fqdn = "pool.local",
+	routes = {
+		["/"] = { model="pool" },
+	}
+}